@@ -0,0 +1,436 @@
+#include "esp_sim/rom_simulator.hpp"
+#include <boost/program_options.hpp>
+#include <cmath>
+#include <csignal>
+#include <filesystem>
+#include <fmt/ranges.h>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <spawn.h>
+#include <spdlog/spdlog.h>
+#include <sstream>
+#include <sys/wait.h>
+
+#ifndef ESP_FLASH_PATH
+#define ESP_FLASH_PATH "esp-flash"
+#endif
+
+extern char** environ;  // NOLINT
+
+namespace {
+
+using Clock        = std::chrono::steady_clock;
+using FloatSecond  = std::chrono::duration<double>;
+using FloatMilli   = std::chrono::duration<double, std::milli>;
+using Milliseconds = std::vector<double>;
+
+constexpr std::uint8_t FLASH_BEGIN      = 0x02;
+constexpr std::uint8_t FLASH_DATA       = 0x03;
+constexpr std::uint8_t FLASH_DEFL_BEGIN = 0x10;
+constexpr std::uint8_t FLASH_DEFL_DATA  = 0x11;
+
+struct BenchOption {
+  std::filesystem::path esp_flash_;
+  std::vector<std::string> extra_args_;
+  std::size_t repeat_ = 3;
+  std::chrono::microseconds turnaround_{0};
+  std::chrono::microseconds erase_time_{0};
+  std::chrono::seconds run_timeout_{0};
+  bool verbose_ = false;
+};
+
+/**
+ * @brief One point of the sweep, every point is flashed BenchOption::repeat_ times
+ */
+struct Config {
+  std::uint32_t image_size_ = 0;
+  double compressibility_   = 0.0;  // fraction of image that is zero-filled, the rest is random
+  std::uint32_t block_size_ = 0;
+  std::uint32_t baud_       = 0;
+  std::size_t window_       = 0;
+
+  [[nodiscard]] std::string key() const {
+    return fmt::format("{},{:.2f},{},{},{}", this->image_size_, this->compressibility_, this->block_size_, this->baud_,
+                       this->window_);
+  }
+};
+
+/**
+ * @brief Timing of one flash session, taken from process start and exit, and from the trace of simulator
+ */
+struct RunResult {
+  bool ok_               = false;
+  double total_s_        = 0.0;  // process start to exit, including reset and connection
+  double transfer_s_     = 0.0;  // first data packet received to last data packet acknowledged
+  double first_write_ms_ = 0.0;  // process start to first data packet received
+  double erase_ms_       = 0.0;  // time spent in FLASH_BEGIN and FLASH_DEFL_BEGIN
+  Milliseconds ack_ms_{};        // data packet received to acknowledged
+  Milliseconds interval_ms_{};   // between consecutive acknowledgements of data packets
+};
+
+struct Summary {
+  Config config_;
+  std::size_t runs_            = 0;
+  std::size_t failures_        = 0;
+  double total_s_p50_          = 0.0;
+  double throughput_kib_s_p50_ = 0.0;  // image size over total time
+  double throughput_kib_s_min_ = 0.0;
+  double transfer_kib_s_p50_   = 0.0;  // image size over transfer time
+  double first_write_ms_p50_   = 0.0;
+  double erase_ms_p50_         = 0.0;
+  std::array<double, 3> ack_ms_{};       // p50, p90, p99
+  std::array<double, 2> interval_ms_{};  // p50, p99
+};
+
+constexpr std::string_view CSV_HEADER =
+  "image_size,compressibility,block_size,baud,window,runs,failures,total_s_p50,throughput_kib_s_p50,"
+  "throughput_kib_s_min,transfer_kib_s_p50,first_write_ms_p50,erase_ms_p50,ack_ms_p50,ack_ms_p90,ack_ms_p99,"
+  "ack_interval_ms_p50,ack_interval_ms_p99";
+
+/**
+ * @brief Nearest-rank percentile, 0 if t_values is empty
+ */
+double percentile(Milliseconds t_values, double const t_percent) {
+  if (t_values.empty()) {
+    return 0.0;
+  }
+
+  auto const rank = static_cast<std::size_t>(std::ceil(t_percent / 100.0 * static_cast<double>(t_values.size())));
+  auto const idx  = std::clamp<std::size_t>(rank, 1, t_values.size()) - 1;
+  auto const nth  = t_values.begin() + static_cast<std::ptrdiff_t>(idx);
+  std::nth_element(t_values.begin(), nth, t_values.end());
+  return *nth;
+}
+
+/**
+ * @brief This function generates an image whose 256 byte chunks are either zero-filled, with probability
+ *        t_compressibility, or random, so that zlib shrinks it to roughly 1 - t_compressibility of its size
+ */
+std::vector<char> make_image(std::uint32_t const t_size, double const t_compressibility) {
+  constexpr std::size_t CHUNK_SIZE = 256;
+  std::mt19937 gen{t_size};
+  std::bernoulli_distribution zero_filled{t_compressibility};
+  std::uniform_int_distribution<int> byte_dist{0, UINT8_MAX};
+
+  std::vector<char> image(t_size);
+  for (std::size_t offset = 0; offset < image.size(); offset += CHUNK_SIZE) {
+    auto const chunk_end = image.begin() + static_cast<std::ptrdiff_t>(std::min(offset + CHUNK_SIZE, image.size()));
+    if (not zero_filled(gen)) {
+      std::generate(image.begin() + static_cast<std::ptrdiff_t>(offset), chunk_end,
+                    [&] { return static_cast<char>(byte_dist(gen)); });
+    }
+  }
+
+  return image;
+}
+
+/**
+ * @brief This function runs t_args as a child process and waits for it, the child is killed after t_timeout
+ *
+ * @return Whether the child exited with EXIT_SUCCESS
+ */
+bool run_process(std::vector<std::string> const& t_args, bool const t_verbose, std::chrono::seconds const t_timeout) {
+  std::vector<char*> argv;
+  for (auto const& arg : t_args) {
+    argv.push_back(const_cast<char*>(arg.c_str()));  // NOLINT(cppcoreguidelines-pro-type-const-cast)
+  }
+  argv.push_back(nullptr);
+
+  posix_spawn_file_actions_t actions{};
+  posix_spawn_file_actions_init(&actions);
+  if (not t_verbose) {
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+  }
+
+  pid_t pid          = 0;
+  auto const spawned = posix_spawn(&pid, argv.front(), &actions, nullptr, argv.data(), environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (spawned != 0) {
+    throw std::system_error(spawned, std::generic_category(), fmt::format("Failed to run {}", t_args.front()));
+  }
+
+  auto const deadline = Clock::now() + t_timeout;
+  int status          = 0;
+  while (waitpid(pid, &status, t_timeout.count() == 0 ? 0 : WNOHANG) == 0) {
+    if (Clock::now() > deadline) {
+      spdlog::warn("{} is still running after {} s, killed", t_args.front(), t_timeout.count());
+      kill(pid, SIGKILL);
+      waitpid(pid, &status, 0);
+      return false;
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds{10});
+  }
+
+  return WIFEXITED(status) and WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+RunResult run_once(Config const& t_config, BenchOption const& t_option, std::filesystem::path const& t_image) {
+  constexpr std::chrono::nanoseconds BYTE_TIME_AT_ONE_BAUD = std::chrono::seconds{10};  // 8N1
+
+  esplink::sim::SimulatorOption const sim_option{
+    .byte_latency_ = BYTE_TIME_AT_ONE_BAUD / t_config.baud_,
+    .turnaround_   = t_option.turnaround_,
+    .erase_time_   = t_option.erase_time_,
+  };
+  esplink::sim::RomSimulator simulator{sim_option};
+
+  std::vector<std::string> args{t_option.esp_flash_.string(), t_image.string(), "--port", simulator.port(),
+                                "--offset", "0", "--baud", std::to_string(t_config.baud_), "--window",
+                                std::to_string(t_config.window_)};
+  if (t_config.block_size_ != 0) {
+    args.insert(args.end(), {"--block-size", std::to_string(t_config.block_size_)});
+  }
+  args.insert(args.end(), t_option.extra_args_.begin(), t_option.extra_args_.end());
+
+  RunResult result;
+  auto const start = Clock::now();
+  result.ok_       = run_process(args, t_option.verbose_, t_option.run_timeout_);
+  result.total_s_  = FloatSecond(Clock::now() - start).count();
+
+  std::optional<Clock::time_point> first_data;
+  std::optional<Clock::time_point> last_ack;
+  for (auto const& record : simulator.trace()) {
+    if (not record.replied_.has_value()) {
+      continue;
+    }
+
+    if (record.command_ == FLASH_BEGIN or record.command_ == FLASH_DEFL_BEGIN) {
+      result.erase_ms_ += FloatMilli(*record.replied_ - record.received_).count();
+    } else if (record.command_ == FLASH_DATA or record.command_ == FLASH_DEFL_DATA) {
+      first_data = first_data.value_or(record.received_);
+      if (last_ack.has_value()) {
+        result.interval_ms_.push_back(FloatMilli(*record.replied_ - *last_ack).count());
+      }
+      result.ack_ms_.push_back(FloatMilli(*record.replied_ - record.received_).count());
+      last_ack = record.replied_;
+    }
+  }
+
+  if (first_data.has_value()) {
+    result.first_write_ms_ = FloatMilli(*first_data - start).count();
+    result.transfer_s_     = FloatSecond(*last_ack - *first_data).count();
+  }
+
+  return result;
+}
+
+Summary summarize(Config const& t_config, std::vector<RunResult> const& t_results) {
+  Summary summary{.config_ = t_config, .runs_ = t_results.size()};
+
+  Milliseconds total;
+  Milliseconds throughput;
+  Milliseconds transfer;
+  Milliseconds first_write;
+  Milliseconds erase;
+  Milliseconds ack;
+  Milliseconds interval;
+  auto const kib = t_config.image_size_ / 1024.0;
+  for (auto const& result : t_results) {
+    if (not result.ok_) {
+      ++summary.failures_;
+      continue;
+    }
+
+    total.push_back(result.total_s_);
+    throughput.push_back(kib / result.total_s_);
+    transfer.push_back(result.transfer_s_ > 0.0 ? kib / result.transfer_s_ : 0.0);
+    first_write.push_back(result.first_write_ms_);
+    erase.push_back(result.erase_ms_);
+    ack.insert(ack.end(), result.ack_ms_.begin(), result.ack_ms_.end());
+    interval.insert(interval.end(), result.interval_ms_.begin(), result.interval_ms_.end());
+  }
+
+  summary.total_s_p50_          = percentile(total, 50);
+  summary.throughput_kib_s_p50_ = percentile(throughput, 50);
+  summary.throughput_kib_s_min_ = throughput.empty() ? 0.0 : *std::min_element(throughput.begin(), throughput.end());
+  summary.transfer_kib_s_p50_   = percentile(transfer, 50);
+  summary.first_write_ms_p50_   = percentile(first_write, 50);
+  summary.erase_ms_p50_         = percentile(erase, 50);
+  summary.ack_ms_               = {percentile(ack, 50), percentile(ack, 90), percentile(ack, 99)};
+  summary.interval_ms_          = {percentile(interval, 50), percentile(interval, 99)};
+  return summary;
+}
+
+std::string to_csv_row(Summary const& t_summary) {
+  return fmt::format("{},{},{},{:.3f},{:.1f},{:.1f},{:.1f},{:.1f},{:.1f},{:.3f},{:.3f},{:.3f},{:.3f},{:.3f}",
+                     t_summary.config_.key(), t_summary.runs_, t_summary.failures_, t_summary.total_s_p50_,
+                     t_summary.throughput_kib_s_p50_, t_summary.throughput_kib_s_min_, t_summary.transfer_kib_s_p50_,
+                     t_summary.first_write_ms_p50_, t_summary.erase_ms_p50_, t_summary.ack_ms_[0],
+                     t_summary.ack_ms_[1], t_summary.ack_ms_[2], t_summary.interval_ms_[0], t_summary.interval_ms_[1]);
+}
+
+/**
+ * @brief This function reads throughput_kib_s_p50 of every sweep point from a csv written by --csv
+ *
+ * @return throughput keyed by Config::key()
+ */
+std::map<std::string, double> read_baseline(std::filesystem::path const& t_path) {
+  std::ifstream file(t_path);
+  if (not file) {
+    throw std::runtime_error(fmt::format("Failed to open baseline {}", t_path.string()));
+  }
+
+  constexpr std::size_t KEY_COLUMNS       = 5;
+  constexpr std::size_t THROUGHPUT_COLUMN = 8;
+  std::map<std::string, double> baseline;
+  std::string line;
+  std::getline(file, line);  // header
+  while (std::getline(file, line)) {
+    std::vector<std::string> columns;
+    std::stringstream stream{line};
+    for (std::string column; std::getline(stream, column, ',');) {
+      columns.push_back(column);
+    }
+
+    if (columns.size() <= THROUGHPUT_COLUMN) {
+      continue;
+    }
+
+    auto const key = fmt::format("{}", fmt::join(columns.begin(), columns.begin() + KEY_COLUMNS, ","));
+    baseline[key]  = std::stod(columns[THROUGHPUT_COLUMN]);
+  }
+
+  return baseline;
+}
+
+template <typename T>
+auto list_option(std::vector<T> t_default) {
+  std::vector<std::string> text;
+  for (auto const& value : t_default) {
+    text.push_back(fmt::format("{}", value));
+  }
+
+  return boost::program_options::value<std::vector<T>>()->multitoken()->default_value(
+    std::move(t_default), fmt::format("{}", fmt::join(text, " ")));
+}
+
+}  // namespace
+
+int main(int argc, const char** argv) {
+  using namespace boost::program_options;
+  options_description sweep_options("Sweep, every combination is benchmarked");
+  sweep_options.add_options()                                                                     //
+    ("image-size", list_option<std::uint32_t>({0x10000, 0x40000}), "Image sizes in bytes")        //
+    ("compressibility", list_option<double>({0.0, 0.5, 0.9}), "Fraction of image that is zero")  //
+    ("block-size", list_option<std::uint32_t>({0, 0x400, 0x1000, 0x4000}),
+     "FLASH_DATA block sizes, 0 lets esp-flash adapt block size to the link")  //
+    ("baud", list_option<std::uint32_t>({460800, 921600}), "Baudrates, simulated as wire latency")  //
+    ("window", list_option<std::size_t>({4}), "Numbers of FLASH_DATA packets in flight");
+
+  options_description bench_options("Parameter for benchmark");
+  bench_options.add_options()                                                                          //
+    ("esp-flash", value<std::string>()->default_value(ESP_FLASH_PATH), "esp-flash executable to benchmark")  //
+    ("esp-flash-arg", value<std::vector<std::string>>()->multitoken(),
+     "Additional argument passed to esp-flash, e.g. --esp-flash-arg=--no-compress")  //
+    ("repeat", value<std::size_t>()->default_value(3), "Number of sessions for every sweep point")  //
+    ("turnaround", value<std::int64_t>()->default_value(0), "Simulated response turnaround in microseconds")  //
+    ("erase-time", value<std::int64_t>()->default_value(0),
+     "Simulated erase time of a 4 KiB sector in microseconds")  //
+    ("run-timeout", value<std::int64_t>()->default_value(300),
+     "Seconds after which a session is killed, 0 waits forever")  //
+    ("csv", value<std::string>(), "Write results as csv to this file")  //
+    ("baseline", value<std::string>(), "Csv written by a previous run, to compare throughput with")  //
+    ("tolerance", value<double>()->default_value(0.1),
+     "Fraction by which median throughput may fall below baseline before it counts as regression");
+
+  options_description visible_options("All options");
+  visible_options.add(sweep_options)
+    .add(bench_options)
+    .add_options()                               //
+    ("help", "Show this help message and exit")  //
+    ("verbose", "Show output of esp-flash");
+
+  variables_map vm;
+  store(parse_command_line(argc, argv, visible_options), vm);
+  notify(vm);
+
+  if (vm.count("help") != 0) {
+    std::cout << visible_options << '\n';
+    return EXIT_SUCCESS;
+  }
+
+  BenchOption const option{
+    .esp_flash_   = vm["esp-flash"].as<std::string>(),
+    .extra_args_  = vm.count("esp-flash-arg") != 0 ? vm["esp-flash-arg"].as<std::vector<std::string>>()
+                                                   : std::vector<std::string>{},
+    .repeat_      = std::max<std::size_t>(vm["repeat"].as<std::size_t>(), 1),
+    .turnaround_  = std::chrono::microseconds{vm["turnaround"].as<std::int64_t>()},
+    .erase_time_  = std::chrono::microseconds{vm["erase-time"].as<std::int64_t>()},
+    .run_timeout_ = std::chrono::seconds{vm["run-timeout"].as<std::int64_t>()},
+    .verbose_     = vm.count("verbose") != 0,
+  };
+
+  std::vector<Config> configs;
+  for (auto const image_size : vm["image-size"].as<std::vector<std::uint32_t>>()) {
+    for (auto const compressibility : vm["compressibility"].as<std::vector<double>>()) {
+      for (auto const block_size : vm["block-size"].as<std::vector<std::uint32_t>>()) {
+        for (auto const baud : vm["baud"].as<std::vector<std::uint32_t>>()) {
+          for (auto const window : vm["window"].as<std::vector<std::size_t>>()) {
+            configs.push_back({image_size, compressibility, block_size, baud, window});
+          }
+        }
+      }
+    }
+  }
+
+  auto const image_path =
+    std::filesystem::temp_directory_path() / fmt::format("esp-flash-bench-{}.bin", static_cast<int>(getpid()));
+  std::vector<Summary> summaries;
+  for (auto const& config : configs) {
+    auto const image = make_image(config.image_size_, config.compressibility_);
+    std::ofstream(image_path, std::ios::binary).write(image.data(), static_cast<std::streamsize>(image.size()));
+
+    std::vector<RunResult> results;
+    for (std::size_t i = 0; i < option.repeat_; ++i) {
+      results.push_back(run_once(config, option, image_path));
+    }
+
+    summaries.push_back(summarize(config, results));
+    auto const& summary = summaries.back();
+    spdlog::info("size {:>7} zero {:.2f} block {:>5} baud {:>7} window {:>2}: {:7.1f} KiB/s (transfer {:7.1f} KiB/s), "
+                 "first write {:6.1f} ms, erase {:6.1f} ms, ack p50/p99 {:.2f}/{:.2f} ms, {} failed",
+                 config.image_size_, config.compressibility_, config.block_size_, config.baud_, config.window_,
+                 summary.throughput_kib_s_p50_, summary.transfer_kib_s_p50_, summary.first_write_ms_p50_,
+                 summary.erase_ms_p50_, summary.ack_ms_[0], summary.ack_ms_[2], summary.failures_);
+  }
+  std::filesystem::remove(image_path);
+
+  if (vm.count("csv") != 0) {
+    std::ofstream csv(vm["csv"].as<std::string>());
+    csv << CSV_HEADER << '\n';
+    for (auto const& summary : summaries) {
+      csv << to_csv_row(summary) << '\n';
+    }
+  }
+
+  bool failed = false;
+  for (auto const& summary : summaries) {
+    if (summary.failures_ != 0) {
+      spdlog::error("{}: {} of {} sessions failed", summary.config_.key(), summary.failures_, summary.runs_);
+      failed = true;
+    }
+  }
+
+  if (vm.count("baseline") != 0) {
+    auto const baseline  = read_baseline(vm["baseline"].as<std::string>());
+    auto const tolerance = vm["tolerance"].as<double>();
+    for (auto const& summary : summaries) {
+      auto const iter = baseline.find(summary.config_.key());
+      if (iter == baseline.end()) {
+        continue;
+      }
+
+      if (summary.throughput_kib_s_p50_ < iter->second * (1.0 - tolerance)) {
+        spdlog::error("{}: throughput regressed from {:.1f} KiB/s to {:.1f} KiB/s", summary.config_.key(),
+                      iter->second, summary.throughput_kib_s_p50_);
+        failed = true;
+      }
+    }
+  }
+
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
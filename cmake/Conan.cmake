@@ -14,7 +14,7 @@ macro (run_conan)
     set(B2_OPTIONS "b2:toolset=clang") # pretty f-up thing tbh, needing to specify this kind of nonsense
   endif ()
 
-  conan_cmake_configure(REQUIRES spdlog/1.10.0 fmt/8.1.1 boost/1.79.0 range-v3/0.11.0 GENERATORS cmake_find_package)
+  conan_cmake_configure(REQUIRES spdlog/1.10.0 fmt/8.1.1 boost/1.79.0 range-v3/0.11.0 zlib/1.2.12 GENERATORS cmake_find_package)
   conan_cmake_autodetect(settings BUILD_TYPE ${CMAKE_BUILD_TYPE})
 
   # Forcing compiler and its version to make sure conan builds project dependencies with same compiler
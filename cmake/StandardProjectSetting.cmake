@@ -14,6 +14,10 @@ endif ()
 # Generate compile_commands.json to make it easier to work with clang based tools
 set(CMAKE_EXPORT_COMPILE_COMMANDS ON)
 
+# log calls below this level are compiled out, --verbose can't bring them back
+set(ESPLINK_LOG_LEVEL TRACE CACHE STRING "Lowest log level compiled in")
+set_property(CACHE ESPLINK_LOG_LEVEL PROPERTY STRINGS "TRACE" "DEBUG" "INFO" "WARN" "ERROR")
+
 option(ENABLE_IPO "Enable Interprocedural Optimization, aka Link Time Optimization (LTO)" OFF)
 
 if (ENABLE_IPO)
@@ -0,0 +1,127 @@
+#pragma once
+
+#include "esp_common/constants.hpp"
+#include "esp_common/cpu_dispatch.hpp"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+
+/**
+ * XOR checksum kernels, of esp image and of FLASH_DATA payload. XOR of bytes equals the bytes of XOR of words folded
+ * together, so data is XORed 8 bytes at a time (word), or 16 (SSE2) or 32 (AVX2) bytes at a time, and folded into one
+ * byte at the end. Scalar version serves as reference. xor_checksum() picks the widest kernel the running CPU supports.
+ */
+namespace esplink {
+
+inline std::uint8_t xor_checksum_scalar(std::uint8_t const* t_first, std::uint8_t const* t_last,
+                                        std::uint8_t t_init) noexcept {
+  for (; t_first != t_last; ++t_first) {
+    t_init ^= *t_first;
+  }
+
+  return t_init;
+}
+
+namespace detail {
+
+inline std::uint8_t fold_word(std::uint64_t t_word) noexcept {
+  t_word ^= t_word >> 32U;
+  t_word ^= t_word >> 16U;
+  t_word ^= t_word >> 8U;
+  return static_cast<std::uint8_t>(t_word);
+}
+
+}  // namespace detail
+
+inline std::uint8_t xor_checksum_word(std::uint8_t const* t_first, std::uint8_t const* t_last,
+                                      std::uint8_t const t_init) noexcept {
+  constexpr std::ptrdiff_t STRIDE  = sizeof(std::uint64_t);
+  std::uint64_t check_sum_0        = t_init;
+  std::uint64_t check_sum_1        = 0;
+  auto const load                  = [](std::uint8_t const* t_data) {
+    std::uint64_t word{};
+    std::memcpy(&word, t_data, sizeof(word));  // unaligned load, compiled into a single mov
+    return word;
+  };
+
+  // two XOR chains, so that loads aren't serialized behind one of them
+  for (; t_last - t_first >= 2 * STRIDE; t_first += 2 * STRIDE) {
+    check_sum_0 ^= load(t_first);
+    check_sum_1 ^= load(t_first + STRIDE);
+  }
+  if (t_last - t_first >= STRIDE) {
+    check_sum_0 ^= load(t_first);
+    t_first += STRIDE;
+  }
+
+  auto const folded = detail::fold_word(check_sum_0 ^ check_sum_1);
+  return xor_checksum_scalar(t_first, t_last, folded);
+}
+
+#if ESPLINK_X86_KERNEL
+
+// NOLINTBEGIN(cppcoreguidelines-pro-type-reinterpret-cast)
+__attribute__((target("sse2"))) inline std::uint8_t xor_checksum_sse2(std::uint8_t const* t_first,
+                                                                      std::uint8_t const* t_last,
+                                                                      std::uint8_t const t_init) noexcept {
+  constexpr std::ptrdiff_t STRIDE = sizeof(__m128i);
+  auto check_sum_0                = _mm_setzero_si128();
+  auto check_sum_1                = _mm_setzero_si128();
+
+  for (; t_last - t_first >= 2 * STRIDE; t_first += 2 * STRIDE) {
+    check_sum_0 = _mm_xor_si128(check_sum_0, _mm_loadu_si128(reinterpret_cast<__m128i const*>(t_first)));
+    check_sum_1 = _mm_xor_si128(check_sum_1, _mm_loadu_si128(reinterpret_cast<__m128i const*>(t_first + STRIDE)));
+  }
+
+  std::array<std::uint64_t, 2> lanes{};
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes.data()), _mm_xor_si128(check_sum_0, check_sum_1));
+  auto const folded = detail::fold_word(lanes[0] ^ lanes[1]);
+  return xor_checksum_word(t_first, t_last, static_cast<std::uint8_t>(t_init ^ folded));
+}
+
+__attribute__((target("avx2"))) inline std::uint8_t xor_checksum_avx2(std::uint8_t const* t_first,
+                                                                      std::uint8_t const* t_last,
+                                                                      std::uint8_t const t_init) noexcept {
+  constexpr std::ptrdiff_t STRIDE = sizeof(__m256i);
+  auto check_sum_0                = _mm256_setzero_si256();
+  auto check_sum_1                = _mm256_setzero_si256();
+
+  for (; t_last - t_first >= 2 * STRIDE; t_first += 2 * STRIDE) {
+    check_sum_0 = _mm256_xor_si256(check_sum_0, _mm256_loadu_si256(reinterpret_cast<__m256i const*>(t_first)));
+    check_sum_1 =
+      _mm256_xor_si256(check_sum_1, _mm256_loadu_si256(reinterpret_cast<__m256i const*>(t_first + STRIDE)));
+  }
+
+  std::array<std::uint64_t, 4> lanes{};
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes.data()), _mm256_xor_si256(check_sum_0, check_sum_1));
+  auto const folded = detail::fold_word(lanes[0] ^ lanes[1] ^ lanes[2] ^ lanes[3]);
+  return xor_checksum_sse2(t_first, t_last, static_cast<std::uint8_t>(t_init ^ folded));
+}
+// NOLINTEND(cppcoreguidelines-pro-type-reinterpret-cast)
+
+#endif
+
+inline std::uint8_t xor_checksum(std::uint8_t const* t_first, std::uint8_t const* t_last,
+                                 std::uint8_t const t_init) noexcept {
+#if ESPLINK_X86_KERNEL
+  return has_avx2() ? xor_checksum_avx2(t_first, t_last, t_init) : xor_checksum_sse2(t_first, t_last, t_init);
+#else
+  return xor_checksum_word(t_first, t_last, t_init);
+#endif
+}
+
+/**
+ * @brief This function XORs every byte of t_data into t_init, ESP32_CHECKSUM_MAGIC by default, i.e. checksum of esp
+ *        image segments and of FLASH_DATA payload
+ */
+template <typename Byte>
+  requires(sizeof(Byte) == 1)
+std::uint8_t xor_checksum(std::span<Byte const> const t_data,
+                          std::uint8_t const t_init = ESP32_CHECKSUM_MAGIC) noexcept {
+  auto const* const first = reinterpret_cast<std::uint8_t const*>(t_data.data());  // NOLINT
+  return xor_checksum(first, first + t_data.size(), t_init);
+}
+
+}  // namespace esplink
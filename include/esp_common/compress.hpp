@@ -0,0 +1,61 @@
+#pragma once
+
+#include <concepts>
+#include <span>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <zlib.h>
+
+namespace esplink {
+
+namespace detail {
+
+/**
+ * @brief This function converts size of buffer to the size type of zlib, which is 32 bits wide on some platforms
+ *
+ * @throw std::length_error if t_size doesn't fit in uLong
+ */
+template <std::unsigned_integral Size>
+uLong to_zlib_size(Size const t_size) {
+  if (not std::in_range<uLong>(t_size)) {
+    throw std::length_error("Data is too large for zlib to compress at once");
+  }
+
+  // cast is only needed, and only compiled, where uLong is narrower
+  if constexpr (std::is_same_v<Size, uLong>) {
+    return t_size;
+  } else {
+    return static_cast<uLong>(t_size);
+  }
+}
+
+}  // namespace detail
+
+/**
+ * @brief This function compresses data into a zlib stream (deflate with zlib header and adler32 trailer), which is the
+ *        format esp chips expect in FLASH_DEFL_DATA packets
+ *
+ * @param t_data  Data to compress
+ * @param t_level zlib compression level
+ * @return std::vector<char> compressed stream
+ *
+ * @throw std::length_error if t_data is too large for zlib
+ */
+inline auto zlib_compress(std::span<char const> const t_data, int const t_level = Z_BEST_COMPRESSION) {
+  auto const data_size = detail::to_zlib_size(t_data.size());
+  auto compressed_size = compressBound(data_size);
+  std::vector<char> ret_val(compressed_size);
+
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+  if (compress2(reinterpret_cast<Bytef*>(ret_val.data()), &compressed_size,
+                reinterpret_cast<Bytef const*>(t_data.data()), data_size, t_level) != Z_OK) {
+    throw std::runtime_error("Failed to compress data");
+  }
+
+  ret_val.resize(compressed_size);
+  return ret_val;
+}
+
+}  // namespace esplink
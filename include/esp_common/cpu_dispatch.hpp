@@ -0,0 +1,28 @@
+#pragma once
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ESPLINK_X86_KERNEL 1
+#else
+#define ESPLINK_X86_KERNEL 0
+#endif
+
+/**
+ * CPU dispatch of SIMD kernels. Kernels are compiled for their instruction set with target attribute, whatever the
+ * build targets, and the widest one the running CPU supports is picked at every call.
+ */
+namespace esplink {
+
+/**
+ * @brief This function tells whether the running CPU supports AVX2, the CPU is only asked once
+ */
+inline bool has_avx2() noexcept {
+#if ESPLINK_X86_KERNEL
+  static bool const HAS_AVX2 = __builtin_cpu_supports("avx2") != 0;
+  return HAS_AVX2;
+#else
+  return false;
+#endif
+}
+
+}  // namespace esplink
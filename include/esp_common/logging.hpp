@@ -0,0 +1,74 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <fmt/format.h>
+#include <memory>
+#include <span>
+#include <spdlog/async.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
+#include <spdlog/spdlog.h>
+#include <string>
+
+// Logging on the transfer path goes through SPDLOG_DEBUG and friends, calls below SPDLOG_ACTIVE_LEVEL are compiled out,
+// the rest check the runtime level before evaluating anything but their arguments, which must therefore be cheap.
+
+namespace esplink {
+
+/**
+ * @brief Hex dump of a byte stream, 16 bytes per line, it only views the bytes and is formatted when the message
+ *        carrying it is actually logged
+ */
+struct HexDump {
+  std::span<std::uint8_t const> bytes_;
+  std::size_t offset_ = 0;  // offset printed for the first byte, to continue a previous dump
+};
+
+/**
+ * @brief Logs to the terminal from a background thread for as long as it lives, so that the thread doing serial I/O
+ *        only queues messages. Messages are dropped rather than blocking the caller if the queue is full, and the
+ *        queue is drained before it's destroyed.
+ */
+class AsyncLogging {
+ public:
+  static constexpr std::size_t QUEUE_SIZE = 8192;
+
+  /**
+   * @param t_name Name of default logger
+   * @param t_stderr Log to stderr instead of stdout
+   */
+  explicit AsyncLogging(std::string const& t_name, bool const t_stderr = false) {
+    spdlog::init_thread_pool(QUEUE_SIZE, 1);
+    auto logger = t_stderr ? spdlog::create_async_nb<spdlog::sinks::stderr_color_sink_mt>(t_name)
+                           : spdlog::create_async_nb<spdlog::sinks::stdout_color_sink_mt>(t_name);
+    spdlog::set_default_logger(std::move(logger));
+  }
+
+  AsyncLogging(AsyncLogging const&)            = delete;
+  AsyncLogging(AsyncLogging&&)                 = delete;
+  AsyncLogging& operator=(AsyncLogging const&) = delete;
+  AsyncLogging& operator=(AsyncLogging&&)      = delete;
+
+  ~AsyncLogging() { spdlog::shutdown(); }
+};
+
+}  // namespace esplink
+
+template <>
+struct fmt::formatter<esplink::HexDump> {
+  static constexpr auto parse(format_parse_context& t_ctx) { return t_ctx.begin(); }
+
+  template <typename FormatContext>
+  auto format(esplink::HexDump const& t_dump, FormatContext& t_ctx) const {
+    constexpr std::size_t BYTE_PER_LINE = 16;
+
+    auto out = t_ctx.out();
+    for (std::size_t offset = 0; offset < t_dump.bytes_.size(); offset += BYTE_PER_LINE) {
+      auto const line = t_dump.bytes_.subspan(offset, std::min(BYTE_PER_LINE, t_dump.bytes_.size() - offset));
+      out = fmt::format_to(out, "\n{:04X}  {:02X}", t_dump.offset_ + offset, fmt::join(line, " "));
+    }
+
+    return out;
+  }
+};
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <cerrno>
+#include <cstddef>
+#include <fcntl.h>
+#include <filesystem>
+#include <fmt/format.h>
+#include <span>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+#include <utility>
+
+namespace esplink {
+
+/**
+ * @brief File mapped into memory as a whole, so that its content is viewed in place instead of being read into a
+ *        buffer. Pages are shared with page cache, and with every other mapping of the same file, until written.
+ */
+class MappedFile {
+ public:
+  enum class Mode {
+    ReadOnly,
+    CopyOnWrite,  // writes stay private to the mapping, only pages written are copied, the file is never modified
+  };
+
+  /**
+   * @throw std::system_error if the file can't be opened or mapped
+   */
+  explicit MappedFile(std::filesystem::path const& t_path, Mode const t_mode = Mode::ReadOnly) {
+    auto const fail = [&t_path](char const* t_what) {
+      return std::system_error(errno, std::generic_category(), fmt::format("Failed to {} {}", t_what, t_path.string()));
+    };
+
+    this->fd_ = ::open(t_path.c_str(), O_RDONLY | O_CLOEXEC);  // NOLINT(cppcoreguidelines-pro-type-vararg)
+    if (this->fd_ < 0) {
+      throw fail("open");
+    }
+
+    struct stat status {};
+    if (::fstat(this->fd_, &status) != 0) {
+      auto error = fail("stat");
+      this->release();
+      throw error;
+    }
+
+    this->size_ = static_cast<std::size_t>(status.st_size);
+    if (not this->map(t_mode)) {
+      auto error = fail("map");
+      this->release();
+      throw error;
+    }
+  }
+
+  MappedFile(MappedFile const&)            = delete;
+  MappedFile& operator=(MappedFile const&) = delete;
+
+  MappedFile(MappedFile&& t_other) noexcept
+    : data_{std::exchange(t_other.data_, nullptr)}, size_{std::exchange(t_other.size_, 0)},
+      fd_{std::exchange(t_other.fd_, -1)} {}
+
+  MappedFile& operator=(MappedFile&& t_other) noexcept {
+    std::swap(this->data_, t_other.data_);
+    std::swap(this->size_, t_other.size_);
+    std::swap(this->fd_, t_other.fd_);
+    return *this;
+  }
+
+  ~MappedFile() { this->release(); }
+
+  /**
+   * @brief Another mapping of the file this one views, of the same size. The file is referred to by descriptor, not
+   *        by path, so that a file replaced at the path since is never mapped instead.
+   *
+   * @throw std::system_error if the file can't be mapped
+   */
+  [[nodiscard]] MappedFile map_again(Mode const t_mode) const {
+    MappedFile other;
+    other.fd_ = ::fcntl(this->fd_, F_DUPFD_CLOEXEC, 0);  // NOLINT(cppcoreguidelines-pro-type-vararg)
+    if (other.fd_ < 0) {
+      throw std::system_error(errno, std::generic_category(), "Failed to duplicate file descriptor");
+    }
+
+    other.size_ = this->size_;
+    if (not other.map(t_mode)) {
+      throw std::system_error(errno, std::generic_category(), "Failed to map file again");
+    }
+
+    return other;
+  }
+
+  [[nodiscard]] std::size_t size() const noexcept { return this->size_; }
+
+  [[nodiscard]] std::span<char const> data() const noexcept { return {static_cast<char const*>(this->data_), size_}; }
+
+  /**
+   * @brief Writable view, only for mapping of Mode::CopyOnWrite, writing to a read-only mapping crashes
+   */
+  [[nodiscard]] std::span<char> writable() noexcept { return {static_cast<char*>(this->data_), this->size_}; }
+
+ private:
+  MappedFile() = default;
+
+  // mmap refuses empty mapping, an empty file is viewed as empty span instead
+  bool map(Mode const t_mode) noexcept {
+    if (this->size_ == 0) {
+      return true;
+    }
+
+    auto const protection = t_mode == Mode::CopyOnWrite ? PROT_READ | PROT_WRITE : PROT_READ;
+    this->data_           = ::mmap(nullptr, this->size_, protection, MAP_PRIVATE, this->fd_, 0);
+    if (this->data_ == MAP_FAILED) {
+      this->data_ = nullptr;
+      return false;
+    }
+
+    ::madvise(this->data_, this->size_, MADV_SEQUENTIAL);
+    return true;
+  }
+
+  void release() noexcept {
+    if (this->data_ != nullptr) {
+      ::munmap(this->data_, this->size_);
+    }
+    if (this->fd_ >= 0) {
+      ::close(this->fd_);
+    }
+  }
+
+  void* data_       = nullptr;
+  std::size_t size_ = 0;
+  int fd_           = -1;  // kept open, so that the same file can be mapped again
+};
+
+}  // namespace esplink
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <thread>
+#include <vector>
+
+namespace esplink {
+
+/**
+ * @brief MD5 digest (RFC 1321), used to compare flash content with the digest esp chip reports for SPI_FLASH_MD5.
+ *        Not meant for anything security related.
+ */
+class MD5 {
+ public:
+  using Digest = std::array<std::uint8_t, 16>;
+
+  void update(std::span<std::byte const> t_data) noexcept {
+    this->length_ += t_data.size();
+
+    if (this->buffered_ != 0) {
+      auto const to_copy = std::min(t_data.size(), BLOCK_SIZE - this->buffered_);
+      std::copy_n(t_data.begin(), to_copy, this->buffer_.begin() + static_cast<std::ptrdiff_t>(this->buffered_));
+      this->buffered_ += to_copy;
+      t_data = t_data.subspan(to_copy);
+      if (this->buffered_ != BLOCK_SIZE) {
+        return;
+      }
+
+      this->transform(this->buffer_.data());
+      this->buffered_ = 0;
+    }
+
+    for (; t_data.size() >= BLOCK_SIZE; t_data = t_data.subspan(BLOCK_SIZE)) {
+      this->transform(t_data.data());
+    }
+
+    std::copy(t_data.begin(), t_data.end(), this->buffer_.begin());
+    this->buffered_ = t_data.size();
+  }
+
+  void update(std::span<char const> const t_data) noexcept { this->update(std::as_bytes(t_data)); }
+
+  [[nodiscard]] Digest finalize() noexcept {
+    auto const bit_length = this->length_ * 8U;
+
+    std::array<std::byte, BLOCK_SIZE + sizeof(bit_length)> padding{std::byte{0x80}};
+    auto const pad_size = (this->buffered_ < 56 ? 56 : 56 + BLOCK_SIZE) - this->buffered_;
+    for (std::size_t i = 0; i < sizeof(bit_length); ++i) {
+      padding[pad_size + i] = static_cast<std::byte>(bit_length >> (8U * i));
+    }
+    this->update(std::span{padding.data(), pad_size + sizeof(bit_length)});
+
+    Digest ret_val{};
+    for (std::size_t i = 0; i < ret_val.size(); ++i) {
+      ret_val[i] = static_cast<std::uint8_t>(this->state_[i / 4] >> (8U * (i % 4)));
+    }
+
+    return ret_val;
+  }
+
+  [[nodiscard]] static Digest compute(std::span<char const> const t_data) noexcept {
+    MD5 md5;
+    md5.update(t_data);
+    return md5.finalize();
+  }
+
+  /**
+   * @brief This function computes digest of every chunk, spread over up to t_threads threads, one per core by default.
+   *        MD5 of one chunk is inherently sequential, therefore chunks are the unit of parallelism.
+   */
+  [[nodiscard]] static std::vector<Digest> compute_each(
+    std::span<std::span<char const> const> const t_chunks,
+    unsigned const t_threads = std::thread::hardware_concurrency()) {
+    std::vector<Digest> ret_val(t_chunks.size());
+    std::atomic<std::size_t> next = 0;
+    auto const work               = [&]() {
+      for (auto i = next++; i < t_chunks.size(); i = next++) {
+        ret_val[i] = compute(t_chunks[i]);
+      }
+    };
+
+    auto const thread_count = std::clamp<std::size_t>(t_threads, 1, std::max<std::size_t>(t_chunks.size(), 1));
+    std::vector<std::jthread> workers;
+    workers.reserve(thread_count - 1);
+    for (std::size_t i = 1; i < thread_count; ++i) {
+      workers.emplace_back(work);
+    }
+    work();
+    workers.clear();  // joins, ret_val must not be touched by workers when it's returned
+
+    return ret_val;
+  }
+
+ private:
+  static constexpr std::size_t BLOCK_SIZE = 64;
+
+  static constexpr std::array<std::uint32_t, 64> SINE_TABLE = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+  };
+
+  static constexpr std::array<int, 16> SHIFT_TABLE = {7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21};
+
+  void transform(std::byte const* t_block) noexcept {
+    std::array<std::uint32_t, 16> words{};
+    for (std::size_t i = 0; i < words.size(); ++i) {
+      words[i] = std::to_integer<std::uint32_t>(t_block[4 * i]) |
+                 (std::to_integer<std::uint32_t>(t_block[4 * i + 1]) << 8U) |
+                 (std::to_integer<std::uint32_t>(t_block[4 * i + 2]) << 16U) |
+                 (std::to_integer<std::uint32_t>(t_block[4 * i + 3]) << 24U);
+    }
+
+    auto [a, b, c, d] = this->state_;
+    for (std::size_t i = 0; i < 64; ++i) {
+      std::uint32_t f = 0;
+      std::size_t g   = 0;
+      switch (i / 16) {
+        case 0:
+          f = (b & c) | (~b & d);
+          g = i;
+          break;
+        case 1:
+          f = (d & b) | (~d & c);
+          g = (5 * i + 1) % 16;
+          break;
+        case 2:
+          f = b ^ c ^ d;
+          g = (3 * i + 5) % 16;
+          break;
+        default:
+          f = c ^ (b | ~d);
+          g = (7 * i) % 16;
+          break;
+      }
+
+      auto const rotated = std::rotl(a + f + SINE_TABLE[i] + words[g], SHIFT_TABLE[(i / 16) * 4 + i % 4]);
+      a                  = d;
+      d                  = c;
+      c                  = b;
+      b                  = b + rotated;
+    }
+
+    this->state_[0] += a;
+    this->state_[1] += b;
+    this->state_[2] += c;
+    this->state_[3] += d;
+  }
+
+  std::array<std::uint32_t, 4> state_{0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+  std::array<std::byte, BLOCK_SIZE> buffer_{};
+  std::size_t buffered_ = 0;
+  std::uint64_t length_ = 0;
+};
+
+}  // namespace esplink
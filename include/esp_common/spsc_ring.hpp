@@ -0,0 +1,99 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <span>
+#include <vector>
+
+namespace esplink {
+
+/**
+ * @brief Lock-free ring buffer with a single producer and a single consumer. Both sides get direct access to the
+ *        contiguous part of the buffer they may touch, so that data can be read into, and decoded from, the ring
+ *        without being copied. Capacity is rounded up to a power of 2.
+ */
+template <typename T>
+class SpscRing {
+ public:
+  explicit SpscRing(std::size_t const t_capacity) : buffer_(std::bit_ceil(t_capacity)), mask_{buffer_.size() - 1} {}
+
+  [[nodiscard]] std::size_t capacity() const noexcept { return this->buffer_.size(); }
+
+  [[nodiscard]] std::size_t size() const noexcept {
+    return this->write_idx_.load(std::memory_order_acquire) - this->read_idx_.load(std::memory_order_acquire);
+  }
+
+  [[nodiscard]] bool empty() const noexcept { return this->size() == 0; }
+
+  /**
+   * @brief Producer side, contiguous free space following the last element written, empty if the ring is full
+   */
+  [[nodiscard]] std::span<T> writable() noexcept {
+    auto const write_idx = this->write_idx_.load(std::memory_order_relaxed);
+    auto const free_size = this->capacity() - (write_idx - this->read_idx_.load(std::memory_order_acquire));
+    auto const offset    = write_idx & this->mask_;
+    return {this->buffer_.data() + offset, std::min(free_size, this->capacity() - offset)};
+  }
+
+  /**
+   * @brief Producer side, makes the first t_size elements of writable() visible to consumer
+   */
+  void commit(std::size_t const t_size) noexcept {
+    this->write_idx_.store(this->write_idx_.load(std::memory_order_relaxed) + t_size, std::memory_order_release);
+  }
+
+  /**
+   * @brief Producer side, copies as much of t_data as fits
+   *
+   * @return Number of elements written
+   */
+  std::size_t write(std::span<T const> t_data) noexcept {
+    std::size_t written = 0;
+    for (auto space = this->writable(); not space.empty() and written != t_data.size(); space = this->writable()) {
+      auto const size = std::min(space.size(), t_data.size() - written);
+      std::copy_n(t_data.begin() + static_cast<std::ptrdiff_t>(written), size, space.begin());
+      this->commit(size);
+      written += size;
+    }
+
+    return written;
+  }
+
+  /**
+   * @brief Consumer side, contiguous elements following the last element consumed, empty if the ring is empty
+   */
+  [[nodiscard]] std::span<T const> readable() const noexcept {
+    auto const read_idx  = this->read_idx_.load(std::memory_order_relaxed);
+    auto const used_size = this->write_idx_.load(std::memory_order_acquire) - read_idx;
+    auto const offset    = read_idx & this->mask_;
+    return {this->buffer_.data() + offset, std::min(used_size, this->capacity() - offset)};
+  }
+
+  /**
+   * @brief Consumer side, releases the first t_size elements of readable() to producer
+   */
+  void consume(std::size_t const t_size) noexcept {
+    this->read_idx_.store(this->read_idx_.load(std::memory_order_relaxed) + t_size, std::memory_order_release);
+  }
+
+  /**
+   * @brief Consumer side, drops everything written so far
+   */
+  void clear() noexcept {
+    this->read_idx_.store(this->write_idx_.load(std::memory_order_acquire), std::memory_order_release);
+  }
+
+ private:
+  static constexpr std::size_t CACHE_LINE_SIZE = 64;
+
+  std::vector<T> buffer_;
+  std::size_t mask_;
+
+  // indices only ever grow, position in buffer_ is index & mask_, kept apart so that both sides don't share cache line
+  alignas(CACHE_LINE_SIZE) std::atomic<std::size_t> write_idx_{0};
+  alignas(CACHE_LINE_SIZE) std::atomic<std::size_t> read_idx_{0};
+};
+
+}  // namespace esplink
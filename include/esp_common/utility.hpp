@@ -36,23 +36,4 @@ inline constexpr auto to_underlying(detail::is_scoped_enum auto t_enum) noexcept
   return static_cast<std::underlying_type_t<decltype(t_enum)>>(t_enum);
 }
 
-inline void print_byte_stream(auto t_begin, auto t_end) noexcept {
-  using ranges::subrange;
-  using ranges::views::transform;
-  constexpr auto byte_per_line = 16;
-  auto const byte_stream_size  = t_end - t_begin;
-  auto const line_to_print = static_cast<std::size_t>((byte_stream_size + byte_per_line - 1) / byte_per_line);  // ceil
-  spdlog::set_pattern("%v");
-
-  for (std::size_t i = 0; i < line_to_print; ++i) {
-    auto const curr_end = t_end - t_begin < byte_per_line ? t_end : t_begin + byte_per_line;
-    spdlog::debug("{:04X}  {:02X}", i * byte_per_line,
-                  fmt::join(subrange(t_begin, curr_end) | transform(to_byte), " "));
-    t_begin = curr_end;
-  }
-
-  spdlog::debug("");
-  spdlog::set_pattern("%+");
-}
-
 }  // namespace esplink
\ No newline at end of file
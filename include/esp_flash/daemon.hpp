@@ -0,0 +1,437 @@
+#pragma once
+
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <filesystem>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "esp_flash/job.hpp"
+#include "esp_flash/runner.hpp"
+#include "esp_flash/session.hpp"
+
+namespace esplink::flash {
+
+using namespace std::chrono_literals;
+
+/**
+ * @brief Device kept connected by the daemon, with esp chip in loader, between jobs
+ */
+struct Device {
+  std::string port_;
+  std::unique_ptr<Loader> loader_;
+  std::optional<ChipInfo> chip_;  // none until connected, and after a job fails, which leaves chip in unknown state
+  bool reset_ = false;            // chip must be reset into loader before connecting again
+};
+
+/**
+ * @brief This function runs t_session on t_device, connecting it first if it isn't connected, the chip is only
+ *        considered connected afterwards if t_session succeeds
+ */
+inline awaitable<void> run_on_device(Device& t_device, FlashOption const& t_option, Session const& t_session,
+                                     DeviceReport& t_report) {
+  auto& loader = *t_device.loader_;
+  if (not t_device.chip_.has_value()) {
+    if (t_device.reset_) {
+      spdlog::info("{}: Resetting into loader", t_report.port_);
+      co_await loader.async_reset(t_option.baud_);
+      loader.get_protocol().set_status_size(esplink::ESPSLIP::ROM_STATUS_SIZE);
+    }
+
+    t_device.reset_ = true;
+    t_device.chip_  = co_await connect(loader, t_option, t_report);
+  }
+
+  auto const chip = *std::exchange(t_device.chip_, std::nullopt);
+  co_await t_session(loader, chip, t_report);
+  t_device.chip_ = chip;
+}
+
+/**
+ * @brief This function runs t_session on every one of t_devices concurrently, and waits until all of them end
+ */
+inline awaitable<std::vector<DeviceReport>> run_on_devices(std::vector<Device*> const& t_devices,
+                                                           FlashOption const& t_option, Session const& t_session) {
+  auto const executor = co_await boost::asio::this_coro::executor;
+  boost::asio::steady_timer all_done{executor, boost::asio::steady_timer::time_point::max()};
+
+  std::vector<DeviceReport> reports(t_devices.size());
+  std::size_t running = t_devices.size();
+  for (std::size_t i = 0; i < t_devices.size(); ++i) {
+    reports[i].port_ = t_devices[i]->port_;
+    boost::asio::co_spawn(executor, run_on_device(*t_devices[i], t_option, t_session, reports[i]),
+                          [&, record = record_outcome(reports[i])](std::exception_ptr const& t_error) {
+                            record(t_error);
+                            if (--running == 0) {
+                              all_done.cancel();
+                            }
+                          });
+  }
+
+  while (running != 0) {
+    boost::system::error_code error;
+    co_await all_done.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, error));
+  }
+
+  co_return reports;
+}
+
+/**
+ * @brief Flash daemon, keeps chips of every port in loader, so that jobs sent by clients over a Unix domain socket
+ *        skip reset, SYNC, chip detection, SPI attach, stub upload and baudrate negotiation, which take most of the
+ *        time of flashing a small image. Jobs are run one at a time, each on its devices concurrently, on one
+ *        io_context run by the thread calling run(). A device whose job fails is reset and connected again by the
+ *        next job using it. Chips are reset out of loader once the daemon is interrupted, after the job running.
+ */
+class Daemon {
+  using Socket = boost::asio::local::stream_protocol::socket;
+
+  static constexpr std::size_t MAX_REQUEST_SIZE = 64 * 1024;  // a command line, with paths of a few images
+  static constexpr auto REQUEST_TIMEOUT         = 5s;         // a client keeping silent mustn't hold the daemon
+
+  std::filesystem::path socket_path_;
+  FlashOption option_;  // of connection, shared by every job
+  boost::asio::io_context context_;
+  boost::asio::local::stream_protocol::acceptor acceptor_{context_};
+  boost::asio::signal_set signals_{context_, SIGINT, SIGTERM};
+  std::vector<Device> devices_;
+  Socket* reading_ = nullptr;  // client whose request is being read, the read is cancelled once daemon is interrupted
+
+  /**
+   * @brief This function parses command line t_args sent by a client, with relative paths resolved against t_cwd,
+   *        and runs it, what the client should print is written to t_reply
+   *
+   * @return Exit code of the command
+   */
+  awaitable<int> run_job(std::filesystem::path const& t_cwd, std::vector<std::string> const& t_args,
+                         std::ostream& t_reply) {
+    std::optional<Job> job;
+    std::vector<Device*> devices;
+    try {
+      auto const vm               = parse_command_line(t_args);
+      auto const [command, files] = split_command(vm);
+      if (vm.count("help") != 0) {
+        print_help(t_reply);
+        co_return EXIT_SUCCESS;
+      }
+
+      if (command == "serve") {
+        t_reply << "Daemon is already serving!\n";
+        co_return EXIT_FAILURE;
+      }
+
+      if (not vm["baud"].defaulted() or vm.count("max-baud") != 0 or vm.count("stub") != 0) {
+        t_reply << "--baud, --max-baud and --stub are given when the daemon starts!\n";
+        co_return EXIT_FAILURE;
+      }
+
+      job = make_job(command, files, vm, t_reply);
+      if (not job.has_value()) {
+        co_return EXIT_FAILURE;
+      }
+
+      // daemon isn't necessarily started where the client is
+      auto& option = job->option_;
+      for (auto& image : job->images_) {
+        image.path_ = t_cwd / image.path_;
+      }
+      if (job->operation_ == Operation::Read) {
+        job->file_ = t_cwd / job->file_;
+      }
+      if (option.metrics_.has_value()) {
+        option.metrics_ = t_cwd / *option.metrics_;
+      }
+
+      auto const& ports = option.ports_;
+      for (auto& device : this->devices_) {
+        if (ports.empty() or std::find(ports.begin(), ports.end(), device.port_) != ports.end()) {
+          devices.push_back(&device);
+        }
+      }
+      if (not ports.empty() and devices.size() != ports.size()) {
+        t_reply << "Only ports served by the daemon can be used!\n";
+        co_return EXIT_FAILURE;
+      }
+
+      option.ports_.clear();
+      for (auto const* device : devices) {
+        option.ports_.push_back(device->port_);
+      }
+      option.reboot_ = false;
+    } catch (std::exception const& t_e) {
+      t_reply << t_e.what() << '\n';
+      co_return EXIT_FAILURE;
+    }
+
+    Session session;
+    try {
+      session = make_session(*job);
+    } catch (std::exception const& t_e) {
+      spdlog::error("{}", t_e.what());
+      t_reply << t_e.what() << '\n';
+      co_return EXIT_FAILURE;
+    }
+
+    auto const start   = std::chrono::steady_clock::now();
+    auto const reports = co_await run_on_devices(devices, this->option_, session);
+    for (auto const& line : summarize(reports, std::chrono::steady_clock::now() - start, job->operation_)) {
+      t_reply << line << '\n';
+    }
+
+    // metrics cover every job since the daemon started
+    if (job->option_.metrics_.has_value()) {
+      std::vector<esplink::PortMetrics> ports;
+      for (auto const* device : devices) {
+        ports.push_back({device->port_, device->loader_->metrics()});
+      }
+      write_metrics(ports, job->option_);
+    }
+
+    co_return std::none_of(reports.begin(), reports.end(),
+                           [](auto const& t_report) { return t_report.error_.has_value(); })
+      ? EXIT_SUCCESS
+      : EXIT_FAILURE;
+  }
+
+  /**
+   * @brief This function receives a job from t_client, working directory of the client followed by one argument per
+   *        line, ended by an empty line, and replies with what the client should print, ended by exit code of the job
+   *
+   * @throw std::runtime_error if the request isn't received within REQUEST_TIMEOUT, or is longer than MAX_REQUEST_SIZE
+   */
+  awaitable<void> serve_client(Socket t_client) {
+    boost::asio::steady_timer deadline{this->context_, REQUEST_TIMEOUT};
+    deadline.async_wait([&t_client](auto const& t_error) {
+      if (not t_error) {
+        boost::system::error_code ignored;
+        t_client.cancel(ignored);
+      }
+    });
+
+    boost::asio::streambuf request{MAX_REQUEST_SIZE};
+    boost::system::error_code error;
+    this->reading_ = &t_client;
+    co_await boost::asio::async_read_until(t_client, request, "\n\n",
+                                           boost::asio::redirect_error(boost::asio::use_awaitable, error));
+    this->reading_ = nullptr;
+    deadline.cancel();
+    if (error == boost::asio::error::operation_aborted) {
+      throw std::runtime_error(this->acceptor_.is_open()
+                                 ? fmt::format("No request within {} s", REQUEST_TIMEOUT.count())
+                                 : std::string{"Interrupted before the request is received"});
+    }
+    if (error == boost::asio::error::not_found) {
+      throw std::runtime_error(fmt::format("Request is longer than {} bytes", MAX_REQUEST_SIZE));
+    }
+    if (error) {
+      throw boost::system::system_error(error, "Failed to read request");
+    }
+
+    std::istream stream{&request};
+    std::string cwd;
+    std::getline(stream, cwd);
+    std::vector<std::string> args;
+    for (std::string arg; std::getline(stream, arg) and not arg.empty();) {
+      args.push_back(std::move(arg));
+    }
+
+    spdlog::info("Running job: {}", fmt::join(args, " "));
+    std::ostringstream reply;
+    auto const exit_code = co_await this->run_job(cwd, args, reply);
+    reply << "exit " << exit_code << '\n';
+
+    auto const content = reply.str();
+    co_await boost::asio::async_write(t_client, boost::asio::buffer(content), boost::asio::use_awaitable);
+  }
+
+  /**
+   * @brief This function stops accepting clients, and gives up on the request being read, the job running is finished
+   */
+  void interrupt() {
+    spdlog::info("Stopping after the job running");
+    this->signals_.clear();
+    this->acceptor_.close();
+    if (this->reading_ != nullptr) {
+      boost::system::error_code ignored;
+      this->reading_->cancel(ignored);
+    }
+  }
+
+  awaitable<void> serve() {
+    // devices are connected up front, so that the first job is as quick as the rest
+    std::vector<Device*> devices;
+    for (auto& device : this->devices_) {
+      devices.push_back(&device);
+    }
+
+    Session const connect_only = [](Loader&, ChipInfo const&, DeviceReport&) -> awaitable<void> { co_return; };
+    for (auto const& report : co_await run_on_devices(devices, this->option_, connect_only)) {
+      if (report.error_.has_value()) {
+        spdlog::error("{}: Failed to connect, retrying with the next job: {}", report.port_, *report.error_);
+      }
+    }
+
+    spdlog::info("Serving jobs at {}", this->socket_path_.string());
+    for (;;) {
+      boost::system::error_code error;
+      auto client =
+        co_await this->acceptor_.async_accept(boost::asio::redirect_error(boost::asio::use_awaitable, error));
+      if (error == boost::asio::error::operation_aborted or not this->acceptor_.is_open()) {
+        break;
+      }
+
+      try {
+        co_await this->serve_client(std::move(client));
+      } catch (std::exception const& t_e) {
+        spdlog::warn("Failed to serve client: {}", t_e.what());
+      }
+    }
+
+    for (auto& device : this->devices_) {
+      co_await device.loader_->async_close();
+    }
+  }
+
+ public:
+  /**
+   * @brief Ports that fail to open are left out, and reported, the rest are served. The socket is only bound once
+   *        ports are open, so that a daemon failing to start leaves no socket behind.
+   *
+   * @throw boost::system::system_error if t_socket can't be listened on
+   * @throw std::runtime_error if another daemon serves at t_socket, or no port can be opened
+   */
+  Daemon(std::filesystem::path t_socket, FlashOption t_option)
+    : socket_path_{std::move(t_socket)}, option_{std::move(t_option)} {
+    // socket left behind by a daemon that didn't exit cleanly is removed, unless a daemon still accepts on it
+    boost::asio::local::stream_protocol::endpoint const endpoint{this->socket_path_.string()};
+    auto const stale = std::filesystem::is_socket(this->socket_path_);
+    if (stale) {
+      Socket probe{this->context_};
+      boost::system::error_code error;
+      probe.connect(endpoint, error);
+      if (not error) {
+        throw std::runtime_error(fmt::format("Another daemon is serving at {}", this->socket_path_.string()));
+      }
+    }
+
+    auto const& ports   = this->option_.ports_;
+    auto const on_error = [&ports](std::size_t const t_index, std::string const& t_error) {
+      spdlog::error("{}: Failed to open, not served: {}", ports[t_index], t_error);
+    };
+    auto loaders = open_ports(this->context_, ports, this->option_.baud_, on_error);
+
+    for (std::size_t i = 0; i < loaders.size(); ++i) {
+      if (loaders[i] != nullptr) {
+        auto& device   = this->devices_.emplace_back();
+        device.port_   = ports[i];
+        device.loader_ = std::move(loaders[i]);
+      }
+    }
+
+    if (this->devices_.empty()) {
+      throw std::runtime_error("None of the ports can be opened");
+    }
+
+    if (stale) {
+      std::filesystem::remove(this->socket_path_);
+    }
+    this->acceptor_.open(endpoint.protocol());
+    this->acceptor_.bind(endpoint);
+    try {
+      this->acceptor_.listen();
+    } catch (boost::system::system_error const& /**/) {
+      std::error_code ignored;
+      std::filesystem::remove(this->socket_path_, ignored);
+      throw;
+    }
+  }
+
+  Daemon(Daemon const&)            = delete;
+  Daemon& operator=(Daemon const&) = delete;
+  Daemon(Daemon&&)                 = delete;
+  Daemon& operator=(Daemon&&)      = delete;
+
+  ~Daemon() {
+    std::error_code error;
+    std::filesystem::remove(this->socket_path_, error);
+  }
+
+  /**
+   * @brief This function serves jobs until SIGINT or SIGTERM, a second one ends the daemon right away
+   */
+  void run() {
+    this->signals_.async_wait([this](auto const& t_error, int) {
+      if (not t_error) {
+        this->interrupt();
+      }
+    });
+
+    boost::asio::co_spawn(this->context_, this->serve(), [this](std::exception_ptr const& t_error) {
+      this->signals_.cancel();
+      if (t_error) {
+        std::rethrow_exception(t_error);
+      }
+    });
+    this->context_.run();
+  }
+
+  /**
+   * @brief This function ends run() after the job running, as SIGINT or SIGTERM does, it may be called from any thread
+   */
+  void stop() {
+    boost::asio::post(this->context_, [this]() { this->interrupt(); });
+  }
+};
+
+/**
+ * @brief This function sends command line t_args to the daemon listening on t_socket, along with working directory
+ *        that relative paths are resolved against, and prints what the daemon replies
+ *
+ * @return Exit code of the command run by the daemon
+ *
+ * @throw boost::system::system_error if the daemon can't be reached
+ */
+inline int send_to_daemon(std::filesystem::path const& t_socket, std::vector<std::string> const& t_args) {
+  std::string request = std::filesystem::current_path().string() + '\n';
+  for (auto const& arg : t_args) {
+    if (arg.empty() or arg.find('\n') != std::string::npos) {
+      throw std::invalid_argument("Arguments sent to the daemon must be non-empty single lines");
+    }
+    request += arg + '\n';
+  }
+  request += '\n';
+
+  boost::asio::io_context context;
+  boost::asio::local::stream_protocol::socket socket{context};
+  socket.connect(boost::asio::local::stream_protocol::endpoint{t_socket.string()});
+  boost::asio::write(socket, boost::asio::buffer(request));
+
+  // daemon closes the connection once the job is done
+  boost::asio::streambuf reply;
+  boost::system::error_code error;
+  boost::asio::read(socket, reply, error);
+  if (error != boost::asio::error::eof) {
+    throw boost::system::system_error(error);
+  }
+
+  std::istream stream{&reply};
+  std::vector<std::string> lines;
+  for (std::string line; std::getline(stream, line);) {
+    lines.push_back(std::move(line));
+  }
+
+  constexpr std::string_view EXIT_PREFIX = "exit ";
+  if (lines.empty() or not lines.back().starts_with(EXIT_PREFIX)) {
+    throw std::runtime_error("Daemon ends the connection before the command is done");
+  }
+
+  for (std::size_t i = 0; i + 1 < lines.size(); ++i) {
+    std::cout << lines[i] << '\n';
+  }
+  return std::stoi(lines.back().substr(EXIT_PREFIX.size()));
+}
+
+}  // namespace esplink::flash
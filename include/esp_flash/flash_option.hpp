@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace esplink::flash {
+
+struct FlashOption {
+  std::vector<std::string> ports_;
+  std::uint32_t baud_       = 115200;
+  std::uint32_t max_baud_   = 0;
+  std::uint32_t offset_     = 0;
+  std::size_t window_       = 1;
+  std::uint32_t block_size_ = 0;  // 0 adapts block size to the link, up to what loader accepts
+  bool compress_            = true;
+  bool diff_                = false;
+  bool verify_              = false;
+  bool write_               = true;  // false only checks flash against images, which must then be verified
+  bool reboot_              = true;  // ends flashing by rebooting the chip, the daemon keeps it in loader instead
+  std::optional<std::filesystem::path> stub_;
+  std::optional<std::filesystem::path> metrics_;
+  bool prometheus_    = false;  // metrics format, JSON otherwise
+  std::uint32_t size_ = 0;      // bytes to read or erase, 0 means up to the end of flash
+};
+
+enum class Operation { Flash, Read, Erase, Verify };
+
+}  // namespace esplink::flash
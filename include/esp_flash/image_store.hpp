@@ -0,0 +1,237 @@
+#pragma once
+
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <cstdint>
+#include <exception>
+#include <future>
+#include <map>
+#include <memory>
+#include <optional>
+#include <span>
+#include <spdlog/spdlog.h>
+#include <string>
+#include <vector>
+
+#include "esp_common/compress.hpp"
+#include "esp_common/constants.hpp"
+#include "esp_common/mapped_file.hpp"
+#include "esp_common/md5.hpp"
+#include "esp_flash/loader.hpp"
+#include "esp_serial/image_layout.hpp"
+
+namespace esplink::flash {
+
+/**
+ * @brief Digests computed on a worker thread, and awaited by sessions on the io_context. The worker posts its
+ *        completion to the io_context, which wakes every session waiting, so that digests are neither polled nor
+ *        waited for by blocking the io_context.
+ */
+class PendingDigests {
+  std::vector<esplink::MD5::Digest> digests_;
+  std::exception_ptr error_;
+  bool ready_ = false;                               // set, and waiters_ woken, on the io_context
+  std::vector<boost::asio::steady_timer*> waiters_;  // of sessions waiting, each cancelled once digests are ready
+  std::future<void> worker_;                         // joined on destruction, so that digests_ outlives the worker
+
+  /**
+   * @brief Timer of a session waiting, registered while it waits
+   */
+  struct Waiter {
+    PendingDigests& pending_;
+    boost::asio::steady_timer timer_;
+
+    Waiter(PendingDigests& t_pending, boost::asio::any_io_executor const& t_executor)
+      : pending_{t_pending}, timer_{t_executor, boost::asio::steady_timer::time_point::max()} {
+      this->pending_.waiters_.push_back(&this->timer_);
+    }
+
+    Waiter(Waiter const&)            = delete;
+    Waiter& operator=(Waiter const&) = delete;
+    Waiter(Waiter&&)                 = delete;
+    Waiter& operator=(Waiter&&)      = delete;
+
+    ~Waiter() { std::erase(this->pending_.waiters_, &this->timer_); }
+  };
+
+ public:
+  /**
+   * @brief This function starts computing digest of each of t_chunks, one chunk per core at a time, completion is
+   *        posted to t_executor
+   */
+  static std::shared_ptr<PendingDigests> start(boost::asio::any_io_executor const& t_executor,
+                                               std::vector<std::span<char const>> t_chunks) {
+    auto pending   = std::make_shared<PendingDigests>();
+    auto* const to = pending.get();
+    pending->worker_ =
+      std::async(std::launch::async, [to, weak = std::weak_ptr{pending}, t_executor, chunks = std::move(t_chunks)]() {
+        try {
+          to->digests_ = esplink::MD5::compute_each(chunks);
+        } catch (...) {
+          to->error_ = std::current_exception();
+        }
+
+        // digests are only looked at on the io_context, once posted, which orders them after the worker
+        boost::asio::post(t_executor, [weak]() {
+          if (auto const done = weak.lock()) {
+            done->ready_ = true;
+            for (auto* const waiter : done->waiters_) {
+              waiter->cancel();
+            }
+          }
+        });
+      });
+
+    return pending;
+  }
+
+  /**
+   * @brief This function waits until digests are computed
+   *
+   * @return Digest of each chunk, in order
+   * @throw What computing digests throws
+   */
+  awaitable<std::vector<esplink::MD5::Digest> const*> async_get() {
+    Waiter waiter{*this, co_await boost::asio::this_coro::executor};
+    while (not this->ready_) {
+      boost::system::error_code ignored;
+      co_await waiter.timer_.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ignored));
+    }
+
+    if (this->error_) {
+      std::rethrow_exception(this->error_);
+    }
+    co_return &this->digests_;
+  }
+};
+
+/**
+ * @brief Image with binary header set for one flash configuration. Compressed regions and sector digests are computed
+ *        the first time a device asks for them, and shared by every device using the same configuration.
+ */
+class PreparedImage {
+  std::optional<esplink::MappedFile> patched_;  // std::nullopt if image is viewed as it is in the file
+  std::span<char const> image_;
+  std::uint32_t offset_;  // flash offset image is written to
+  std::map<Region, std::vector<char>> compressed_;
+  std::map<std::uint32_t, std::vector<esplink::MD5::Digest>> chunk_digests_;  // by chunk size
+  std::map<std::vector<Region>, std::shared_ptr<PendingDigests>> region_digests_;
+
+ public:
+  PreparedImage(std::span<char const> const t_image, std::uint32_t const t_offset)
+    : image_{t_image}, offset_{t_offset} {}
+
+  PreparedImage(esplink::MappedFile t_patched, std::uint32_t const t_offset)
+    : patched_{std::move(t_patched)}, image_{this->patched_->data()}, offset_{t_offset} {}
+
+  [[nodiscard]] std::uint32_t offset() const noexcept { return this->offset_; }
+
+  [[nodiscard]] std::span<char const> data() const noexcept { return this->image_; }
+
+  [[nodiscard]] std::span<char const> data(Region const t_region) const noexcept {
+    return this->data().subspan(t_region.begin_, t_region.size_);
+  }
+
+  [[nodiscard]] std::span<char const> compressed(Region const t_region) {
+    auto iter = this->compressed_.find(t_region);
+    if (iter == this->compressed_.end()) {
+      iter = this->compressed_.emplace(t_region, esplink::zlib_compress(this->data(t_region))).first;
+    }
+
+    return iter->second;
+  }
+
+  /**
+   * @brief Digest of the t_chunk-th chunk of t_chunk_size bytes of the image, digests of every chunk of the same size
+   *        are computed at once, on worker threads
+   */
+  [[nodiscard]] esplink::MD5::Digest const& chunk_digest(std::uint32_t const t_chunk_size,
+                                                         std::uint32_t const t_chunk) {
+    auto& digests = this->chunk_digests_[t_chunk_size];
+    if (digests.empty()) {
+      std::vector<std::span<char const>> chunks;
+      for (std::size_t begin = 0; begin < this->image_.size(); begin += t_chunk_size) {
+        chunks.push_back(this->image_.subspan(begin, std::min<std::size_t>(t_chunk_size, this->image_.size() - begin)));
+      }
+      digests = esplink::MD5::compute_each(chunks);
+    }
+
+    return digests.at(t_chunk);
+  }
+
+  /**
+   * @brief Digest of each of t_regions, computed on worker threads, one region per core at a time, so that digests are
+   *        ready by the time the regions are written. Sessions awaiting them are resumed on t_executor.
+   */
+  [[nodiscard]] std::shared_ptr<PendingDigests> digests(boost::asio::any_io_executor const& t_executor,
+                                                        std::vector<Region> const& t_regions) {
+    auto iter = this->region_digests_.find(t_regions);
+    if (iter == this->region_digests_.end()) {
+      std::vector<std::span<char const>> chunks;
+      chunks.reserve(t_regions.size());
+      for (auto const& region : t_regions) {
+        chunks.push_back(this->data(region));
+      }
+
+      iter = this->region_digests_.emplace(t_regions, PendingDigests::start(t_executor, std::move(chunks))).first;
+    }
+
+    return iter->second;
+  }
+};
+
+/**
+ * @brief SPI flash mode, SPI flash speed and flash chip size, as in image header
+ */
+using FlashParams = std::array<std::uint8_t, 3>;
+
+/**
+ * @brief Image file mapped into memory once, and prepared once per flash configuration, for every device flashed in
+ *        one run. Image whose header is patched is a copy on write mapping of the same file, mapped by descriptor, so
+ *        that patching flash parameters copies a single page, and every other image views the file mapping as it is.
+ */
+class ImageStore {
+  esplink::MappedFile raw_;
+  std::uint32_t offset_;
+  std::string name_;
+  std::map<std::optional<FlashParams>, PreparedImage> prepared_;  // std::nullopt keeps header as is
+
+ public:
+  explicit ImageStore(ImageFile const& t_file)
+    : raw_{t_file.path_}, offset_{t_file.offset_}, name_{t_file.path_.string()} {
+    spdlog::info("Reading file: {}, file size: {}, flash offset: {:#x}", this->name_, this->raw_.size(),
+                 this->offset_);
+  }
+
+  [[nodiscard]] std::size_t size() const noexcept { return this->raw_.size(); }
+
+  [[nodiscard]] std::uint32_t offset() const noexcept { return this->offset_; }
+
+  [[nodiscard]] std::string const& name() const noexcept { return this->name_; }
+
+  /**
+   * @brief Image with t_params patched into its header, or with header kept as is if t_params is std::nullopt
+   */
+  template <esplink::ImageHeaderChipID ChipID>
+  PreparedImage& prepare(std::optional<FlashParams> const& t_params) {
+    auto iter = this->prepared_.find(t_params);
+    if (iter == this->prepared_.end()) {
+      // only esp images carry flash parameters, e.g. partition table doesn't, and is viewed as is
+      auto const raw    = this->raw_.data();
+      auto const is_esp = not raw.empty() and static_cast<std::uint8_t>(raw.front()) == esplink::ESP_MAGIC_NUMBER;
+      if (is_esp and t_params.has_value()) {
+        auto image                     = this->raw_.map_again(esplink::MappedFile::Mode::CopyOnWrite);
+        auto header                    = image.writable();
+        auto const [mode, speed, size] = *t_params;
+        esplink::set_binary_header<ChipID>(header, mode, speed, size);
+        iter = this->prepared_.emplace(t_params, PreparedImage{std::move(image), this->offset_}).first;
+      } else {
+        iter = this->prepared_.emplace(t_params, PreparedImage{raw, this->offset_}).first;
+      }
+    }
+
+    return iter->second;
+  }
+};
+
+}  // namespace esplink::flash
@@ -0,0 +1,342 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <boost/program_options.hpp>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "esp_flash/flash_option.hpp"
+#include "esp_flash/image_store.hpp"
+#include "esp_flash/runner.hpp"
+#include "esp_flash/session.hpp"
+#include "esp_serial/image_layout.hpp"
+
+namespace esplink::flash {
+
+/**
+ * @brief What to do to devices, as given on command line, either run once, or sent to the daemon by a client
+ */
+struct Job {
+  Operation operation_ = Operation::Flash;
+  std::vector<ImageFile> images_;            // to flash or verify
+  std::filesystem::path file_;               // to read flash to
+  bool whole_chip_ = false;                  // erase whole flash rather than ranges_
+  std::vector<esplink::FlashRange> ranges_;  // to erase
+  std::string chip_;
+  FlashOption option_;
+};
+
+/**
+ * @brief This function makes session flashing t_files, each at its own offset, or verifying them if t_option doesn't
+ *        write. Image files are mapped once, and shared by every device.
+ */
+template <esplink::ImageHeaderChipID ChipID>
+Session make_flash_session(std::vector<ImageFile> const& t_files, FlashOption const& t_option) {
+  auto stores = std::make_shared<std::vector<ImageStore>>();
+  for (auto const& file : t_files) {
+    if (file.path_.extension() == "elf") {
+      throw std::invalid_argument("elf file is not supported, currently support only .bin file");
+    }
+    stores->emplace_back(file);
+  }
+
+  esplink::check_overlap(*stores);
+  return [stores, t_option](Loader& t_loader, ChipInfo const& t_chip, DeviceReport& t_report) {
+    return flash_session<ChipID>(t_loader, t_chip, *stores, t_option, t_report);
+  };
+}
+
+using FlashFn = Session (*)(std::vector<ImageFile> const&, FlashOption const&);
+
+inline auto& get_flash_fn() {
+  static std::unordered_map<std::string_view, FlashFn> const FLASH_FN_MAP = []() {
+    std::unordered_map<std::string_view, FlashFn> ret_val;
+    ret_val["ESP32C3"] = make_flash_session<esplink::ImageHeaderChipID::ESP32C3>;
+    return ret_val;
+  }();
+
+  return FLASH_FN_MAP;
+}
+
+/**
+ * @brief This function makes the session t_job runs on every device. Flash of every device is read to the file of
+ *        the job, with name of the port inserted before extension if there are several, e.g. backup.ttyUSB0.bin.
+ *
+ * @throw std::invalid_argument if images of the job can't be flashed, e.g. they overlap
+ */
+inline Session make_session(Job const& t_job) {
+  auto const& option = t_job.option_;
+  switch (t_job.operation_) {
+    case Operation::Flash:
+    case Operation::Verify:
+      return get_flash_fn().at(t_job.chip_)(t_job.images_, option);
+    case Operation::Read:
+      return [file = t_job.file_, option](Loader& t_loader, ChipInfo const& t_chip, DeviceReport& t_report) {
+        auto path = file;
+        if (option.ports_.size() > 1) {
+          auto const port = std::filesystem::path{t_report.port_}.filename().string();
+          path.replace_filename(fmt::format("{}.{}{}", file.stem().string(), port, file.extension().string()));
+        }
+
+        return read_session(t_loader, t_chip, std::move(path), option, t_report);
+      };
+    case Operation::Erase:
+      break;
+  }
+
+  return [whole_chip = t_job.whole_chip_, ranges = t_job.ranges_](Loader& t_loader, ChipInfo const& t_chip,
+                                                                    DeviceReport& t_report) {
+    return erase_session(t_loader, t_chip, whole_chip, ranges, t_report);
+  };
+}
+
+/**
+ * @brief Options of esp-flash, shared by command line of the program, and command line sent to the daemon
+ */
+inline boost::program_options::options_description describe_options() {
+  using namespace boost::program_options;
+  options_description flash_options("Parameter for flash");
+  flash_options.add_options()                                                       //
+    ("port", value<std::vector<std::string>>(),
+     "Port of connected ESP MCU, may be repeated, comma separated, or a glob pattern, e.g. \"/dev/ttyUSB*\", to flash "
+     "several MCUs concurrently")  //
+    ("baud", value<int>()->default_value(115200), "Baudrate of the communication")  //
+    ("max-baud", value<int>(),
+     "Highest baudrate to negotiate after connection, steps down automatically if the link is unreliable")  //
+    ("offset", value<std::string>(), "Flash offset")                                //
+    ("window", value<std::size_t>()->default_value(1),
+     "Maximum number of FLASH_DATA packets in flight, 1 waits for each response before sending the next one")  //
+    ("block-size", value<std::uint32_t>(),
+     "Size of data in each FLASH_DATA packet, one of 1024, 2048, 4096, 8192 and 16384, chosen from round trip time "
+     "and error rate measured during the session by default, up to 4096 for ROM loader and 16384 for flasher stub")  //
+    ("no-compress", "Send image uncompressed even if the chip accepts compressed data")  //
+    ("diff", "Only erase and write sectors whose content differs from the image, compared by MD5 digest")  //
+    ("verify", "Check every region written against MD5 digest computed by esp chip before ending flashing")  //
+    ("stub", value<std::string>(), "Flasher stub elf file to upload and run before flashing")  //
+    ("flash-param", value<std::string>(),
+     "Flash parameter, including SPI flash mode, SPI flash speed, and flash chip size")  //
+    ("metrics", value<std::string>(),
+     "Write latency and throughput metrics of every command to this file at the end of the run")  //
+    ("metrics-format", value<std::string>()->default_value("json"), "Format of metrics file, json or prometheus")  //
+    ("chip", value<std::string>()->default_value("ESP32C3"), "Chip type, currently support only ESP32C3");
+
+  options_description read_options("Parameter for read and erase");
+  read_options.add_options()  //
+    ("size", value<std::string>(),
+     "Number of bytes to read or erase from offset, in hex, up to the end of flash by default when reading, or "
+     "erasing whole flash by ROM loader");
+
+  options_description daemon_options("Parameter for daemon");
+  daemon_options.add_options()  //
+    ("socket", value<std::string>(),
+     "Unix domain socket the daemon listens on with serve, or to send the command to otherwise. Chips are kept in "
+     "loader between commands, --port of a command picks among those of the daemon, all of them by default, while "
+     "--baud, --max-baud and --stub are given to serve");
+
+  options_description visible_options("All options");
+  visible_options.add(flash_options)
+    .add(read_options)
+    .add(daemon_options)
+    .add_options()                               //
+    ("help", "Show this help message and exit")  //
+    ("verbose", "Show debug message during execution");
+
+  return visible_options;
+}
+
+inline void print_help(std::ostream& t_out) {
+  t_out << "Usage: esp-flash [flash] FILE [options]             write image file to flash at --offset\n"
+           "       esp-flash [flash] OFFSET:FILE... [options]   write image files to flash at their offsets\n"
+           "       esp-flash verify OFFSET:FILE... [options]    check image files against flash\n"
+           "       esp-flash read FILE [options]                dump flash content to file\n"
+           "       esp-flash erase-region [options]             erase --size bytes of flash at --offset\n"
+           "       esp-flash erase-region OFFSET:SIZE...        erase each range of flash, sizes in hex\n"
+           "       esp-flash erase-flash [options]              erase whole flash\n"
+           "       esp-flash serve --socket PATH [options]      keep --port connected, run commands sent to PATH\n"
+           "       esp-flash --socket PATH COMMAND...           have the command run by the daemon at PATH\n\n"
+        << describe_options() << '\n';
+}
+
+/**
+ * @throw boost::program_options::error if t_args can't be parsed
+ */
+inline boost::program_options::variables_map parse_command_line(std::vector<std::string> const& t_args) {
+  using namespace boost::program_options;
+  options_description hidden_options;
+  hidden_options.add_options()("command-and-file", value<std::vector<std::string>>(), "Command, and files to use");
+
+  positional_options_description pd;
+  pd.add("command-and-file", -1);
+
+  options_description all("Allowed options");
+  all.add(describe_options()).add(hidden_options);
+
+  variables_map vm;
+  store(command_line_parser(t_args).options(all).positional(pd).run(), vm);
+  notify(vm);
+  return vm;
+}
+
+/**
+ * @brief This function splits positional arguments into command, which is optional, flash by default, and files,
+ *        which are everything after it
+ */
+inline std::pair<std::string, std::vector<std::string>> split_command(
+  boost::program_options::variables_map const& t_vm) {
+  constexpr std::array<std::string_view, 6> COMMANDS = {"flash",        "verify",      "read",
+                                                        "erase-region", "erase-flash", "serve"};
+
+  auto args = t_vm.count("command-and-file") != 0 ? t_vm["command-and-file"].as<std::vector<std::string>>()
+                                                  : std::vector<std::string>{};
+  std::string command{COMMANDS.front()};
+  if (not args.empty() and std::find(COMMANDS.begin(), COMMANDS.end(), args.front()) != COMMANDS.end()) {
+    command = args.front();
+    args.erase(args.begin());
+  }
+
+  return {std::move(command), std::move(args)};
+}
+
+/**
+ * @brief This function makes option of flashing from t_vm, problems found are reported to t_err
+ *
+ * @return std::nullopt if t_vm isn't valid
+ */
+inline std::optional<FlashOption> make_option(boost::program_options::variables_map const& t_vm, std::ostream& t_err) {
+  if (t_vm.count("block-size") != 0) {
+    try {
+      get_write_fn(t_vm["block-size"].as<std::uint32_t>());
+    } catch (std::invalid_argument& t_e) {
+      t_err << t_e.what() << '\n';
+      return std::nullopt;
+    }
+  }
+
+  auto const& metrics_format = t_vm["metrics-format"].as<std::string>();
+  if (metrics_format != "json" and metrics_format != "prometheus") {
+    t_err << "Unsupported metrics format " << metrics_format << '\n';
+    return std::nullopt;
+  }
+
+  auto const parse_hex = [&t_vm](std::string const& t_name) {
+    std::uint32_t value = 0;
+    if (t_vm.count(t_name) != 0) {
+      std::stringstream ss;
+      ss << std::hex << t_vm[t_name].as<std::string>();
+      ss >> value;
+    }
+    return value;
+  };
+
+  return FlashOption{
+    .ports_      = t_vm.count("port") != 0 ? expand_ports(t_vm["port"].as<std::vector<std::string>>())  //
+                                           : std::vector<std::string>{},
+    .baud_       = static_cast<std::uint32_t>(t_vm["baud"].as<int>()),
+    .max_baud_   = t_vm.count("max-baud") != 0 ? static_cast<std::uint32_t>(t_vm["max-baud"].as<int>()) : 0U,
+    .offset_     = parse_hex("offset"),
+    .window_     = t_vm["window"].as<std::size_t>(),
+    .block_size_ = t_vm.count("block-size") != 0 ? t_vm["block-size"].as<std::uint32_t>() : 0U,
+    .compress_   = t_vm.count("no-compress") == 0,
+    .diff_       = t_vm.count("diff") != 0,
+    .verify_     = t_vm.count("verify") != 0,
+    .stub_       = t_vm.count("stub") != 0 ? std::optional<std::filesystem::path>{t_vm["stub"].as<std::string>()}
+                                           : std::nullopt,
+    .metrics_    = t_vm.count("metrics") != 0 ? std::optional<std::filesystem::path>{t_vm["metrics"].as<std::string>()}
+                                              : std::nullopt,
+    .prometheus_ = metrics_format == "prometheus",
+    .size_       = parse_hex("size"),
+  };
+}
+
+/**
+ * @brief This function makes job of t_command on t_files from t_vm, problems found are reported to t_err
+ *
+ * @return std::nullopt if t_command can't be run with t_files and t_vm
+ */
+inline std::optional<Job> make_job(std::string const& t_command, std::vector<std::string> const& t_files,
+                                   boost::program_options::variables_map const& t_vm, std::ostream& t_err) {
+  auto const is_erase = t_command.starts_with("erase-");
+  if (t_command == "erase-flash" and not t_files.empty()) {
+    t_err << t_command << " takes no file!\n";
+    return std::nullopt;
+  }
+
+  if (t_command == "erase-region" and t_files.empty() and (t_vm.count("offset") == 0 or t_vm.count("size") == 0)) {
+    t_err << "Must specifiy OFFSET:SIZE, or --offset and --size of region to erase!\n";
+    return std::nullopt;
+  }
+
+  if (not is_erase and t_files.empty()) {
+    t_err << "Must specifiy a file!\n";
+    return std::nullopt;
+  }
+
+  if (t_command == "read" and t_files.size() != 1) {
+    t_err << "read takes one file!\n";
+    return std::nullopt;
+  }
+
+  auto option = make_option(t_vm, t_err);
+  if (not option.has_value()) {
+    return std::nullopt;
+  }
+
+  Job job;
+  job.chip_   = t_vm["chip"].as<std::string>();
+  job.option_ = *std::move(option);
+  if (t_command == "read") {
+    job.operation_ = Operation::Read;
+    job.file_      = t_files.back();
+    return job;
+  }
+
+  if (is_erase) {
+    job.operation_  = Operation::Erase;
+    job.whole_chip_ = t_command == "erase-flash";
+    if (t_files.empty()) {
+      job.ranges_.push_back({job.whole_chip_ ? 0U : job.option_.offset_, job.option_.size_});
+    }
+    for (auto const& arg : t_files) {
+      auto const range = esplink::parse_flash_range(arg);
+      if (not range.has_value()) {
+        t_err << "Range to erase " << arg << " must be given as OFFSET:SIZE in hex!\n";
+        return std::nullopt;
+      }
+      job.ranges_.push_back(*range);
+    }
+    return job;
+  }
+
+  if (t_command == "verify") {
+    job.operation_      = Operation::Verify;
+    job.option_.verify_ = true;
+    job.option_.write_  = false;
+  }
+
+  // a single file may be written at --offset, several must each be given their own offset
+  for (auto const& file : t_files) {
+    auto image = esplink::parse_image_file(file);
+    if (not image.has_value() and t_files.size() > 1) {
+      t_err << "Using several files, " << file << " must be given as OFFSET:FILE!\n";
+      return std::nullopt;
+    }
+    job.images_.push_back(std::move(image).value_or(ImageFile{job.option_.offset_, file}));
+  }
+
+  if (not get_flash_fn().contains(job.chip_)) {
+    t_err << "Unsupported chip " << job.chip_ << '\n';
+    return std::nullopt;
+  }
+
+  return job;
+}
+
+}  // namespace esplink::flash
@@ -0,0 +1,274 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <boost/asio.hpp>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <optional>
+#include <span>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+#include <vector>
+
+#include "esp_common/chip.hpp"
+#include "esp_common/mapped_file.hpp"
+#include "esp_flash/flash_option.hpp"
+#include "esp_flash/report.hpp"
+#include "esp_mkbin/elf_reader.hpp"
+#include "esp_serial/boot_cmd.hpp"
+#include "esp_serial/serial_port.hpp"
+#include "esp_serial/slip.hpp"
+
+namespace esplink::flash {
+
+using namespace std::chrono_literals;
+
+using Loader = esplink::Serial<esplink::ESPSLIP>;
+using boost::asio::awaitable;
+
+inline constexpr std::uint32_t MAX_FLASH_SIZE = 16 * 1024 * 1024;
+
+/**
+ * @brief This function splits t_data into DataCommand packets of at most BlockSize bytes, packets view t_data in place,
+ *        therefore t_data must outlive them
+ */
+template <typename DataCommand, std::uint32_t BlockSize>
+auto split_into_blocks(std::span<char const> const t_data) {
+  auto const data_size    = static_cast<std::uint32_t>(t_data.size());
+  auto const packet_count = (data_size + BlockSize - 1) / BlockSize;
+
+  std::vector<DataCommand> blocks;
+  blocks.reserve(packet_count);
+  for (std::uint32_t sequence = 0; sequence < packet_count; ++sequence) {
+    auto const block_offset = sequence * BlockSize;
+    auto const block_size   = std::min(BlockSize, data_size - block_offset);
+    auto const block        = esplink::command::FLASH_DATA<BlockSize>{block_size, sequence,  //
+                                                                  t_data.subspan(block_offset, block_size)};
+    blocks.push_back(DataCommand{block});
+  }
+
+  return blocks;
+}
+
+/**
+ * @brief This function uploads flasher stub to RAM of esp chip and runs it, every loadable section of the stub elf
+ *        is uploaded to its load address, and the stub is started at the elf entry point. ROM loader writes MEM_DATA
+ *        at its running pointer, whatever its sequence number, so a packet sent again after its response is lost
+ *        would be written twice. A section losing a packet either way is uploaded again from MEM_BEGIN instead.
+ *
+ * @param t_loader  Serial port connected to ROM loader
+ * @param t_stub    Path to elf file of flasher stub
+ *
+ * @throw std::runtime_error if a section fails UPLOAD_RETRY times, or the stub doesn't greet once started
+ */
+inline awaitable<void> upload_stub(Loader& t_loader, std::filesystem::path const t_stub) {
+  esplink::MappedFile const stub_file{t_stub};
+  std::optional<esplink::ELFView<esplink::Format::x86>> elf;
+  try {
+    elf.emplace(stub_file.data());
+  } catch (std::exception const& t_e) {
+    throw std::invalid_argument(fmt::format("Flasher stub must be an ELF32 file: {}", t_e.what()));
+  }
+
+  constexpr std::uint32_t RAM_BLOCK_SIZE = 0x1800;
+  constexpr int UPLOAD_RETRY             = 3;
+  for (auto const& [name, section, data] : elf->loadable_sections()) {
+    spdlog::info("Uploading flasher stub section {} ({} bytes) to {:#x}", name, section.size_, section.addr_);
+    auto const blocks       = split_into_blocks<esplink::command::MEM_DATA<RAM_BLOCK_SIZE>, RAM_BLOCK_SIZE>(data);
+    auto const packet_count = static_cast<std::uint32_t>(blocks.size());
+    for (int attempt = 1;; ++attempt) {
+      try {
+        co_await t_loader.async_transceive(
+          esplink::command::MEM_BEGIN{section.size_, packet_count, RAM_BLOCK_SIZE, section.addr_}, 1, 1000ms);
+        co_await t_loader.async_transceive_pipelined(blocks, 1, 1, 1000ms);
+        break;
+      } catch (std::runtime_error const& t_e) {
+        if (attempt == UPLOAD_RETRY) {
+          throw;
+        }
+        spdlog::warn("Uploading flasher stub section {} again: {}", name, t_e.what());
+      }
+    }
+  }
+
+  auto const entry = elf->file_header().entry_;
+  spdlog::info("Running flasher stub at {:#x}", entry);
+  co_await t_loader.async_transceive(esplink::command::MEM_END{entry}, 1, 1000ms);
+  if (not co_await t_loader.async_wait_for_frame("OHAI", 1000ms)) {
+    throw std::runtime_error("Flasher stub doesn't respond after upload");
+  }
+
+  t_loader.get_protocol().set_status_size(esplink::ESPSLIP::STUB_STATUS_SIZE);
+}
+
+/**
+ * @brief This function switches both ends to the highest baudrate, not greater than t_max_baud, that the serial driver
+ *        accepts and that passes a short integrity probe. If switching or the probe fails, the link can't be trusted
+ *        to carry CHANGE_BAUDRATE back, therefore the chip is reset into ROM loader at the baudrate negotiation starts
+ *        from, brought back by t_reconnect, and the next lower baudrate is tried.
+ *
+ * @param t_chip_id   Chip id read during connection, used to verify probe responses
+ * @param t_reconnect Brings ROM loader, just reset into, back to the state negotiation starts from, e.g. stub running
+ * @return Baudrate used from now on
+ *
+ * @throw std::runtime_error if the chip can't be brought back after a failed attempt
+ */
+inline awaitable<std::uint32_t> negotiate_baud_rate(Loader& t_loader, std::uint32_t const t_chip_id,
+                                                    std::uint32_t const t_max_baud, bool const t_stub_running,
+                                                    std::function<awaitable<void>()> const& t_reconnect) {
+  constexpr std::array CANDIDATE_BAUDS = {3'000'000U, 2'000'000U, 1'500'000U, 921'600U, 460'800U, 230'400U};
+  constexpr auto PROBE_COUNT           = 8;
+  constexpr auto SETTLE_TIME           = 50ms;
+
+  // lambdas below are awaited right away, therefore it's safe for them to capture by reference
+  auto const probe = [&]() -> awaitable<bool> {
+    try {
+      for (int i = 0; i < PROBE_COUNT; ++i) {
+        auto const chip_id = co_await t_loader.async_transceive(esplink::command::READ_REG<0x4000'1000>(), 1);
+        if (chip_id.value_ != t_chip_id) {
+          co_return false;
+        }
+      }
+      co_return true;
+    } catch (std::runtime_error const& t_e) {
+      spdlog::warn("Integrity probe failed: {}", t_e.what());
+      co_return false;
+    }
+  };
+
+  auto const switch_baud_rate = [&](std::uint32_t const t_from, std::uint32_t const t_to) -> awaitable<void> {
+    co_await t_loader.async_transceive(esplink::command::CHANGE_BAUDRATE{t_to, t_stub_running ? t_from : 0}, 3);
+    co_await t_loader.async_set_baud_rate(t_to);
+
+    boost::asio::steady_timer settle_timer{t_loader.get_io_context(), SETTLE_TIME};
+    co_await settle_timer.async_wait(boost::asio::use_awaitable);
+    co_await t_loader.async_discard_input();
+  };
+
+  auto const working_baud = t_loader.get_baud_rate();
+  for (auto const baud : CANDIDATE_BAUDS) {
+    if (baud > t_max_baud or baud <= working_baud) {
+      continue;
+    }
+
+    // only tells whether the driver accepts the baudrate, whether the adapter keeps up is up to the probe
+    try {
+      co_await t_loader.async_set_baud_rate(baud);
+      co_await t_loader.async_set_baud_rate(working_baud);
+    } catch (boost::system::system_error const& t_e) {
+      spdlog::info("Serial driver doesn't accept {} bps: {}", baud, t_e.what());
+      continue;
+    }
+
+    try {
+      co_await switch_baud_rate(working_baud, baud);
+      if (co_await probe()) {
+        co_return baud;
+      }
+    } catch (std::runtime_error const& t_e) {
+      spdlog::warn("Failed to switch to {} bps: {}", baud, t_e.what());
+    }
+
+    spdlog::warn("Link is unreliable at {} bps, resetting chip back to {} bps", baud, working_baud);
+    try {
+      co_await t_loader.async_reset(working_baud);
+      co_await t_reconnect();
+    } catch (std::runtime_error const& t_e) {
+      throw std::runtime_error(fmt::format("Lost connection after switching to {} bps: {}", baud, t_e.what()));
+    }
+  }
+
+  co_return working_baud;
+}
+
+/**
+ * @brief This function runs t_session, then closes t_loader whether t_session succeeds or not
+ */
+inline awaitable<void> close_after(Loader& t_loader, awaitable<void> t_session) {
+  std::exception_ptr error;
+  try {
+    co_await std::move(t_session);
+  } catch (...) {
+    error = std::current_exception();
+  }
+
+  co_await t_loader.async_close();
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+/**
+ * @brief What is learned about esp chip while connecting
+ */
+struct ChipInfo {
+  std::array<std::uint8_t, 4> image_header_{};  // first bytes of flash, holding flash parameters if an image is there
+  bool stub_running_ = false;
+
+  [[nodiscard]] bool has_image() const noexcept { return this->image_header_[0] == esplink::ESP_MAGIC_NUMBER; }
+  [[nodiscard]] std::uint8_t spi_mode() const noexcept { return this->image_header_[2]; }
+  [[nodiscard]] std::uint8_t spi_speed() const noexcept {
+    return static_cast<std::uint8_t>(this->image_header_[3] >> 4U);
+  }
+  [[nodiscard]] std::uint8_t flash_chip_size() const noexcept {
+    return static_cast<std::uint8_t>(this->image_header_[3] & 0xFU);
+  }
+
+  /**
+   * @brief Size of flash in bytes as given by image header, which is 1 MB shifted left by the size code, 0 if there's
+   *        no image
+   */
+  [[nodiscard]] std::uint32_t flash_size() const noexcept {
+    return this->has_image() ? std::min(0x100000U << this->flash_chip_size(), MAX_FLASH_SIZE) : 0U;
+  }
+};
+
+/**
+ * @brief Connection sequence, SYNC -> READ_REG -> SPI_ATTACH -> SPI_SET_PARAMS -> FLASH_READ_SLOW of image header,
+ *        followed by uploading flasher stub and baudrate negotiation if t_option asks for them
+ */
+inline awaitable<ChipInfo> connect(Loader& loader, FlashOption const& t_option, DeviceReport const& t_report) {
+  co_await loader.async_transceive(esplink::command::SYNC(), 50);
+
+  auto const chip_id_ret          = co_await loader.async_transceive(esplink::command::READ_REG<0x4000'1000>(), 50);
+  auto const [chip_id, chip_name] = esplink::get_chip_info(chip_id_ret.value_);
+  spdlog::info("{}: ESP chip detected, (id, chip name) = ({:#x}, {})", t_report.port_, esplink::to_underlying(chip_id),
+               chip_name);
+
+  co_await loader.async_transceive(esplink::command::SPI_ATTACH());
+  co_await loader.async_transceive(esplink::command::SPI_SET_PARAMS());
+  auto const flash_read = co_await loader.async_transceive(esplink::command::FLASH_READ_SLOW{0, 16}, 0, 2000ms);
+
+  ChipInfo info;
+  std::copy_n(flash_read.data_.begin(), std::min(flash_read.data_.size(), info.image_header_.size()),
+              info.image_header_.begin());
+
+  // stub doesn't implement FLASH_READ_SLOW, therefore it is started after flash header is read by ROM
+  info.stub_running_ = t_option.stub_.has_value();
+  if (info.stub_running_) {
+    co_await upload_stub(loader, *t_option.stub_);
+  }
+
+  if (t_option.max_baud_ > t_option.baud_) {
+    // flash header is known already, chip reset by a failed attempt only needs to be attached and given stub again
+    auto const reconnect = [&]() -> awaitable<void> {
+      loader.get_protocol().set_status_size(esplink::ESPSLIP::ROM_STATUS_SIZE);
+      co_await loader.async_transceive(esplink::command::SYNC(), 50);
+      co_await loader.async_transceive(esplink::command::SPI_ATTACH());
+      co_await loader.async_transceive(esplink::command::SPI_SET_PARAMS());
+      if (info.stub_running_) {
+        co_await upload_stub(loader, *t_option.stub_);
+      }
+    };
+
+    auto const baud = co_await negotiate_baud_rate(loader, chip_id_ret.value_, t_option.max_baud_, info.stub_running_,
+                                                   reconnect);
+    spdlog::info("{}: Using {} bps for the rest of the session", t_report.port_, baud);
+  }
+
+  co_return info;
+}
+
+}  // namespace esplink::flash
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <fmt/format.h>
+#include <fstream>
+#include <optional>
+#include <spdlog/spdlog.h>
+#include <string>
+#include <vector>
+
+#include "esp_flash/flash_option.hpp"
+#include "esp_serial/metrics.hpp"
+
+namespace esplink::flash {
+
+/**
+ * @brief Progress and outcome of flashing one device, or reading its flash
+ */
+struct DeviceReport {
+  std::string port_;
+  std::uint32_t to_write_ = 0;  // bytes of image to write, after unchanged sectors are skipped, or bytes to read
+  std::uint32_t written_  = 0;
+  std::chrono::steady_clock::time_point start_{std::chrono::steady_clock::now()};
+  std::chrono::steady_clock::duration elapsed_{};
+  std::optional<std::string> error_;
+
+  void advance(std::uint32_t const t_bytes) {
+    constexpr std::uint32_t STEP_PERCENT = 10;
+    auto const percent                   = [this]() { return this->written_ * 100ULL / std::max(this->to_write_, 1U); };
+
+    auto const last_step = percent() / STEP_PERCENT;
+    this->written_       = std::min(this->written_ + t_bytes, this->to_write_);
+    if (percent() / STEP_PERCENT != last_step) {
+      spdlog::info("{}: {}% ({} / {} bytes)", this->port_, percent(), this->written_, this->to_write_);
+    }
+  }
+};
+
+/**
+ * @brief This function logs outcome of every device, and of all of them
+ *
+ * @return Lines logged, so that the daemon can send them to the client asking for the job
+ */
+inline std::vector<std::string> summarize(std::vector<DeviceReport> const& t_reports,
+                                          std::chrono::steady_clock::duration const t_elapsed,
+                                          Operation const t_operation) {
+  using FloatSecond = std::chrono::duration<double>;
+
+  // wording of bytes transferred and of devices done, by operation
+  constexpr std::array TRANSFERRED = {"written", "read", "erased", "verified"};
+  constexpr std::array DONE        = {"flashed", "read", "erased", "verified"};
+  auto const transferred           = TRANSFERRED.at(static_cast<std::size_t>(esplink::to_underlying(t_operation)));
+
+  std::vector<std::string> lines;
+  std::size_t failed = 0;
+  for (auto const& report : t_reports) {
+    auto const seconds = std::chrono::duration_cast<FloatSecond>(report.elapsed_).count();
+    if (report.error_.has_value()) {
+      ++failed;
+      lines.push_back(fmt::format("{}: FAILED after {:.1f} s, {} / {} bytes {}: {}", report.port_, seconds,
+                                  report.written_, report.to_write_, transferred, *report.error_));
+      spdlog::error("{}", lines.back());
+    } else {
+      lines.push_back(fmt::format("{}: OK in {:.1f} s, {} bytes {} ({:.1f} KiB/s)", report.port_, seconds,
+                                  report.written_, transferred, report.written_ / 1024.0 / std::max(seconds, 1e-3)));
+      spdlog::info("{}", lines.back());
+    }
+  }
+
+  std::size_t const succeeded = t_reports.size() - failed;
+  lines.push_back(fmt::format("{} of {} devices {} in {:.1f} s", succeeded, t_reports.size(),
+                              DONE.at(static_cast<std::size_t>(esplink::to_underlying(t_operation))),
+                              std::chrono::duration_cast<FloatSecond>(t_elapsed).count()));
+  spdlog::info("{}", lines.back());
+  return lines;
+}
+
+/**
+ * @brief This function writes per command metrics of t_ports to the file given by t_option, so that runs can be
+ *        compared or collected by monitoring
+ */
+inline void write_metrics(std::vector<esplink::PortMetrics> const& t_ports, FlashOption const& t_option) {
+  std::ofstream file{*t_option.metrics_};
+  file << (t_option.prometheus_ ? esplink::to_prometheus(t_ports) : esplink::to_json(t_ports));
+  if (not file) {
+    spdlog::error("Failed to write metrics to {}", t_option.metrics_->string());
+  }
+}
+
+/**
+ * @brief Completion handler of session spawned for t_report, recording how long the session takes, and why it fails
+ */
+inline auto record_outcome(DeviceReport& t_report) {
+  return [&t_report](std::exception_ptr const& t_error) {
+    t_report.elapsed_ = std::chrono::steady_clock::now() - t_report.start_;
+    try {
+      if (t_error) {
+        std::rethrow_exception(t_error);
+      }
+    } catch (std::exception const& t_e) {
+      t_report.error_ = t_e.what();
+    }
+  };
+}
+
+}  // namespace esplink::flash
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <glob.h>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "esp_flash/flash_option.hpp"
+#include "esp_flash/loader.hpp"
+#include "esp_flash/report.hpp"
+#include "esp_flash/session.hpp"
+
+namespace esplink::flash {
+
+/**
+ * @brief This function expands t_patterns, each of which may be a comma separated list of ports or glob patterns,
+ *        e.g. "/dev/ttyUSB*", into a sorted list of distinct ports
+ */
+inline std::vector<std::string> expand_ports(std::vector<std::string> const& t_patterns) {
+  std::set<std::string> ports;
+  for (auto const& patterns : t_patterns) {
+    std::stringstream stream{patterns};
+    for (std::string pattern; std::getline(stream, pattern, ',');) {
+      if (pattern.empty()) {
+        continue;
+      }
+
+      glob_t matches{};
+      if (glob(pattern.c_str(), 0, nullptr, &matches) == 0) {
+        ports.insert(matches.gl_pathv, matches.gl_pathv + matches.gl_pathc);  // NOLINT
+      } else if (pattern.find_first_of("*?[") == std::string::npos) {
+        ports.insert(pattern);  // let opening the port report the error
+      } else {
+        spdlog::warn("No port matches {}", pattern);
+      }
+      globfree(&matches);
+    }
+  }
+
+  return {ports.begin(), ports.end()};
+}
+
+/**
+ * @brief This function connects t_loader, then runs t_session on the chip connected
+ */
+inline awaitable<void> connect_and_run(Loader& t_loader, FlashOption const& t_option, Session const& t_session,
+                                       DeviceReport& t_report) {
+  auto const chip = co_await connect(t_loader, t_option, t_report);
+  co_await t_session(t_loader, chip, t_report);
+}
+
+using OpenError = std::function<void(std::size_t, std::string const&)>;  // index of the port, and why it fails
+
+/**
+ * @brief This function opens every one of t_ports on t_context, all at the same time, since opening a port resets the
+ *        chip, which takes a while
+ *
+ * @return Loader of every port, null for a port that fails to open, whose index and error are given to t_on_error
+ */
+inline std::vector<std::unique_ptr<Loader>> open_ports(boost::asio::io_context& t_context,
+                                                       std::vector<std::string> const& t_ports,
+                                                       std::uint32_t const t_baud, OpenError const& t_on_error) {
+  std::vector<std::future<std::unique_ptr<Loader>>> opening;
+  for (auto const& port : t_ports) {
+    opening.push_back(std::async(std::launch::async, [&t_context, &port, t_baud]() {
+      return std::make_unique<Loader>(t_context, port, t_baud);
+    }));
+  }
+
+  std::vector<std::unique_ptr<Loader>> loaders(t_ports.size());
+  for (std::size_t i = 0; i < loaders.size(); ++i) {
+    try {
+      loaders[i] = opening[i].get();
+    } catch (std::exception const& t_e) {
+      t_on_error(i, t_e.what());
+    }
+  }
+
+  return loaders;
+}
+
+/**
+ * @brief This function runs t_session on every port in t_option concurrently, on one io_context, and summarizes their
+ *        outcome
+ *
+ * @return true if every session succeeds
+ */
+inline bool run_sessions(FlashOption const& t_option, Operation const t_operation, Session const& t_session) {
+  auto const start = std::chrono::steady_clock::now();
+
+  std::vector<DeviceReport> reports(t_option.ports_.size());
+  for (std::size_t i = 0; i < reports.size(); ++i) {
+    reports[i].port_ = t_option.ports_[i];
+  }
+
+  boost::asio::io_context context;
+  auto const on_error = [&reports](std::size_t const t_index, std::string const& t_error) {
+    auto& report    = reports[t_index];
+    report.error_   = t_error;
+    report.elapsed_ = std::chrono::steady_clock::now() - report.start_;
+  };
+  auto loaders = open_ports(context, t_option.ports_, t_option.baud_, on_error);
+
+  for (std::size_t i = 0; i < reports.size(); ++i) {
+    if (loaders[i] == nullptr) {
+      continue;
+    }
+
+    auto& loader = *loaders[i];
+    boost::asio::co_spawn(context, close_after(loader, connect_and_run(loader, t_option, t_session, reports[i])),
+                          record_outcome(reports[i]));
+  }
+
+  context.run();
+
+  summarize(reports, std::chrono::steady_clock::now() - start, t_operation);
+  if (t_option.metrics_.has_value()) {
+    std::vector<esplink::PortMetrics> ports;
+    for (std::size_t i = 0; i < loaders.size(); ++i) {
+      if (loaders[i] != nullptr) {
+        ports.push_back({reports[i].port_, loaders[i]->metrics()});
+      }
+    }
+    write_metrics(ports, t_option);
+  }
+
+  return std::none_of(reports.begin(), reports.end(), [](auto const& t_report) { return t_report.error_.has_value(); });
+}
+
+}  // namespace esplink::flash
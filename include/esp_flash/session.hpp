@@ -0,0 +1,716 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fmt/format.h>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <optional>
+#include <span>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "esp_common/md5.hpp"
+#include "esp_flash/flash_option.hpp"
+#include "esp_flash/image_store.hpp"
+#include "esp_flash/loader.hpp"
+#include "esp_flash/report.hpp"
+#include "esp_serial/erase_plan.hpp"
+#include "esp_serial/image_layout.hpp"
+#include "esp_serial/serial_port.hpp"
+
+namespace esplink::flash {
+
+using namespace std::chrono_literals;
+
+inline constexpr std::uint32_t SECTOR_SIZE  = esplink::ErasePlan::SECTOR_SIZE;
+inline constexpr std::uint32_t SEGMENT_SIZE = 0x40000;  // multiple of sector and of every block size
+inline constexpr auto DATA_TIMEOUT          = 1500ms;   // worst case of one block, timeout adapts to the link below it
+inline constexpr int BEGIN_RETRY            = 3;        // segment begins with FLASH_BEGIN, losing one isn't fatal
+inline constexpr int DATA_RETRY             = 2;        // attempts of each request safe to send again
+inline constexpr int WRITE_RETRY            = 3;        // rounds of writing again sectors that differ, with no progress
+inline constexpr std::size_t MD5_WINDOW     = 4;        // ROM loader hashing flash leaves its small UART FIFO undrained
+
+/**
+ * @brief This function parses MD5 digest reported by esp chip, ROM loader replies 32 hex characters, flasher stub
+ *        replies 16 raw bytes
+ */
+inline esplink::MD5::Digest parse_digest(std::vector<std::uint8_t> const& t_data) {
+  esplink::MD5::Digest digest{};
+  constexpr auto HEX_DIGEST_SIZE = 2 * std::tuple_size_v<esplink::MD5::Digest>;
+  if (t_data.size() >= HEX_DIGEST_SIZE) {
+    for (std::size_t i = 0; i < digest.size(); ++i) {
+      std::from_chars(reinterpret_cast<char const*>(&t_data[2 * i]),      // NOLINT
+                      reinterpret_cast<char const*>(&t_data[2 * i + 2]),  // NOLINT
+                      digest[i], 16);
+    }
+  } else if (t_data.size() >= digest.size()) {
+    std::copy_n(t_data.begin(), digest.size(), digest.begin());
+  }
+
+  return digest;
+}
+
+/**
+ * @brief This function splits t_regions into chunks of t_chunk_size bytes, and compares each of them with flash
+ *        content, using MD5 digest computed by esp chip. Every region must begin at a multiple of t_chunk_size.
+ *
+ * @param t_window Number of digests requested at once, since responses can't be told apart, a lost request is only
+ *                 sent again if t_window is 1
+ * @return Chunks that differ, adjacent ones merged into regions
+ * @throw std::runtime_error if a digest can't be read
+ */
+inline awaitable<std::vector<Region>> diff_chunks(Loader& t_loader, PreparedImage& t_image,
+                                                  std::vector<Region> const& t_regions,
+                                                  std::uint32_t const t_chunk_size, std::size_t const t_window) {
+  auto const chunks = esplink::split_regions(t_regions, t_chunk_size);
+  std::vector<esplink::command::SPI_FLASH_MD5> requests;
+  requests.reserve(chunks.size());
+  for (auto const& chunk : chunks) {
+    requests.push_back({t_image.offset() + chunk.begin_, chunk.size_});
+  }
+
+  std::vector<bool> changed(chunks.size(), true);
+  auto const compare_digest = [&](std::size_t const t_idx, auto const& t_response) {
+    auto const& expected = t_image.chunk_digest(t_chunk_size, chunks[t_idx].begin_ / t_chunk_size);
+    changed[t_idx]       = parse_digest(t_response.data_) != expected;
+  };
+  co_await t_loader.async_transceive_pipelined(requests, t_window, t_window == 1 ? DATA_RETRY : 1, 1000ms,
+                                               compare_digest);
+
+  std::vector<Region> regions;
+  for (std::size_t i = 0; i < chunks.size(); ++i) {
+    if (not changed[i]) {
+      continue;
+    }
+
+    if (not regions.empty() and regions.back().begin_ + regions.back().size_ == chunks[i].begin_) {
+      regions.back().size_ += chunks[i].size_;
+    } else {
+      regions.push_back(chunks[i]);
+    }
+  }
+
+  co_return regions;
+}
+
+/**
+ * @brief This function compares t_image with flash content, first block by block, then sector by sector within blocks
+ *        that differ, so that an image mostly unchanged costs few round trips
+ *
+ * @return Regions to write, or std::nullopt if the comparison can't be made and whole image should be written
+ */
+inline awaitable<std::optional<std::vector<Region>>> find_changed_regions(Loader& t_loader, PreparedImage& t_image) {
+  // regions must start at sector boundary, otherwise erasing them also erases unchanged data in the same sector
+  if (t_image.offset() % SECTOR_SIZE != 0) {
+    spdlog::warn("Flash offset {:#x} isn't aligned to sector, write whole image", t_image.offset());
+    co_return std::nullopt;
+  }
+
+  constexpr std::uint32_t DIFF_BLOCK_SIZE = 0x10000;
+  auto const image_size                   = static_cast<std::uint32_t>(t_image.data().size());
+
+  std::vector<Region> regions{{0, image_size}};
+  std::size_t digest_count = 0;
+  for (auto const chunk_size : {DIFF_BLOCK_SIZE, SECTOR_SIZE}) {
+    digest_count += esplink::split_regions(regions, chunk_size).size();
+    try {
+      regions = co_await diff_chunks(t_loader, t_image, regions, chunk_size, MD5_WINDOW);
+    } catch (std::runtime_error& t_e) {
+      spdlog::warn("Failed to read flash digest ({}), write whole image", t_e.what());
+      co_return std::nullopt;
+    }
+  }
+
+  auto const changed_size = std::accumulate(regions.begin(), regions.end(), std::uint32_t{0},
+                                            [](auto const t_sum, auto const& t_rgn) { return t_sum + t_rgn.size_; });
+  spdlog::info("{} of {} bytes differ from flash content, in {} regions, found by {} digests", changed_size, image_size,
+               regions.size(), digest_count);
+  co_return regions;
+}
+
+/**
+ * @brief Regions written of one image, to be checked against digests of the image, which are being computed
+ */
+struct Verification {
+  std::uint32_t offset_;  // flash offset of the image
+  std::vector<Region> regions_;
+  std::shared_ptr<PendingDigests> digests_;
+};
+
+/**
+ * @brief This function checks regions written against digests of their images, using MD5 digest computed by esp
+ *        chip. Requests of every image are pipelined, MD5_WINDOW at a time, so that flasher stub, which keeps draining
+ *        UART while hashing flash, costs little more than the time it takes to read flash, while the small UART FIFO
+ *        of ROM loader doesn't overflow. Digests of images are computed while regions are being written, and waited
+ *        for without blocking sessions of other devices.
+ *
+ * @throw std::runtime_error if any region differs from its image
+ */
+inline awaitable<void> verify_regions(Loader& t_loader, std::vector<Verification> const& t_verifications,
+                                      DeviceReport const& t_report) {
+  constexpr auto MD5_TIME_PER_MB = 8000ms;  // esp chip reads and hashes flash at 1 MB per 8 s in the worst case
+  constexpr auto MIN_MD5_TIMEOUT = 3000ms;
+
+  std::vector<esplink::command::SPI_FLASH_MD5> requests;
+  std::uint32_t largest = 0;
+  for (auto const& [offset, regions, digests] : t_verifications) {
+    for (auto const& region : regions) {
+      requests.push_back({offset + region.begin_, region.size_});
+      largest = std::max(largest, region.size_);
+    }
+  }
+
+  std::vector<esplink::MD5::Digest> flash_digests(requests.size());
+  auto const store_digest = [&](std::size_t const t_idx, auto const& t_response) {
+    flash_digests[t_idx] = parse_digest(t_response.data_);
+  };
+
+  auto const timeout = std::max(MIN_MD5_TIMEOUT, MD5_TIME_PER_MB * largest / (1024 * 1024));
+  for (int attempt = 1;; ++attempt) {
+    // a lost request shifts responses behind it, so every digest is requested again
+    try {
+      co_await t_loader.async_transceive_pipelined(requests, MD5_WINDOW, 1, timeout, store_digest);
+      break;
+    } catch (esplink::PipelineError const& t_e) {
+      if (attempt == DATA_RETRY) {
+        throw;
+      }
+      spdlog::warn("{}: {}, requesting every flash digest again", t_report.port_, t_e.what());
+    }
+  }
+
+  std::vector<esplink::MD5::Digest> image_digests;
+  for (auto const& verification : t_verifications) {
+    auto const* const digests = co_await verification.digests_->async_get();
+    image_digests.insert(image_digests.end(), digests->begin(), digests->end());
+  }
+
+  std::size_t mismatch = 0;
+  for (std::size_t i = 0; i < requests.size(); ++i) {
+    if (flash_digests[i] != image_digests[i]) {
+      spdlog::error("{}: Flash at {:#x} ({} bytes) differs from image", t_report.port_, requests[i].address_,
+                    requests[i].size_);
+      ++mismatch;
+    }
+  }
+
+  if (mismatch != 0) {
+    throw std::runtime_error(fmt::format("Verification failed, {} of {} regions differ", mismatch, requests.size()));
+  }
+
+  spdlog::info("{}: Verified {} regions against flash digest", t_report.port_, requests.size());
+}
+
+/**
+ * @brief This function picks the block size, up to t_max_block_size, that delivers the most data per second over the
+ *        link measured so far. Larger block spreads overhead of each round trip over more bytes, but is more likely to
+ *        be corrupted, and costs a timeout to send again.
+ */
+inline std::uint32_t choose_block_size(esplink::LinkEstimator const& t_link, std::uint32_t const t_max_block_size) {
+  constexpr std::array CANDIDATE_BLOCK_SIZES = {0x400U, 0x800U, 0x1000U, 0x2000U, 0x4000U};
+  if (not t_link.ready()) {
+    return t_max_block_size;
+  }
+
+  using Seconds           = esplink::LinkEstimator::Seconds;
+  std::uint32_t best_size = CANDIDATE_BLOCK_SIZES.front();
+  double best_rate        = 0;
+  for (auto const block_size : CANDIDATE_BLOCK_SIZES) {
+    if (block_size > t_max_block_size) {
+      break;
+    }
+
+    // attempts needed are geometrically distributed, every failed attempt costs a timeout
+    auto const delivered = std::pow(1 - t_link.byte_error_rate(), block_size);
+    auto const attempt   = t_link.predict(block_size).count();
+    auto const failure   = std::chrono::duration_cast<Seconds>(t_link.timeout(block_size, DATA_TIMEOUT)).count();
+    auto const expected  = attempt + (1 - delivered) / std::max(delivered, 1e-9) * failure;
+    auto const rate      = block_size / std::max(expected, 1e-9);
+    if (rate >= best_rate) {
+      best_size = block_size;
+      best_rate = rate;
+    }
+  }
+
+  return best_size;
+}
+
+/**
+ * @brief This function begins writing t_region of t_image to flash, compressed if the chip accepts it, and sends every
+ *        block of BlockSize bytes once
+ *
+ * @param t_compressed Set to whether data is sent compressed, before the first block is sent
+ * @throw esplink::PipelineError if a block fails, blocks ahead of it are written
+ */
+template <std::uint32_t BlockSize>
+awaitable<void> write_blocks(Loader& t_loader, PreparedImage& t_image, Region const t_region,
+                             FlashOption const& t_option, bool const t_stub_running, DeviceReport& t_report,
+                             bool& t_compressed) {
+  auto const data           = t_image.data(t_region);
+  auto const flash_offset   = t_image.offset() + t_region.begin_;
+  auto const data_size      = static_cast<std::uint32_t>(data.size());
+  auto const packet_size    = (data_size + BlockSize - 1) / BlockSize;
+  auto const report_written = [&](std::size_t const t_block, auto const& /**/) {
+    t_report.advance(std::min(BlockSize, data_size - static_cast<std::uint32_t>(t_block) * BlockSize));
+  };
+
+  if (t_option.compress_) {
+    auto compressed               = t_image.compressed(t_region);
+    auto const compressed_size    = static_cast<std::uint32_t>(compressed.size());
+    auto const compressed_packets = (compressed_size + BlockSize - 1) / BlockSize;
+    spdlog::info("{}: Compressed {} bytes to {} bytes ({:.1f}%)", t_report.port_, data_size, compressed_size,
+                 100.0 * compressed_size / std::max(data_size, 1U));
+
+    // ROM expects erase size rounded up to block size of uncompressed data, while stub expects the exact size
+    auto const erase_size = t_stub_running ? data_size : packet_size * BlockSize;
+    try {
+      spdlog::info("{}: Erasing {} bytes in flash at offset {:#x}", t_report.port_, data_size, flash_offset);
+      co_await t_loader.async_transceive(
+        esplink::command::FLASH_DEFL_BEGIN{{erase_size, compressed_packets, BlockSize, flash_offset}}, BEGIN_RETRY,
+        esplink::ErasePlan::timeout(flash_offset, erase_size));
+    } catch (std::runtime_error& t_e) {
+      spdlog::warn("{}: Compressed flashing is rejected ({}), fall back to uncompressed flashing", t_report.port_,
+                   t_e.what());
+      compressed = {};
+    }
+
+    if (not compressed.empty()) {
+      // a compressed block may inflate to many blocks, which takes longer to write
+      constexpr auto WRITE_TIME_PER_MB = 40000ms;
+      auto const inflated_per_block    = BlockSize * data_size / std::max(compressed_size, 1U);
+      auto const block_timeout         = std::max(DATA_TIMEOUT, WRITE_TIME_PER_MB * inflated_per_block / (1024 * 1024));
+
+      auto const report_inflated = [&](std::size_t, auto const& /**/) { t_report.advance(inflated_per_block); };
+      t_compressed               = true;
+
+      auto const blocks = split_into_blocks<esplink::command::FLASH_DEFL_DATA<BlockSize>, BlockSize>(compressed);
+      co_await t_loader.async_transceive_pipelined(blocks, t_option.window_, 1,
+                                                   esplink::Timeout::adaptive(block_timeout), report_inflated);
+      co_return;
+    }
+  }
+
+  spdlog::info("{}: Erasing {} bytes in flash at offset {:#x}", t_report.port_, data_size, flash_offset);
+  co_await t_loader.async_transceive(esplink::command::FLASH_BEGIN{data_size, packet_size, BlockSize, flash_offset},
+                                     BEGIN_RETRY, esplink::ErasePlan::timeout(flash_offset, data_size));
+
+  auto const blocks = split_into_blocks<esplink::command::FLASH_DATA<BlockSize>, BlockSize>(data);
+  t_compressed      = false;
+  co_await t_loader.async_transceive_pipelined(blocks, t_option.window_, 1, esplink::Timeout::adaptive(DATA_TIMEOUT),
+                                               report_written);
+}
+
+/**
+ * @brief This function writes t_region of t_image to flash, compressed if the chip accepts it, in blocks of BlockSize
+ *        bytes. Flashing is left open, so that several regions can be written before FLASH_END. Blocks are waited for
+ *        as long as the link measured so far suggests, so that a lost block is found out soon.
+ *
+ *        Loader writes every block at its running write pointer whatever its sequence number, and a lost block shifts
+ *        responses behind it, so a failed block can't be told, nor sent again behind the blocks in flight. Sectors of
+ *        t_region are compared with flash content instead, and those that differ are written again.
+ *
+ * @param t_stub_running Whether flasher stub is running, which interprets erase size of FLASH_DEFL_BEGIN differently
+ * @return true if data is sent compressed, which should be ended by FLASH_DEFL_END
+ */
+template <std::uint32_t BlockSize>
+awaitable<bool> write_region(Loader& t_loader, PreparedImage& t_image, Region const t_region,
+                             FlashOption const& t_option, bool const t_stub_running, DeviceReport& t_report) {
+  auto const size_of = [](std::vector<Region> const& t_regions) {
+    return std::accumulate(t_regions.begin(), t_regions.end(), std::uint32_t{0},
+                           [](auto const t_sum, auto const& t_piece) { return t_sum + t_piece.size_; });
+  };
+
+  auto const written_before = t_report.written_;
+  std::vector<Region> regions{t_region};
+  bool compressed = false;
+  for (int stalled = 0;;) {
+    std::optional<std::string> error;
+    for (auto const& region : regions) {
+      try {
+        co_await write_blocks<BlockSize>(t_loader, t_image, region, t_option, t_stub_running, t_report, compressed);
+      } catch (esplink::PipelineError const& t_e) {
+        error = t_e.what();
+        break;
+      }
+    }
+
+    if (not error.has_value()) {
+      co_return compressed;
+    }
+
+    auto const remaining = size_of(regions);
+    spdlog::warn("{}: {}, comparing {} bytes at offset {:#x} with flash", t_report.port_, *error, t_region.size_,
+                 t_image.offset() + t_region.begin_);
+
+    // sectors can only be told apart if they are aligned, otherwise erasing one erases the end of the previous one
+    regions = {t_region};
+    try {
+      if (t_image.offset() % SECTOR_SIZE == 0) {
+        regions = co_await diff_chunks(t_loader, t_image, regions, SECTOR_SIZE, 1);
+      }
+    } catch (std::runtime_error& t_e) {
+      spdlog::warn("{}: Failed to read flash digest ({}), write whole region again", t_report.port_, t_e.what());
+    }
+
+    stalled = size_of(regions) < remaining ? 0 : stalled + 1;
+    if (stalled == WRITE_RETRY) {
+      throw std::runtime_error(fmt::format("Failed to write flash at offset {:#x}: {}",
+                                           t_image.offset() + t_region.begin_, *error));
+    }
+
+    t_report.written_ = written_before + t_region.size_ - size_of(regions);
+  }
+}
+
+using WriteFn = awaitable<bool> (*)(Loader&, PreparedImage&, Region, FlashOption const&, bool, DeviceReport&);
+
+/**
+ * @brief This function maps block size to write_region instantiated for it
+ *
+ * @throw std::invalid_argument if t_block_size isn't one of the supported sizes
+ */
+inline WriteFn get_write_fn(std::uint32_t const t_block_size) {
+  switch (t_block_size) {
+    case 0x400:
+      return &write_region<0x400>;
+    case 0x800:
+      return &write_region<0x800>;
+    case 0x1000:
+      return &write_region<0x1000>;
+    case 0x2000:
+      return &write_region<0x2000>;
+    case 0x4000:
+      return &write_region<0x4000>;
+    default:
+      throw std::invalid_argument(fmt::format("Unsupported block size {}", t_block_size));
+  }
+}
+
+/**
+ * @brief Flash sequence, FLASH_BEGIN -> FLASH_DATA* -> FLASH_END on connected chip, with compression and diff in
+ *        between, as a coroutine, so that sessions of many devices can share one io_context. Every image is written
+ *        over the same connection, and the chip is rebooted once, after the last one, unless t_option keeps it in
+ *        loader. If t_option doesn't write, images are only verified against flash.
+ */
+template <esplink::ImageHeaderChipID ChipID>
+awaitable<void> flash_session(Loader& loader, ChipInfo const& chip, std::vector<ImageStore>& t_stores,
+                              FlashOption const& t_option, DeviceReport& t_report) {
+  // flash parameters are taken from the image at offset 0, which a blank or erased flash lacks
+  std::optional<FlashParams> flash_params;
+  if (chip.has_image()) {
+    flash_params = FlashParams{chip.spi_mode(), chip.spi_speed(), chip.flash_chip_size()};
+    spdlog::info("{}: Using flash mode: {}, flash speed: {}, flash chip size: {}", t_report.port_, chip.spi_mode(),
+                 chip.spi_speed(), chip.flash_chip_size());
+  } else {
+    spdlog::warn("{}: No image at flash offset 0 to take flash parameters from, image headers are written as they are",
+                 t_report.port_);
+  }
+  auto const stub_running = chip.stub_running_;
+
+  // regions of every image are found first, so that progress covers all of them
+  std::vector<std::pair<PreparedImage*, std::vector<Region>>> to_write;
+  std::vector<Verification> to_verify;
+  for (auto& store : t_stores) {
+    // whole image is kept in memory so that blocks in flight can be sent again without rereading the file
+    auto& image  = store.prepare<ChipID>(flash_params);
+    auto regions = std::vector<Region>{{0, static_cast<std::uint32_t>(image.data().size())}};
+    if (t_option.diff_ and t_option.write_) {
+      auto changed_regions = co_await find_changed_regions(loader, image);
+      regions              = std::move(changed_regions).value_or(regions);
+    }
+
+    for (auto const& region : regions) {
+      t_report.to_write_ += region.size_;
+    }
+
+    // digests of what is written are computed alongside writing, a segment per core at a time
+    if (t_option.verify_ and not regions.empty()) {
+      auto pieces  = esplink::split_regions(regions, SEGMENT_SIZE);
+      auto digests = image.digests(co_await boost::asio::this_coro::executor, pieces);
+      to_verify.push_back({image.offset(), std::move(pieces), std::move(digests)});
+    }
+
+    if (not regions.empty()) {
+      to_write.emplace_back(&image, std::move(regions));
+    }
+  }
+
+  if (not t_option.write_) {
+    co_await verify_regions(loader, to_verify, t_report);
+    t_report.advance(t_report.to_write_);
+    co_return;
+  }
+
+  if (to_write.empty()) {
+    spdlog::info("{}: Flash content is identical to image, nothing to write", t_report.port_);
+    co_return;
+  }
+
+  // stub isn't limited by the small receive buffer of ROM, larger block means less packet overhead
+  constexpr std::uint32_t ROM_BLOCK_SIZE  = 0x1000;
+  constexpr std::uint32_t STUB_BLOCK_SIZE = 0x4000;
+  auto const max_block_size               = stub_running ? STUB_BLOCK_SIZE : ROM_BLOCK_SIZE;
+
+  bool compressed          = false;
+  std::uint32_t block_size = 0;
+  for (auto const& [image, regions] : to_write) {
+    for (auto const& segment : esplink::split_into_segments(regions, image->offset(), SEGMENT_SIZE)) {
+      // unless given, block size follows the link, as measured by handshake and blocks written so far
+      auto const next_block_size =
+        t_option.block_size_ != 0 ? t_option.block_size_ : choose_block_size(loader.link(), max_block_size);
+      if (next_block_size != block_size) {
+        auto const& link = loader.link();
+        spdlog::info("{}: Writing in blocks of {} bytes (overhead {:.2f} ms, {:.2f} us/byte, {:.1e} errors/byte)",
+                     t_report.port_, next_block_size, link.overhead().count() * 1e3, link.per_byte().count() * 1e6,
+                     link.byte_error_rate());
+        block_size = next_block_size;
+      }
+
+      auto const write_fn       = get_write_fn(block_size);
+      auto const written_before = t_report.written_;
+      compressed                = co_await write_fn(loader, *image, segment, t_option, stub_running, t_report);
+      t_report.written_         = written_before + segment.size_;  // progress of compressed blocks is an estimate
+    }
+  }
+
+  // flash is checked before FLASH_END, which reboots the chip
+  if (t_option.verify_) {
+    co_await verify_regions(loader, to_verify, t_report);
+  }
+
+  // loader finishes writing with the last block, FLASH_END is only needed to leave it
+  if (not t_option.reboot_) {
+    spdlog::info("{}: Staying in loader", t_report.port_);
+    co_return;
+  }
+
+  using esplink::command::FlashEndOption;
+  if (compressed) {
+    co_await loader.async_transceive(esplink::command::FLASH_DEFL_END<FlashEndOption::Reboot>());
+  } else {
+    co_await loader.async_transceive(esplink::command::FLASH_END<FlashEndOption::Reboot>());
+  }
+}
+
+inline constexpr std::uint32_t READ_CHUNK_SIZE    = 0x10000;  // unit of integrity check, read again if it differs
+inline constexpr std::uint32_t ROM_READ_SIZE      = 64;       // most FLASH_READ_SLOW reads at once
+inline constexpr std::uint32_t STUB_READ_PACKET   = 0x1000;
+inline constexpr std::uint32_t STUB_READ_INFLIGHT = 64;
+inline constexpr int READ_RETRY                   = 3;
+
+/**
+ * @brief This function reads t_out.size() bytes of flash at t_address with FLASH_READ_SLOW of ROM loader, keeping
+ *        t_window requests in flight, then asks for digest of the same range
+ *
+ * @return Digest of the range computed by esp chip
+ */
+inline awaitable<esplink::MD5::Digest> read_chunk_rom(Loader& t_loader, std::uint32_t const t_address,
+                                                      std::span<char> const t_out, std::size_t const t_window) {
+  auto const size = static_cast<std::uint32_t>(t_out.size());
+  std::vector<esplink::command::FLASH_READ_SLOW> requests;
+  requests.reserve((size + ROM_READ_SIZE - 1) / ROM_READ_SIZE);
+  for (std::uint32_t offset = 0; offset < size; offset += ROM_READ_SIZE) {
+    requests.push_back({t_address + offset, std::min(ROM_READ_SIZE, size - offset)});
+  }
+
+  auto const copy_data = [&](std::size_t const t_idx, auto const& t_response) {
+    auto const& request = requests[t_idx];
+    if (t_response.data_.size() < request.data_length_) {
+      throw std::runtime_error(fmt::format("Short read of {} bytes at {:#x}", t_response.data_.size(),
+                                           request.bootloader_address_));
+    }
+    auto const out = t_out.begin() + static_cast<std::ptrdiff_t>(t_idx * ROM_READ_SIZE);
+    std::copy_n(t_response.data_.begin(), request.data_length_, out);
+  };
+
+  // a lost request shifts responses onto the wrong offsets unless one is in flight at a time, the chunk is read again
+  co_await t_loader.async_transceive_pipelined(requests, t_window, t_window == 1 ? DATA_RETRY : 1,
+                                               esplink::Timeout::adaptive(1000ms), copy_data);
+  auto const digest = co_await t_loader.async_transceive(esplink::command::SPI_FLASH_MD5{t_address, size}, 1, 1000ms);
+  co_return parse_digest(digest.data_);
+}
+
+/**
+ * @brief This function reads t_out.size() bytes of flash at t_address with READ_FLASH of flasher stub, which streams
+ *        data as fast as the link allows, and acknowledges every packet as it arrives
+ *
+ * @return Digest of the range computed by esp chip, sent after the data
+ *
+ * @throw std::runtime_error if the stream stalls, or a frame of unexpected size arrives
+ */
+inline awaitable<esplink::MD5::Digest> read_chunk_stub(Loader& t_loader, std::uint32_t const t_address,
+                                                       std::span<char> const t_out) {
+  auto const size = static_cast<std::uint32_t>(t_out.size());
+  co_await t_loader.async_transceive(
+    esplink::command::READ_FLASH{t_address, size, STUB_READ_PACKET, STUB_READ_INFLIGHT}, 1, 1000ms);
+
+  auto const receive = [&](std::size_t const t_expected) -> awaitable<std::vector<std::uint8_t>> {
+    auto frame = co_await t_loader.async_receive_frame(DATA_TIMEOUT);
+    if (not frame.has_value()) {
+      throw std::runtime_error(fmt::format("Flash read at {:#x} stalls", t_address));
+    }
+    if (frame->size() != t_expected) {
+      throw std::runtime_error(fmt::format("Expecting {} bytes of flash, received {}", t_expected, frame->size()));
+    }
+    co_return *std::move(frame);
+  };
+
+  for (std::uint32_t received = 0; received < size;) {
+    auto const packet = co_await receive(std::min(STUB_READ_PACKET, size - received));
+    std::copy(packet.begin(), packet.end(), t_out.begin() + received);
+    received += static_cast<std::uint32_t>(packet.size());
+
+    t_loader.send_frame(std::bit_cast<std::array<std::uint8_t, sizeof(received)>>(received));
+  }
+
+  co_return parse_digest(co_await receive(std::tuple_size_v<esplink::MD5::Digest>));
+}
+
+/**
+ * @brief This function reads t_size bytes of flash at t_address into t_file, chunk by chunk, every chunk is compared
+ *        with digest computed by esp chip before it is written, and read again if it differs, so that memory used
+ *        doesn't grow with the size read
+ *
+ * @throw std::runtime_error if READ_FLASH stream of flasher stub breaks, since stub is still streaming and takes any
+ *        request as acknowledgement, or if a chunk can't be read in READ_RETRY attempts
+ */
+inline awaitable<void> read_to_file(Loader& t_loader, std::uint32_t const t_address, std::uint32_t const t_size,
+                                    std::ofstream& t_file, bool const t_stub_running, FlashOption const& t_option,
+                                    DeviceReport& t_report) {
+  std::vector<char> buffer(std::min(READ_CHUNK_SIZE, t_size));
+  for (std::uint32_t offset = 0; offset < t_size; offset += READ_CHUNK_SIZE) {
+    auto const address = t_address + offset;
+    auto const chunk   = std::span{buffer}.first(std::min(READ_CHUNK_SIZE, t_size - offset));
+    for (int attempt = 1;; ++attempt) {
+      std::optional<std::string> error;
+      try {
+        // digest is sent once the stream ends, mismatch or not, stub is back to serving requests by then
+        auto const digest = t_stub_running ? co_await read_chunk_stub(t_loader, address, chunk)
+                                           : co_await read_chunk_rom(t_loader, address, chunk, t_option.window_);
+        if (digest == esplink::MD5::compute(chunk)) {
+          break;
+        }
+        error = "digest mismatch";
+      } catch (std::runtime_error& t_e) {
+        if (t_stub_running) {
+          throw;
+        }
+        error = t_e.what();
+      }
+
+      if (attempt == READ_RETRY) {
+        throw std::runtime_error(fmt::format("Failed to read {} bytes at {:#x}: {}", chunk.size(), address, *error));
+      }
+
+      spdlog::warn("{}: Reading {} bytes at {:#x} again: {}", t_report.port_, chunk.size(), address, *error);
+    }
+
+    t_file.write(chunk.data(), static_cast<std::streamsize>(chunk.size()));
+    if (not t_file) {
+      throw std::runtime_error("Failed to write flash content to file");
+    }
+    t_report.advance(static_cast<std::uint32_t>(chunk.size()));
+  }
+}
+
+/**
+ * @brief This function resolves t_size bytes of flash at t_address, or up to the end of flash as given by image header
+ *        if t_size is 0, and lets esp chip access flash up to the end of the range
+ */
+inline awaitable<esplink::FlashRange> resolve_range(Loader& t_loader, ChipInfo const& t_chip,
+                                                    std::uint32_t const t_address, std::uint32_t const t_size) {
+  auto const flash_size = t_chip.flash_size();
+  if (t_size == 0 and flash_size == 0) {
+    throw std::runtime_error("Flash size is unknown without image at offset 0, --size must be given");
+  }
+
+  auto const end = t_size == 0 ? std::uint64_t{flash_size} : std::uint64_t{t_address} + t_size;
+  if (end > MAX_FLASH_SIZE or end <= t_address) {
+    throw std::invalid_argument(fmt::format("Can't access flash from {:#x} to {:#x}", t_address, end));
+  }
+
+  if (end > esplink::command::SPI_SET_PARAMS{}.flash_size_) {
+    co_await t_loader.async_transceive(esplink::command::SPI_SET_PARAMS{static_cast<std::uint32_t>(end)});
+  }
+
+  co_return esplink::FlashRange{t_address, static_cast<std::uint32_t>(end - t_address)};
+}
+
+/**
+ * @brief Read sequence, FLASH_READ_SLOW* or READ_FLASH of flasher stub on connected chip, reading t_option.size_ bytes
+ *        at t_option.offset_, or up to the end of flash as given by image header, to t_file
+ */
+inline awaitable<void> read_session(Loader& loader, ChipInfo const& chip, std::filesystem::path const t_file,
+                                    FlashOption const& t_option, DeviceReport& t_report) {
+  auto const range   = co_await resolve_range(loader, chip, t_option.offset_, t_option.size_);
+  t_report.to_write_ = range.size_;
+
+  std::ofstream file{t_file, std::ios::binary | std::ios::out | std::ios::trunc};
+  if (not file.good()) {
+    throw std::invalid_argument(fmt::format("Failed to open {}", t_file.string()));
+  }
+
+  spdlog::info("{}: Reading {} bytes of flash at offset {:#x} to {}", t_report.port_, range.size_, range.address_,
+               t_file.string());
+  co_await read_to_file(loader, range.address_, range.size_, file, chip.stub_running_, t_option, t_report);
+}
+
+/**
+ * @brief Erase sequence on connected chip, erasing t_ranges, or the whole chip if t_whole_chip. Ranges that touch are
+ *        merged, and each merged range is erased by one ERASE_REGION of flasher stub, or by one FLASH_BEGIN without
+ *        data of ROM loader, which has no erase command. Flasher stub erases whole chip by ERASE_FLASH. Either way,
+ *        erase is waited for as long as its sectors and blocks take.
+ */
+inline awaitable<void> erase_session(Loader& loader, ChipInfo const& chip, bool const t_whole_chip,
+                                     std::vector<esplink::FlashRange> const& t_ranges, DeviceReport& t_report) {
+  if (t_whole_chip and chip.stub_running_) {
+    auto const flash_size = chip.flash_size() != 0 ? chip.flash_size() : MAX_FLASH_SIZE;
+    t_report.to_write_    = flash_size;
+    spdlog::info("{}: Erasing whole flash", t_report.port_);
+    co_await loader.async_transceive(esplink::command::ERASE_FLASH{}, 0,
+                                     esplink::ErasePlan::chip_erase_timeout(flash_size));
+    t_report.advance(flash_size);
+    co_return;
+  }
+
+  std::vector<esplink::FlashRange> ranges;
+  for (auto const& [address, size] : t_ranges) {
+    auto const range = co_await resolve_range(loader, chip, address, size);
+    if (range.address_ % SECTOR_SIZE != 0 or range.size_ % SECTOR_SIZE != 0) {
+      throw std::invalid_argument(fmt::format("Erase range {:#x} + {:#x} isn't aligned to sector size {:#x}",
+                                              range.address_, range.size_, SECTOR_SIZE));
+    }
+    ranges.push_back(range);
+  }
+
+  esplink::ErasePlan const plan{ranges};
+  t_report.to_write_ = static_cast<std::uint32_t>(plan.erase_size());
+  spdlog::info("{}: Erasing {} bytes in flash in {} ranges, {} sectors and {} blocks", t_report.port_,
+               plan.erase_size(), plan.ranges().size(), plan.sector_count(), plan.block_count());
+  for (auto const& range : plan.ranges()) {
+    auto const timeout = esplink::ErasePlan::timeout(range.address_, range.size_);
+    if (chip.stub_running_) {
+      co_await loader.async_transceive(esplink::command::ERASE_REGION{range.address_, range.size_}, 0, timeout);
+    } else {
+      constexpr std::uint32_t ROM_BLOCK_SIZE = 0x1000;
+      co_await loader.async_transceive(esplink::command::FLASH_BEGIN{range.size_, 0, ROM_BLOCK_SIZE, range.address_},
+                                       0, timeout);
+    }
+    t_report.advance(range.size_);
+  }
+}
+
+/**
+ * @brief Session run on one connected chip, made once for every device of a run, or of a job sent to the daemon
+ */
+using Session = std::function<awaitable<void>(Loader&, ChipInfo const&, DeviceReport&)>;
+
+}  // namespace esplink::flash
@@ -6,6 +6,7 @@
 #include <array>
 #include <bit>
 #include <cstddef>
+#include <cstring>
 #include <fmt/ranges.h>
 #include <fstream>
 #include <range/v3/algorithm/count_if.hpp>
@@ -15,6 +16,7 @@
 #include <range/v3/range/conversion.hpp>
 #include <range/v3/view/filter.hpp>
 #include <range/v3/view/sliding.hpp>
+#include <span>
 #include <spdlog/spdlog.h>
 #include <stdexcept>
 #include <string_view>
@@ -342,10 +344,7 @@ struct ELFFile {
 
   template <Format Fmt>
   constexpr auto get_section_memory_type(SectionHeader<Fmt> const& t_section) const {
-    auto const content = std::get<to_underlying(Fmt) - 1>(this->content_);
-    return *ranges::find_if(content.program_headers_, [&](auto const& t_ph) {
-      return t_ph.vaddr_ <= t_section.addr_ and t_section.addr_ < t_ph.vaddr_ + t_ph.memsz_;
-    });
+    return std::get<to_underlying(Fmt) - 1>(this->content_).get_section_memory_type(t_section);
   }
 
  private:
@@ -429,4 +428,150 @@ struct ELFFile {
   }
 };
 
-}  // namespace esplink
\ No newline at end of file
+/**
+ * @brief Section of ELF file parsed by ELFView, name and data view the content of the file
+ */
+template <Format Fmt>
+struct SectionView {
+  std::string_view name_;
+  SectionHeader<Fmt> header_;
+  std::span<char const> data_;  // empty if section occupies no space in file, e.g. .bss
+};
+
+/**
+ * @brief ELF file parsed in place, e.g. from a MappedFile. Headers are read at bounds-checked offsets, section names
+ *        view the section name string table, and section data view the content, nothing of the file is copied,
+ *        therefore the content must outlive ELFView.
+ */
+template <Format Fmt>
+class ELFView {
+  static constexpr std::uint32_t ELF_MAGIC_NUMBER = 0x464C457F;  // "\x7fELF" read as little endian word
+
+  std::span<char const> content_;
+  Identity identity_{};
+  FileHeaderWithoutIdentity<Fmt> file_header_{};
+  std::vector<ProgramHeader<Fmt>> program_headers_;
+  std::vector<SectionView<Fmt>> sections_;
+
+  /**
+   * @throw std::out_of_range if t_size bytes at t_offset aren't all in the file
+   */
+  [[nodiscard]] std::span<char const> view(std::uint64_t const t_offset, std::uint64_t const t_size) const {
+    if (t_offset > this->content_.size() or t_size > this->content_.size() - t_offset) {
+      throw std::out_of_range(fmt::format("ELF refers to {:#x} bytes at {:#x}, beyond the end of file ({:#x} bytes)",
+                                          t_size, t_offset, this->content_.size()));
+    }
+
+    return this->content_.subspan(t_offset, t_size);
+  }
+
+  // headers aren't necessarily aligned in the file, therefore they are copied rather than viewed
+  template <typename Header>
+  [[nodiscard]] Header read(std::uint64_t const t_offset) const {
+    Header header;
+    std::memcpy(&header, this->view(t_offset, sizeof(Header)).data(), sizeof(Header));
+    return header;
+  }
+
+  template <typename Header>
+  [[nodiscard]] std::vector<Header> read_table(std::uint64_t const t_offset, std::size_t const t_count,
+                                               std::size_t const t_entry_size) const {
+    if (t_count != 0 and t_entry_size != sizeof(Header)) {
+      throw std::invalid_argument(fmt::format("Unexpected ELF header entry size {}", t_entry_size));
+    }
+
+    std::vector<Header> headers(t_count);
+    std::memcpy(headers.data(), this->view(t_offset, t_count * sizeof(Header)).data(), t_count * sizeof(Header));
+    return headers;
+  }
+
+ public:
+  /**
+   * @throw std::invalid_argument if t_content isn't an ELF file of Fmt
+   * @throw std::out_of_range if a header or section lies beyond the end of t_content
+   */
+  explicit ELFView(std::span<char const> const t_content) : content_{t_content} {
+    this->identity_ = this->read<Identity>(0);
+    if (this->identity_.magic_number_ != ELF_MAGIC_NUMBER) {
+      throw std::invalid_argument("Not an ELF file");
+    }
+    if (static_cast<Format>(this->identity_.class_) != Fmt) {
+      throw std::invalid_argument(fmt::format("Expecting {} file", Fmt == Format::x86 ? "ELF32" : "ELF64"));
+    }
+
+    this->file_header_     = this->read<FileHeaderWithoutIdentity<Fmt>>(sizeof(Identity));
+    auto const& header     = this->file_header_;
+    this->program_headers_ = this->read_table<ProgramHeader<Fmt>>(header.phoff_, header.phnum_, header.phentsize_);
+    auto const section_headers =
+      this->read_table<SectionHeader<Fmt>>(header.shoff_, header.shnum_, header.shentsize_);
+
+    std::string_view names;
+    if (header.shstrndx_ < section_headers.size()) {
+      auto const& table = section_headers[header.shstrndx_];
+      auto const bytes  = this->view(table.offset_, table.size_);
+      names             = std::string_view{bytes.data(), bytes.size()};
+    }
+
+    this->sections_.reserve(section_headers.size());
+    for (auto const& section : section_headers) {
+      if (section.name_ >= names.size() and section.name_ != 0) {
+        throw std::out_of_range(fmt::format("ELF section name at {:#x} is beyond the name table", section.name_));
+      }
+
+      auto name = names.substr(std::min<std::size_t>(section.name_, names.size()));
+      name      = name.substr(0, name.find('\0'));
+      auto data = section.have_content() ? this->view(section.offset_, section.size_) : std::span<char const>{};
+      this->sections_.push_back({name, section, data});
+    }
+  }
+
+  [[nodiscard]] Identity const& identity() const noexcept { return this->identity_; }
+
+  [[nodiscard]] FileHeaderWithoutIdentity<Fmt> const& file_header() const noexcept { return this->file_header_; }
+
+  [[nodiscard]] std::vector<ProgramHeader<Fmt>> const& program_headers() const noexcept {
+    return this->program_headers_;
+  }
+
+  [[nodiscard]] std::vector<SectionView<Fmt>> const& sections() const noexcept { return this->sections_; }
+
+  /**
+   * @return Section named t_name, nullptr if there's none
+   */
+  [[nodiscard]] SectionView<Fmt> const* find(std::string_view const t_name) const noexcept {
+    auto const iter = std::find_if(this->sections_.begin(), this->sections_.end(),
+                                   [t_name](auto const& t_section) { return t_section.name_ == t_name; });
+    return iter != this->sections_.end() ? &*iter : nullptr;
+  }
+
+  /**
+   * @brief Sections that are loaded to memory of the chip and have content, in the order of section header table
+   */
+  [[nodiscard]] std::vector<SectionView<Fmt>> loadable_sections() const {
+    auto const should_load = [](auto const& t_section) {
+      return t_section.header_.is_loadable() and t_section.header_.have_content();
+    };
+
+    std::vector<SectionView<Fmt>> loadable;
+    std::copy_if(this->sections_.begin(), this->sections_.end(), std::back_inserter(loadable), should_load);
+    return loadable;
+  }
+
+  /**
+   * @brief Program header of memory t_section is loaded to
+   *
+   * @throw std::invalid_argument if no program header covers address of t_section
+   */
+  [[nodiscard]] ProgramHeader<Fmt> const& memory_type(SectionHeader<Fmt> const& t_section) const {
+    auto const iter = std::find_if(this->program_headers_.begin(), this->program_headers_.end(), [&](auto const& t_ph) {
+      return t_ph.vaddr_ <= t_section.addr_ and t_section.addr_ < t_ph.vaddr_ + t_ph.memsz_;
+    });
+    if (iter == this->program_headers_.end()) {
+      throw std::invalid_argument(fmt::format("No program header covers address {:#x}", t_section.addr_));
+    }
+
+    return *iter;
+  }
+};
+
+}  // namespace esplink
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "esp_common/constants.hpp"
+#include "esp_mkbin/elf_reader.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <span>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace esplink {
+
+/**
+ * @brief Segment of image, either a loadable section, or loadable sections adjacent in memory merged into one, whose
+ *        data are written one after another
+ */
+struct Segment {
+  std::uint32_t address_;
+  std::uint32_t size_;
+  std::vector<std::span<char const>> parts_;  // view the elf file
+};
+
+/**
+ * @brief This function lays out segments of image, one per loadable section, unless there are more than image can
+ *        hold, in which case sections adjacent in memory of the same type are merged
+ *
+ * @throw std::runtime_error if there are still too many segments after merging
+ */
+inline std::vector<Segment> lay_out_segments(ELFView<Format::x86> const& t_elf, std::string_view const t_name) {
+  auto const loadable   = t_elf.loadable_sections();
+  auto const to_segment = [](auto const& t_section) {
+    return Segment{t_section.header_.addr_, t_section.header_.size_, {t_section.data_}};
+  };
+
+  std::vector<Segment> segments;
+  if (loadable.size() <= ESP32_IMAGE_MAX_SEGMENT) {
+    spdlog::info("Find {} loadable segments in {}, less equal than ESP32_IMAGE_MAX_SEGMENT, skip merge",
+                 loadable.size(), t_name);
+    std::transform(loadable.begin(), loadable.end(), std::back_inserter(segments), to_segment);
+    [[likely]] return segments;
+  }
+
+  spdlog::info("Find {} loadable segments in {}, greater than ESP32_IMAGE_MAX_SEGMENT, merging adjacent segment",
+               loadable.size(), t_name);
+
+  // segments are laid out from the highest address down, as ELFFile::merge_adjacent_loadable always has, so that
+  // images of the same elf file stay byte for byte the same, a section ending where the segment begins is merged into
+  // the front of it
+  auto sorted = loadable;
+  std::sort(sorted.begin(), sorted.end(), [](auto const& t_lhs, auto const& t_rhs) {
+    return std::pair{t_lhs.header_.addr_, t_lhs.header_.size_} > std::pair{t_rhs.header_.addr_, t_rhs.header_.size_};
+  });
+
+  ProgramHeader<Format::x86> const* last_memory = nullptr;
+  for (auto const& section : sorted) {
+    auto const* const memory = &t_elf.memory_type(section.header_);
+    if (not segments.empty() and memory == last_memory and
+        section.header_.addr_ + section.header_.size_ == segments.back().address_) {
+      auto& segment    = segments.back();
+      segment.address_ = section.header_.addr_;
+      segment.size_ += section.header_.size_;
+      segment.parts_.insert(segment.parts_.begin(), section.data_);
+    } else {
+      segments.push_back(to_segment(section));
+    }
+    last_memory = memory;
+  }
+
+  if (segments.size() > ESP32_IMAGE_MAX_SEGMENT) {
+    throw std::runtime_error("Invalid section count even after merged.");
+  }
+
+  return segments;
+}
+
+}  // namespace esplink
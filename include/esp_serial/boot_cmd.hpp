@@ -3,10 +3,11 @@
 #include <algorithm>
 #include <array>
 #include <cstdint>
-#include <numeric>
+#include <span>
 #include <string>
 #include <string_view>
 
+#include "esp_common/checksum.hpp"
 #include "esp_common/constants.hpp"
 #include "esp_common/utility.hpp"
 
@@ -76,31 +77,29 @@ struct SPI_ATTACH {
   constexpr auto operator()() const noexcept { return std::array<std::uint8_t, 6>{0, 0, 0, 0, 0, 0}; }
 };
 
-template <std::uint32_t FlashSize = 4 * 1024 * 1024>
 struct SPI_SET_PARAMS {
+  std::uint32_t flash_size_ = 4 * 1024 * 1024;  // flash beyond it can't be accessed
+
   static constexpr std::string_view NAME     = "SPI_SET_PARAMS";
   static constexpr std::uint8_t COMMAND_BYTE = 0x0B;
   static constexpr std::size_t PACKET_SIZE   = 6 * sizeof(std::uint32_t);
 
   constexpr auto operator()() const noexcept {
-    constexpr auto ret_val = []() {
-      std::array<std::uint8_t, PACKET_SIZE> v{};
-      constexpr auto flash_size_arr  = word_to_byte_array(FlashSize);
-      constexpr auto block_size_arr  = word_to_byte_array(64 * 1024);
-      constexpr auto sector_size_arr = word_to_byte_array(4 * 1024);
-      constexpr auto page_size_arr   = word_to_byte_array(256);
-      constexpr auto status_mask_arr = word_to_byte_array(0xFFFF);
-
-      auto* iter = std::fill_n(v.begin(), 4, 0);
-      iter       = std::copy_n(flash_size_arr.begin(), flash_size_arr.size(), iter);
-      iter       = std::copy_n(block_size_arr.begin(), block_size_arr.size(), iter);
-      iter       = std::copy_n(sector_size_arr.begin(), sector_size_arr.size(), iter);
-      iter       = std::copy_n(page_size_arr.begin(), page_size_arr.size(), iter);
-      std::copy_n(status_mask_arr.begin(), status_mask_arr.size(), iter);
+    std::array<std::uint8_t, PACKET_SIZE> v{};
+    auto const flash_size_arr      = word_to_byte_array(this->flash_size_);
+    constexpr auto block_size_arr  = word_to_byte_array(64 * 1024);
+    constexpr auto sector_size_arr = word_to_byte_array(4 * 1024);
+    constexpr auto page_size_arr   = word_to_byte_array(256);
+    constexpr auto status_mask_arr = word_to_byte_array(0xFFFF);
+
+    auto* iter = std::fill_n(v.begin(), 4, 0);
+    iter       = std::copy_n(flash_size_arr.begin(), flash_size_arr.size(), iter);
+    iter       = std::copy_n(block_size_arr.begin(), block_size_arr.size(), iter);
+    iter       = std::copy_n(sector_size_arr.begin(), sector_size_arr.size(), iter);
+    iter       = std::copy_n(page_size_arr.begin(), page_size_arr.size(), iter);
+    std::copy_n(status_mask_arr.begin(), status_mask_arr.size(), iter);
 
-      return v;
-    }();
-    return ret_val;
+    return v;
   }
 };
 
@@ -138,26 +137,42 @@ struct FLASH_DATA {
   static constexpr std::size_t DATA_PACKET = 16;
   std::uint32_t flash_size_;
   std::uint32_t sequence_;
-  std::array<char, WriteDataSize> const& buffer_;
+  std::span<char const> buffer_;  // at least flash_size_ bytes, at most WriteDataSize bytes are sent
 
   static constexpr std::string_view NAME     = "FLASH_DATA";
   static constexpr std::uint8_t COMMAND_BYTE = 0x03;
   static constexpr int PACKET_SIZE           = -1;
 
   [[nodiscard]] std::uint8_t check_sum() const noexcept {
-    return std::accumulate(this->buffer_.begin(), this->buffer_.begin() + flash_size_, ESP32_CHECKSUM_MAGIC,
-                           std::bit_xor{});
+    return xor_checksum(this->payload());
   }
 
-  auto operator()() const noexcept {
-    std::vector<std::uint8_t> ret_val(DATA_PACKET + this->flash_size_);
+  /**
+   * @brief Fixed size part of packet data, preceding the payload
+   */
+  [[nodiscard]] constexpr auto header() const noexcept {
+    std::array<std::uint8_t, DATA_PACKET> ret_val{};
     auto flash_size_arr = word_to_byte_array(this->flash_size_);
     auto sequence_arr   = word_to_byte_array(this->sequence_);
 
-    auto iter = std::copy_n(flash_size_arr.begin(), flash_size_arr.size(), ret_val.begin());
-    iter      = std::copy_n(sequence_arr.begin(), sequence_arr.size(), iter);
-    iter      = std::fill_n(iter, 8, 0);
-    std::transform(this->buffer_.begin(), this->buffer_.begin() + this->flash_size_, iter,
+    auto* iter = std::copy_n(flash_size_arr.begin(), flash_size_arr.size(), ret_val.begin());
+    std::copy_n(sequence_arr.begin(), sequence_arr.size(), iter);
+
+    return ret_val;
+  }
+
+  /**
+   * @brief Data to write, viewed in place so that it can be framed without being copied first
+   */
+  [[nodiscard]] constexpr auto payload() const noexcept { return this->buffer_.first(this->flash_size_); }
+
+  auto operator()() const noexcept {
+    std::vector<std::uint8_t> ret_val(DATA_PACKET + this->flash_size_);
+    auto const header  = this->header();
+    auto const payload = this->payload();
+
+    auto iter = std::copy(header.begin(), header.end(), ret_val.begin());
+    std::transform(payload.begin(), payload.end(), iter,
                    [](auto const t_chr) { return static_cast<std::uint8_t>(t_chr); });
 
     return ret_val;
@@ -178,6 +193,121 @@ struct FLASH_END {
   }
 };
 
+/**
+ * Compressed counterpart of FLASH_BEGIN, FLASH_DATA and FLASH_END, the data sent is a zlib stream, and is decompressed
+ * by esp chip before writing to flash. Packet format is identical to the uncompressed version.
+ */
+struct FLASH_DEFL_BEGIN : FLASH_BEGIN {
+  static constexpr std::string_view NAME     = "FLASH_DEFL_BEGIN";
+  static constexpr std::uint8_t COMMAND_BYTE = 0x10;
+};
+
+template <std::size_t WriteDataSize>
+struct FLASH_DEFL_DATA : FLASH_DATA<WriteDataSize> {
+  static constexpr std::string_view NAME     = "FLASH_DEFL_DATA";
+  static constexpr std::uint8_t COMMAND_BYTE = 0x11;
+};
+
+template <FlashEndOption Opt>
+struct FLASH_DEFL_END : FLASH_END<Opt> {
+  static constexpr std::string_view NAME     = "FLASH_DEFL_END";
+  static constexpr std::uint8_t COMMAND_BYTE = 0x12;
+};
+
+struct MEM_BEGIN {
+  std::uint32_t total_size_{};
+  std::uint32_t packet_count_{};
+  std::uint32_t data_size_per_packet_{};
+  std::uint32_t memory_offset_{};
+
+  static constexpr std::string_view NAME     = "MEM_BEGIN";
+  static constexpr std::uint8_t COMMAND_BYTE = 0x05;
+  static constexpr std::size_t PACKET_SIZE   = 4 * sizeof(std::uint32_t);
+
+  constexpr auto operator()() const noexcept {
+    std::array<std::uint8_t, PACKET_SIZE> ret_val{};
+    auto total_size_arr    = word_to_byte_array(this->total_size_);
+    auto packet_count_arr  = word_to_byte_array(this->packet_count_);
+    auto data_size_arr     = word_to_byte_array(this->data_size_per_packet_);
+    auto memory_offset_arr = word_to_byte_array(this->memory_offset_);
+
+    auto* iter = std::move(total_size_arr.begin(), total_size_arr.end(), ret_val.begin());
+    iter       = std::move(packet_count_arr.begin(), packet_count_arr.end(), iter);
+    iter       = std::move(data_size_arr.begin(), data_size_arr.end(), iter);
+    std::move(memory_offset_arr.begin(), memory_offset_arr.end(), iter);
+
+    return ret_val;
+  }
+};
+
+/**
+ * Data packet of MEM_BEGIN, packet format is identical to FLASH_DATA, except that data is written to RAM
+ */
+template <std::size_t WriteDataSize>
+struct MEM_DATA : FLASH_DATA<WriteDataSize> {
+  static constexpr std::string_view NAME     = "MEM_DATA";
+  static constexpr std::uint8_t COMMAND_BYTE = 0x07;
+};
+
+struct MEM_END {
+  std::uint32_t entry_address_{};  // 0 means no execution after upload
+
+  static constexpr std::string_view NAME     = "MEM_END";
+  static constexpr std::uint8_t COMMAND_BYTE = 0x06;
+  static constexpr std::size_t PACKET_SIZE   = 2 * sizeof(std::uint32_t);
+
+  constexpr auto operator()() const noexcept {
+    std::array<std::uint8_t, PACKET_SIZE> ret_val{};
+    auto execute_flag_arr  = word_to_byte_array(static_cast<std::uint32_t>(this->entry_address_ == 0));
+    auto entry_address_arr = word_to_byte_array(this->entry_address_);
+
+    auto* iter = std::move(execute_flag_arr.begin(), execute_flag_arr.end(), ret_val.begin());
+    std::move(entry_address_arr.begin(), entry_address_arr.end(), iter);
+
+    return ret_val;
+  }
+};
+
+struct CHANGE_BAUDRATE {
+  std::uint32_t new_baud_;
+  std::uint32_t old_baud_ = 0;  // ROM loader expects 0, flasher stub expects current baudrate
+
+  static constexpr std::string_view NAME     = "CHANGE_BAUDRATE";
+  static constexpr std::uint8_t COMMAND_BYTE = 0x0F;
+  static constexpr std::size_t PACKET_SIZE   = 2 * sizeof(std::uint32_t);
+
+  constexpr auto operator()() const noexcept {
+    auto new_baud_arr = word_to_byte_array(this->new_baud_);
+    auto old_baud_arr = word_to_byte_array(this->old_baud_);
+
+    std::array<std::uint8_t, PACKET_SIZE> ret_val{};
+    auto* iter = std::copy_n(new_baud_arr.begin(), new_baud_arr.size(), ret_val.begin());
+    std::copy_n(old_baud_arr.begin(), old_baud_arr.size(), iter);
+
+    return ret_val;
+  }
+};
+
+struct SPI_FLASH_MD5 {
+  std::uint32_t address_;
+  std::uint32_t size_;
+
+  static constexpr std::string_view NAME     = "SPI_FLASH_MD5";
+  static constexpr std::uint8_t COMMAND_BYTE = 0x13;
+  static constexpr std::size_t PACKET_SIZE   = 4 * sizeof(std::uint32_t);
+
+  constexpr auto operator()() const noexcept {
+    auto address_arr = word_to_byte_array(this->address_);
+    auto size_arr    = word_to_byte_array(this->size_);
+
+    std::array<std::uint8_t, PACKET_SIZE> ret_val{};
+    auto* iter = std::copy_n(address_arr.begin(), address_arr.size(), ret_val.begin());
+    std::copy_n(size_arr.begin(), size_arr.size(), iter);
+
+    return ret_val;
+  }
+};
+
 struct FLASH_READ_SLOW {
   std::uint32_t bootloader_address_;
   std::uint32_t data_length_;
@@ -198,4 +328,62 @@ struct FLASH_READ_SLOW {
   }
 };
 
+/**
+ * @brief Flasher stub only. Response is followed by t_length bytes of flash in frames of t_packet_size bytes, each of
+ *        which must be acknowledged by a frame holding the number of bytes received so far, and by a frame holding raw
+ *        MD5 digest of the whole range. Stub stops sending once t_max_inflight packets aren't acknowledged.
+ */
+struct READ_FLASH {
+  std::uint32_t address_;
+  std::uint32_t length_;
+  std::uint32_t packet_size_;
+  std::uint32_t max_inflight_;
+
+  static constexpr std::string_view NAME     = "READ_FLASH";
+  static constexpr std::uint8_t COMMAND_BYTE = 0xD2;
+  static constexpr std::size_t PACKET_SIZE   = 4 * sizeof(std::uint32_t);
+
+  constexpr auto operator()() const noexcept {
+    std::array<std::uint8_t, PACKET_SIZE> ret_val{};
+    auto* iter = ret_val.begin();
+    for (auto const word : {this->address_, this->length_, this->packet_size_, this->max_inflight_}) {
+      auto const word_arr = word_to_byte_array(word);
+      iter                = std::copy(word_arr.begin(), word_arr.end(), iter);
+    }
+
+    return ret_val;
+  }
+};
+
+/**
+ * @brief Flasher stub only. Erases the whole flash chip, which takes tens of seconds on large chips
+ */
+struct ERASE_FLASH {
+  static constexpr std::string_view NAME     = "ERASE_FLASH";
+  static constexpr std::uint8_t COMMAND_BYTE = 0xD0;
+
+  constexpr auto operator()() const noexcept { return std::array<std::uint8_t, 0>{}; }
+};
+
+/**
+ * @brief Flasher stub only. Erases t_size bytes at t_address, both multiple of sector size, with block erase where
+ *        the range covers whole 64 KiB blocks
+ */
+struct ERASE_REGION {
+  std::uint32_t address_;
+  std::uint32_t size_;
+
+  static constexpr std::string_view NAME     = "ERASE_REGION";
+  static constexpr std::uint8_t COMMAND_BYTE = 0xD1;
+  static constexpr std::size_t PACKET_SIZE   = 2 * sizeof(std::uint32_t);
+
+  constexpr auto operator()() const noexcept {
+    std::array<std::uint8_t, PACKET_SIZE> ret_val{};
+    auto const address_arr = word_to_byte_array(this->address_);
+    auto const size_arr    = word_to_byte_array(this->size_);
+    std::copy(size_arr.begin(), size_arr.end(), std::copy(address_arr.begin(), address_arr.end(), ret_val.begin()));
+    return ret_val;
+  }
+};
+
 }  // namespace esplink::command
\ No newline at end of file
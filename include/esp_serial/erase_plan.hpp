@@ -0,0 +1,151 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace esplink {
+
+/**
+ * @brief Range of flash, in flash address
+ */
+struct FlashRange {
+  std::uint32_t address_;
+  std::uint32_t size_;
+
+  [[nodiscard]] constexpr std::uint64_t end() const noexcept { return std::uint64_t{this->address_} + this->size_; }
+
+  auto operator<=>(FlashRange const&) const = default;
+};
+
+/**
+ * @brief Erase operations needed before writing a set of ranges. SPI NOR flash erases either a 4 KiB sector or a
+ *        64 KiB block at a time, the latter far faster per byte. Ranges are rounded out to sectors and merged where
+ *        they touch, each merged range is erased by sectors up to the first block boundary, then by whole blocks, then
+ *        by sectors again, which is also what ROM loader and flasher stub do for an erase of that range. Sectors
+ *        outside of the ranges are never erased, since they may hold data that must be kept.
+ */
+class ErasePlan {
+ public:
+  static constexpr std::uint32_t SECTOR_SIZE = 0x1000;
+  static constexpr std::uint32_t BLOCK_SIZE  = 0x10000;
+
+  // worst case of common SPI NOR flash, e.g. W25Q and GD25Q series, typical time is several times shorter
+  static constexpr std::chrono::milliseconds SECTOR_ERASE_TIME{400};
+  static constexpr std::chrono::milliseconds BLOCK_ERASE_TIME{2000};
+  static constexpr std::chrono::milliseconds CHIP_ERASE_TIME_PER_MB{15000};
+  static constexpr std::chrono::milliseconds MIN_TIMEOUT{3000};  // leaves room for round trip of a small erase
+
+  /**
+   * @brief One erase operation repeated over a contiguous range, size_ is a multiple of the unit it erases
+   */
+  struct Run {
+    FlashRange range_;
+    bool block_;  // erased by 64 KiB blocks, by 4 KiB sectors otherwise
+
+    auto operator<=>(Run const&) const = default;
+  };
+
+  explicit ErasePlan(std::span<FlashRange const> const t_ranges) {
+    std::vector<FlashRange> sorted;
+    for (auto const& range : t_ranges) {
+      if (range.size_ != 0) {
+        auto const begin = range.address_ / SECTOR_SIZE * SECTOR_SIZE;
+        auto const end   = (range.end() + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+        sorted.push_back({begin, static_cast<std::uint32_t>(end - begin)});
+      }
+    }
+    std::sort(sorted.begin(), sorted.end());
+
+    for (auto const& range : sorted) {
+      if (not this->ranges_.empty() and range.address_ <= this->ranges_.back().end()) {
+        auto& last = this->ranges_.back();
+        last.size_ = static_cast<std::uint32_t>(std::max(last.end(), range.end()) - last.address_);
+      } else {
+        this->ranges_.push_back(range);
+      }
+    }
+
+    for (auto const& range : this->ranges_) {
+      this->plan(range);
+    }
+  }
+
+  /**
+   * @brief Sector aligned ranges that don't touch each other, each of which can be erased by one command
+   */
+  [[nodiscard]] std::span<FlashRange const> ranges() const noexcept { return this->ranges_; }
+
+  [[nodiscard]] std::span<Run const> runs() const noexcept { return this->runs_; }
+
+  [[nodiscard]] std::uint32_t sector_count() const noexcept { return this->count(false); }
+
+  [[nodiscard]] std::uint32_t block_count() const noexcept { return this->count(true); }
+
+  [[nodiscard]] std::uint64_t erase_size() const noexcept {
+    std::uint64_t ret_val = 0;
+    for (auto const& range : this->ranges_) {
+      ret_val += range.size_;
+    }
+    return ret_val;
+  }
+
+  /**
+   * @brief Time allowed for erasing everything in the plan
+   */
+  [[nodiscard]] std::chrono::milliseconds timeout() const noexcept {
+    return std::max(MIN_TIMEOUT, this->sector_count() * SECTOR_ERASE_TIME + this->block_count() * BLOCK_ERASE_TIME);
+  }
+
+  /**
+   * @brief Time allowed for erasing t_size bytes at t_address, as one erase command
+   */
+  [[nodiscard]] static std::chrono::milliseconds timeout(std::uint32_t const t_address, std::uint32_t const t_size) {
+    FlashRange const range{t_address, t_size};
+    return ErasePlan{std::span{&range, 1}}.timeout();
+  }
+
+  /**
+   * @brief Time allowed for erasing a whole chip of t_flash_size bytes
+   */
+  [[nodiscard]] static std::chrono::milliseconds chip_erase_timeout(std::uint64_t const t_flash_size) noexcept {
+    constexpr std::uint64_t MB = 1024 * 1024;
+    return std::max(MIN_TIMEOUT, CHIP_ERASE_TIME_PER_MB * static_cast<std::int64_t>((t_flash_size + MB - 1) / MB));
+  }
+
+ private:
+  void plan(FlashRange const t_range) {
+    auto const begin       = std::uint64_t{t_range.address_};
+    auto const end         = t_range.end();
+    auto const block_begin = std::min((begin + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE, end);
+    auto const block_end   = std::max(end / BLOCK_SIZE * BLOCK_SIZE, block_begin);
+
+    auto const add = [this](std::uint64_t const t_begin, std::uint64_t const t_end, bool const t_block) {
+      if (t_end > t_begin) {
+        this->runs_.push_back({{static_cast<std::uint32_t>(t_begin), static_cast<std::uint32_t>(t_end - t_begin)},
+                               t_block});
+      }
+    };
+
+    add(begin, block_begin, false);
+    add(block_begin, block_end, true);
+    add(block_end, end, false);
+  }
+
+  [[nodiscard]] std::uint32_t count(bool const t_block) const noexcept {
+    std::uint32_t ret_val = 0;
+    for (auto const& run : this->runs_) {
+      if (run.block_ == t_block) {
+        ret_val += run.range_.size_ / (t_block ? BLOCK_SIZE : SECTOR_SIZE);
+      }
+    }
+    return ret_val;
+  }
+
+  std::vector<FlashRange> ranges_;
+  std::vector<Run> runs_;
+};
+
+}  // namespace esplink
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <filesystem>
+#include <fmt/format.h>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include "esp_serial/erase_plan.hpp"
+
+namespace esplink {
+
+/**
+ * @brief Image file to write at a flash offset
+ */
+struct ImageFile {
+  std::uint32_t offset_;
+  std::filesystem::path path_;
+};
+
+/**
+ * @brief Range of image, relative to the start of image, that needs to be written to flash
+ */
+struct Region {
+  std::uint32_t begin_;
+  std::uint32_t size_;
+
+  auto operator<=>(Region const&) const = default;
+};
+
+/**
+ * @brief This function splits t_regions into pieces of at most t_size bytes
+ */
+inline std::vector<Region> split_regions(std::vector<Region> const& t_regions, std::uint32_t const t_size) {
+  std::vector<Region> pieces;
+  for (auto const& region : t_regions) {
+    for (std::uint32_t begin = 0; begin < region.size_; begin += t_size) {
+      pieces.push_back({region.begin_ + begin, std::min(t_size, region.size_ - begin)});
+    }
+  }
+
+  return pieces;
+}
+
+/**
+ * @brief This function splits t_regions of image at t_offset into segments of at most t_segment_size bytes, each of
+ *        which is written with its own FLASH_BEGIN. Regions are kept whole if t_offset isn't aligned to sector, since
+ *        erasing a segment would then erase the end of the previous one.
+ */
+inline std::vector<Region> split_into_segments(std::vector<Region> const& t_regions, std::uint32_t const t_offset,
+                                               std::uint32_t const t_segment_size) {
+  if (t_offset % ErasePlan::SECTOR_SIZE != 0) {
+    return t_regions;
+  }
+
+  return split_regions(t_regions, t_segment_size);
+}
+
+/**
+ * @brief This function sorts t_images by flash offset, and makes sure that no two of them share a sector, since
+ *        erasing flash for one would then erase part of the other. Image is anything with offset(), size() and name().
+ *
+ * @throw std::invalid_argument if two images overlap or share a sector
+ */
+template <typename Image>
+void check_overlap(std::vector<Image>& t_images) {
+  constexpr std::uint64_t SECTOR_SIZE = ErasePlan::SECTOR_SIZE;
+  std::sort(t_images.begin(), t_images.end(), [](auto const& t_lhs, auto const& t_rhs) {
+    return t_lhs.offset() < t_rhs.offset();
+  });
+
+  for (std::size_t i = 1; i < t_images.size(); ++i) {
+    auto const& prev = t_images[i - 1];
+    auto const& next = t_images[i];
+    auto const end   = std::uint64_t{prev.offset()} + prev.size();
+    if (end > next.offset()) {
+      throw std::invalid_argument(
+        fmt::format("{} ({:#x} - {:#x}) overlaps {} at {:#x}", prev.name(), prev.offset(), end, next.name(),
+                    next.offset()));
+    }
+
+    if ((end + SECTOR_SIZE - 1) / SECTOR_SIZE > next.offset() / SECTOR_SIZE) {
+      throw std::invalid_argument(fmt::format("{} and {} share the sector at {:#x}, erasing one erases the other",
+                                              prev.name(), next.name(), next.offset() / SECTOR_SIZE * SECTOR_SIZE));
+    }
+  }
+}
+
+namespace detail {
+
+/**
+ * @brief This function parses t_hex, with or without 0x prefix
+ *
+ * @return std::nullopt if t_hex isn't a hex number that fits in 32 bits
+ */
+inline std::optional<std::uint32_t> parse_hex(std::string_view t_hex) {
+  if (t_hex.starts_with("0x") or t_hex.starts_with("0X")) {
+    t_hex.remove_prefix(2);
+  }
+
+  std::uint32_t value     = 0;
+  auto const* const last  = t_hex.data() + t_hex.size();
+  auto const [end, error] = std::from_chars(t_hex.data(), last, value, 16);
+  if (t_hex.empty() or error != std::errc{} or end != last) {
+    return std::nullopt;
+  }
+
+  return value;
+}
+
+}  // namespace detail
+
+/**
+ * @brief This function parses image file given as offset:file, with offset in hex
+ *
+ * @return std::nullopt if t_arg isn't of that form
+ */
+inline std::optional<ImageFile> parse_image_file(std::string const& t_arg) {
+  auto const colon = t_arg.find(':');
+  if (colon == std::string::npos) {
+    return std::nullopt;
+  }
+
+  auto const offset = detail::parse_hex(std::string_view{t_arg}.substr(0, colon));
+  if (not offset.has_value()) {
+    return std::nullopt;
+  }
+
+  return ImageFile{*offset, t_arg.substr(colon + 1)};
+}
+
+/**
+ * @brief This function parses range of flash given as offset:size, both in hex
+ *
+ * @return std::nullopt if t_arg isn't of that form, or size is 0
+ */
+inline std::optional<FlashRange> parse_flash_range(std::string_view const t_arg) {
+  auto const colon = t_arg.find(':');
+  if (colon == std::string_view::npos) {
+    return std::nullopt;
+  }
+
+  auto const offset = detail::parse_hex(t_arg.substr(0, colon));
+  auto const size   = detail::parse_hex(t_arg.substr(colon + 1));
+  if (not offset.has_value() or not size.has_value() or *size == 0) {
+    return std::nullopt;
+  }
+
+  return FlashRange{*offset, *size};
+}
+
+}  // namespace esplink
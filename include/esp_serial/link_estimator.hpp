@@ -0,0 +1,181 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+
+namespace esplink {
+
+/**
+ * @brief Online model of the link to esp chip. Round trip time of a request is fitted as a fixed overhead plus a cost
+ *        per byte sent, with old samples fading out, so that the model follows the link as conditions change. Like
+ *        retransmission timeout of TCP (RFC 6298), timeout is the prediction plus 4 times the mean deviation of
+ *        samples from it, and is doubled on every timeout until a response arrives again. Cost per byte is never
+ *        taken lower than the time a byte takes on the wire, which short requests sent before any data can't reveal.
+ */
+class LinkEstimator {
+ public:
+  using Seconds = std::chrono::duration<double>;
+
+  static constexpr std::size_t MIN_SAMPLES = 4;  // model isn't trusted before this many samples
+  static constexpr std::chrono::milliseconds MIN_TIMEOUT{50};
+
+  /**
+   * @param t_byte_time Time a byte takes on the wire, e.g. 10 bits over baudrate for 8N1
+   */
+  explicit LinkEstimator(Seconds const t_byte_time = Seconds{0}) noexcept : byte_time_{t_byte_time.count()} {}
+
+  /**
+   * @brief This function adds a round trip, t_bytes is the size of request on the wire. Only requests answered at the
+   *        first attempt should be added, a response to a request sent again can't be told apart from a late response
+   *        to the previous attempt.
+   */
+  void add_sample(std::size_t const t_bytes, std::chrono::steady_clock::duration const t_round_trip) noexcept {
+    auto const bytes      = static_cast<double>(t_bytes);
+    auto const round_trip = std::chrono::duration_cast<Seconds>(t_round_trip).count();
+
+    auto const error = std::abs(round_trip - this->predict(t_bytes).count());
+    this->deviation_ = this->samples_ == 0 ? round_trip / 2
+                                           : (1 - DEVIATION_GAIN) * this->deviation_ + DEVIATION_GAIN * error;
+
+    this->weight_  = DECAY * this->weight_ + 1;
+    this->sum_x_   = DECAY * this->sum_x_ + bytes;
+    this->sum_y_   = DECAY * this->sum_y_ + round_trip;
+    this->sum_xx_  = DECAY * this->sum_xx_ + bytes * bytes;
+    this->sum_xy_  = DECAY * this->sum_xy_ + bytes * round_trip;
+    this->backoff_ = 1;
+    ++this->samples_;
+    this->add_traffic(t_bytes, 0);
+
+    // requests of the same size say nothing about cost per byte, the last estimate is kept then
+    auto const spread = this->weight_ * this->sum_xx_ - this->sum_x_ * this->sum_x_;
+    if (spread > SPREAD_THRESHOLD * this->weight_ * this->sum_xx_) {
+      auto const fitted = (this->weight_ * this->sum_xy_ - this->sum_x_ * this->sum_y_) / spread;
+      this->per_byte_   = std::max(this->byte_time_, fitted);
+    }
+    this->overhead_ = std::max(0.0, (this->sum_y_ - this->per_byte_ * this->sum_x_) / this->weight_);
+  }
+
+  /**
+   * @brief This function records a request of t_bytes that got no valid response, i.e. timed out or was refused
+   */
+  void add_loss(std::size_t const t_bytes) noexcept { this->add_traffic(t_bytes, 1); }
+
+  /**
+   * @brief This function doubles timeout until the next sample, since a timeout means the model is too optimistic
+   */
+  void back_off() noexcept { this->backoff_ = std::min(this->backoff_ * 2, MAX_BACKOFF); }
+
+  /**
+   * @brief This function forgets everything measured, e.g. after baudrate is changed to one of t_byte_time per byte
+   */
+  void reset(Seconds const t_byte_time) noexcept { *this = LinkEstimator{t_byte_time}; }
+
+  [[nodiscard]] bool ready() const noexcept { return this->samples_ >= MIN_SAMPLES; }
+
+  [[nodiscard]] Seconds overhead() const noexcept { return Seconds{this->overhead_}; }
+
+  [[nodiscard]] Seconds per_byte() const noexcept { return Seconds{this->per_byte_}; }
+
+  [[nodiscard]] Seconds predict(std::size_t const t_bytes) const noexcept {
+    return Seconds{this->overhead_ + this->per_byte_ * static_cast<double>(t_bytes)};
+  }
+
+  /**
+   * @brief Probability of one byte sent being corrupted or lost, every failed request is blamed on a single byte
+   */
+  [[nodiscard]] double byte_error_rate() const noexcept {
+    return this->traffic_bytes_ > 0 ? std::min(1.0, this->traffic_losses_ / this->traffic_bytes_) : 0.0;
+  }
+
+  /**
+   * @brief This function gives time to wait for the response to a request of t_bytes, t_ceiling if the model isn't
+   *        ready yet
+   */
+  [[nodiscard]] std::chrono::milliseconds timeout(std::size_t const t_bytes,
+                                                  std::chrono::milliseconds const t_ceiling) const noexcept {
+    if (not this->ready()) {
+      return t_ceiling;
+    }
+
+    auto const estimate = this->predict(t_bytes) + DEVIATION_FACTOR * Seconds{this->deviation_};
+    auto const timeout  = std::max(std::chrono::ceil<std::chrono::milliseconds>(estimate), MIN_TIMEOUT);
+    return std::min(timeout * this->backoff_, t_ceiling);
+  }
+
+ private:
+  static constexpr double DECAY            = 0.9;    // weight of old samples after a new one is added
+  static constexpr double TRAFFIC_DECAY    = 0.99;   // same, for loss rate, which needs a longer memory
+  static constexpr double DEVIATION_GAIN   = 0.25;   // beta of RFC 6298
+  static constexpr double DEVIATION_FACTOR = 4;      // K of RFC 6298
+  static constexpr double SPREAD_THRESHOLD = 0.01;   // relative variance of sizes needed to fit cost per byte
+  static constexpr int MAX_BACKOFF         = 64;
+
+  void add_traffic(std::size_t const t_bytes, double const t_loss) noexcept {
+    this->traffic_bytes_  = TRAFFIC_DECAY * this->traffic_bytes_ + static_cast<double>(t_bytes);
+    this->traffic_losses_ = TRAFFIC_DECAY * this->traffic_losses_ + t_loss;
+  }
+
+  // exponentially weighted sums for least squares fit of round trip (y) against request size (x)
+  double weight_ = 0;
+  double sum_x_  = 0;
+  double sum_y_  = 0;
+  double sum_xx_ = 0;
+  double sum_xy_ = 0;
+
+  double byte_time_ = 0;
+  double overhead_  = 0;
+  double per_byte_  = byte_time_;
+  double deviation_ = 0;
+  int backoff_      = 1;
+
+  double traffic_bytes_  = 0;
+  double traffic_losses_ = 0;
+
+  std::size_t samples_ = 0;
+};
+
+/**
+ * @brief Time to wait for a response, either fixed, or adaptive, which follows LinkEstimator without exceeding a worst
+ *        case given by caller. Durations convert to fixed timeout implicitly.
+ */
+class Timeout {
+  std::chrono::milliseconds ceiling_;
+  std::chrono::milliseconds initial_;
+  bool adaptive_ = false;
+
+  constexpr Timeout(std::chrono::milliseconds const t_ceiling, std::chrono::milliseconds const t_initial,
+                    bool const t_adaptive) noexcept
+    : ceiling_{t_ceiling}, initial_{t_initial}, adaptive_{t_adaptive} {}
+
+ public:
+  constexpr Timeout(std::chrono::milliseconds const t_fixed) noexcept  // NOLINT(google-explicit-constructor)
+    : Timeout(t_fixed, t_fixed, false) {}
+
+  /**
+   * @param t_ceiling Worst case, timeout never exceeds it
+   * @param t_initial Timeout used until the link is measured
+   */
+  static constexpr Timeout adaptive(std::chrono::milliseconds const t_ceiling,
+                                    std::chrono::milliseconds const t_initial) noexcept {
+    return {t_ceiling, std::min(t_initial, t_ceiling), true};
+  }
+
+  static constexpr Timeout adaptive(std::chrono::milliseconds const t_ceiling) noexcept {
+    return adaptive(t_ceiling, t_ceiling);
+  }
+
+  [[nodiscard]] constexpr bool is_adaptive() const noexcept { return this->adaptive_; }
+
+  [[nodiscard]] std::chrono::milliseconds resolve(LinkEstimator const& t_link,
+                                                  std::size_t const t_bytes) const noexcept {
+    if (not this->adaptive_) {
+      return this->ceiling_;
+    }
+
+    return t_link.ready() ? t_link.timeout(t_bytes, this->ceiling_) : this->initial_;
+  }
+};
+
+}  // namespace esplink
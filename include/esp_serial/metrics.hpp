@@ -0,0 +1,258 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <fmt/format.h>
+#include <iterator>
+#include <map>
+#include <span>
+#include <string>
+#include <string_view>
+
+namespace esplink {
+
+/**
+ * @brief Latency histogram with fixed bucket bounds, so that histograms of different ports and runs can be added up,
+ *        the same way Prometheus histograms are
+ */
+class Histogram {
+ public:
+  using Seconds = std::chrono::duration<double>;
+
+  // upper bounds of buckets in seconds, values above the last one fall in an unbounded bucket
+  static constexpr std::array BOUNDS = {1e-4, 2.5e-4, 5e-4, 1e-3, 2.5e-3, 5e-3, 1e-2, 2.5e-2,
+                                        5e-2, 0.1,    0.25, 0.5,  1.0,    2.5,  5.0,  10.0};
+
+  void observe(Seconds const t_value) noexcept {
+    auto const value  = t_value.count();
+    auto const bucket = std::lower_bound(BOUNDS.begin(), BOUNDS.end(), value) - BOUNDS.begin();
+    ++this->counts_[static_cast<std::size_t>(bucket)];
+    ++this->count_;
+    this->sum_ += value;
+    this->max_ = std::max(this->max_, value);
+  }
+
+  void observe(std::chrono::steady_clock::duration const t_value) noexcept {
+    this->observe(std::chrono::duration_cast<Seconds>(t_value));
+  }
+
+  [[nodiscard]] std::uint64_t count() const noexcept { return this->count_; }
+  [[nodiscard]] double sum() const noexcept { return this->sum_; }
+  [[nodiscard]] double max() const noexcept { return this->max_; }
+
+  /**
+   * @brief Number of values in each bucket, the last one being the unbounded bucket
+   */
+  [[nodiscard]] std::span<std::uint64_t const> counts() const noexcept { return this->counts_; }
+
+  /**
+   * @brief Upper bound of the bucket holding t_quantile of the values, or the largest value if that's the unbounded
+   *        bucket, 0 if nothing is observed
+   */
+  [[nodiscard]] double quantile(double const t_quantile) const noexcept {
+    auto const rank      = static_cast<std::uint64_t>(std::ceil(t_quantile * static_cast<double>(this->count_)));
+    std::uint64_t so_far = 0;
+    for (std::size_t i = 0; i < BOUNDS.size(); ++i) {
+      so_far += this->counts_[i];
+      if (so_far >= std::max<std::uint64_t>(rank, 1)) {
+        return std::min(BOUNDS[i], this->max_);
+      }
+    }
+
+    return this->max_;
+  }
+
+ private:
+  std::array<std::uint64_t, BOUNDS.size() + 1> counts_{};
+  std::uint64_t count_ = 0;
+  double sum_          = 0;
+  double max_          = 0;
+};
+
+/**
+ * @brief Counters and latency histograms of one command type
+ */
+struct CommandMetrics {
+  std::string_view name_;
+  std::uint64_t requests_     = 0;  // packets sent, including retries
+  std::uint64_t responses_    = 0;  // responses reporting success
+  std::uint64_t retries_      = 0;  // packets sent again, after timeout or error response
+  std::uint64_t timeouts_     = 0;
+  std::uint64_t errors_       = 0;  // responses reporting error status
+  std::uint64_t wire_bytes_   = 0;  // bytes of requests on the wire, after escaping
+  std::uint64_t escape_bytes_ = 0;  // bytes added to requests by escaping
+
+  Histogram write_time_;  // from the first byte of request handed to the port, to the last one written
+  Histogram first_byte_;  // from request written, to the first byte received, only when nothing else is in flight
+  Histogram round_trip_;  // from request queued, to its response decoded
+};
+
+/**
+ * @brief Metrics of every command sent through one port, updated by Serial on its io thread
+ */
+class SessionMetrics {
+  std::map<std::uint8_t, CommandMetrics> commands_;
+  std::uint64_t received_bytes_ = 0;
+
+ public:
+  CommandMetrics& of(std::uint8_t const t_command, std::string_view const t_name) {
+    auto& metrics = this->commands_[t_command];
+    metrics.name_ = t_name;
+    return metrics;
+  }
+
+  /**
+   * @brief Metrics of t_command, which must have been sent at least once
+   */
+  CommandMetrics& of(std::uint8_t const t_command) { return this->commands_.at(t_command); }
+
+  void add_received(std::size_t const t_bytes) noexcept { this->received_bytes_ += t_bytes; }
+
+  [[nodiscard]] std::uint64_t received_bytes() const noexcept { return this->received_bytes_; }
+
+  [[nodiscard]] auto const& commands() const noexcept { return this->commands_; }
+};
+
+/**
+ * @brief Metrics of one port, labeled by its name
+ */
+struct PortMetrics {
+  std::string port_;
+  SessionMetrics metrics_;
+};
+
+namespace detail {
+
+inline std::string json_string(std::string_view const t_str) {
+  std::string ret_val{"\""};
+  for (auto const chr : t_str) {
+    if (chr == '"' or chr == '\\') {
+      ret_val.push_back('\\');
+      ret_val.push_back(chr);
+    } else if (static_cast<unsigned char>(chr) < 0x20) {
+      fmt::format_to(std::back_inserter(ret_val), "\\u{:04x}", static_cast<int>(chr));
+    } else {
+      ret_val.push_back(chr);
+    }
+  }
+
+  ret_val.push_back('"');
+  return ret_val;
+}
+
+inline std::string json_histogram(Histogram const& t_histogram) {
+  constexpr double P50 = 0.5;
+  constexpr double P99 = 0.99;
+
+  std::string buckets;
+  std::uint64_t cumulative = 0;
+  for (std::size_t i = 0; i < t_histogram.counts().size(); ++i) {
+    cumulative += t_histogram.counts()[i];
+    auto const bound = i < Histogram::BOUNDS.size() ? fmt::format("{}", Histogram::BOUNDS[i]) : "\"+Inf\"";
+    fmt::format_to(std::back_inserter(buckets), "{}{{\"le\": {}, \"count\": {}}}", i == 0 ? "" : ", ", bound,
+                   cumulative);
+  }
+
+  return fmt::format(R"({{"count": {}, "sum": {}, "max": {}, "p50": {}, "p99": {}, "buckets": [{}]}})",
+                     t_histogram.count(), t_histogram.sum(), t_histogram.max(), t_histogram.quantile(P50),
+                     t_histogram.quantile(P99), buckets);
+}
+
+}  // namespace detail
+
+/**
+ * @brief This function formats metrics of every port as JSON, bucket counts are cumulative, as in Prometheus
+ */
+inline std::string to_json(std::span<PortMetrics const> const t_ports) {
+  std::string ret_val{"{\"ports\": ["};
+  for (std::size_t i = 0; i < t_ports.size(); ++i) {
+    auto const& [port, metrics] = t_ports[i];
+    fmt::format_to(std::back_inserter(ret_val), "{}\n  {{\"port\": {}, \"received_bytes\": {}, \"commands\": [",
+                   i == 0 ? "" : ",", detail::json_string(port), metrics.received_bytes());
+
+    bool first = true;
+    for (auto const& [code, command] : metrics.commands()) {
+      fmt::format_to(std::back_inserter(ret_val),
+                     "{}\n    {{\"command\": {}, \"code\": {}, \"requests\": {}, \"responses\": {}, \"retries\": {}, "
+                     "\"timeouts\": {}, \"errors\": {}, \"wire_bytes\": {}, \"escape_bytes\": {},\n"
+                     "     \"write_time_seconds\": {},\n     \"first_byte_seconds\": {},\n"
+                     "     \"round_trip_seconds\": {}}}",
+                     first ? "" : ",", detail::json_string(command.name_), code, command.requests_,
+                     command.responses_, command.retries_, command.timeouts_, command.errors_, command.wire_bytes_,
+                     command.escape_bytes_, detail::json_histogram(command.write_time_),
+                     detail::json_histogram(command.first_byte_), detail::json_histogram(command.round_trip_));
+      first = false;
+    }
+
+    ret_val.append("]}");
+  }
+
+  ret_val.append("\n]}\n");
+  return ret_val;
+}
+
+/**
+ * @brief This function formats metrics of every port in Prometheus text exposition format, labeled by port and
+ *        command, e.g. to be picked up by node exporter textfile collector
+ */
+inline std::string to_prometheus(std::span<PortMetrics const> const t_ports) {
+  std::string ret_val;
+  auto out = std::back_inserter(ret_val);
+
+  // label values are escaped the same way as JSON strings, which is what Prometheus expects for \ and "
+  auto const labels = [](std::string_view const t_port, std::string_view const t_command) {
+    return fmt::format("port={},command={}", detail::json_string(t_port), detail::json_string(t_command));
+  };
+
+  auto const counter = [&](std::string_view const t_name, std::string_view const t_help, auto const t_member) {
+    fmt::format_to(out, "# HELP esplink_{} {}\n# TYPE esplink_{} counter\n", t_name, t_help, t_name);
+    for (auto const& [port, metrics] : t_ports) {
+      for (auto const& [code, command] : metrics.commands()) {
+        fmt::format_to(out, "esplink_{}{{{}}} {}\n", t_name, labels(port, command.name_), command.*t_member);
+      }
+    }
+  };
+
+  auto const histogram = [&](std::string_view const t_name, std::string_view const t_help, auto const t_member) {
+    fmt::format_to(out, "# HELP esplink_{} {}\n# TYPE esplink_{} histogram\n", t_name, t_help, t_name);
+    for (auto const& [port, metrics] : t_ports) {
+      for (auto const& [code, command] : metrics.commands()) {
+        auto const& hist         = command.*t_member;
+        auto const label         = labels(port, command.name_);
+        std::uint64_t cumulative = 0;
+        for (std::size_t i = 0; i < hist.counts().size(); ++i) {
+          cumulative += hist.counts()[i];
+          auto const bound = i < Histogram::BOUNDS.size() ? fmt::format("{}", Histogram::BOUNDS[i]) : "+Inf";
+          fmt::format_to(out, "esplink_{}_bucket{{{},le=\"{}\"}} {}\n", t_name, label, bound, cumulative);
+        }
+        fmt::format_to(out, "esplink_{}_sum{{{}}} {}\n", t_name, label, hist.sum());
+        fmt::format_to(out, "esplink_{}_count{{{}}} {}\n", t_name, label, hist.count());
+      }
+    }
+  };
+
+  counter("requests_total", "Requests sent, including retries", &CommandMetrics::requests_);
+  counter("responses_total", "Responses reporting success", &CommandMetrics::responses_);
+  counter("retries_total", "Requests sent again after timeout or error response", &CommandMetrics::retries_);
+  counter("timeouts_total", "Requests whose response didn't arrive in time", &CommandMetrics::timeouts_);
+  counter("errors_total", "Responses reporting error status", &CommandMetrics::errors_);
+  counter("wire_bytes_total", "Bytes of requests on the wire, after escaping", &CommandMetrics::wire_bytes_);
+  counter("escape_bytes_total", "Bytes added to requests by escaping", &CommandMetrics::escape_bytes_);
+  histogram("write_time_seconds", "Time to write a request to the port", &CommandMetrics::write_time_);
+  histogram("first_byte_seconds", "Time from request written to first byte received", &CommandMetrics::first_byte_);
+  histogram("round_trip_seconds", "Time from request queued to its response decoded", &CommandMetrics::round_trip_);
+
+  fmt::format_to(out, "# HELP esplink_received_bytes_total Bytes received from esp chip\n"
+                      "# TYPE esplink_received_bytes_total counter\n");
+  for (auto const& [port, metrics] : t_ports) {
+    fmt::format_to(out, "esplink_received_bytes_total{{port={}}} {}\n", detail::json_string(port),
+                   metrics.received_bytes());
+  }
+
+  return ret_val;
+}
+
+}  // namespace esplink
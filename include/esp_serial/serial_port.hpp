@@ -1,43 +1,79 @@
 #pragma once
 
 #include <boost/asio.hpp>
-#include <boost/asio/buffers_iterator.hpp>
-#include <boost/asio/completion_condition.hpp>
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/executor_work_guard.hpp>
 #include <boost/asio/high_resolution_timer.hpp>
 #include <boost/asio/io_context.hpp>
-#include <boost/asio/posix/stream_descriptor.hpp>
-#include <boost/asio/read.hpp>
-#include <boost/asio/read_until.hpp>
+#include <boost/asio/redirect_error.hpp>
 #include <boost/asio/serial_port.hpp>
-#include <boost/asio/windows/object_handle.hpp>
-#include <boost/next_prior.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/asio/use_future.hpp>
+#include <boost/asio/write.hpp>
+#include <cerrno>
 #include <chrono>
+#include <cstring>
+#include <deque>
 #include <fmt/format.h>
 #include <fmt/ranges.h>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
 #include <source_location>
+#include <span>
 #include <spdlog/spdlog.h>
+#include <stdexcept>
+#include <string>
+#include <thread>
 #include <unistd.h>
+#include <vector>
 
+#include "esp_common/logging.hpp"
+#include "esp_common/spsc_ring.hpp"
 #include "esp_common/utility.hpp"
+#include "esp_serial/link_estimator.hpp"
+#include "esp_serial/metrics.hpp"
 
 namespace esplink {
 
-template <typename P>
-struct MatchCondition;
+/**
+ * @brief Error of the packet Serial::async_transceive_pipelined gives up on, every packet ahead of it is acknowledged
+ */
+struct PipelineError : std::runtime_error {
+  PipelineError(std::string const& t_what, std::size_t const t_index) : std::runtime_error{t_what}, index_{t_index} {}
 
+  std::size_t index_;
+};
+
+/**
+ * @brief Serial port talking to esp chip with PacketProtocol. Every operation is a coroutine on an io_context, which
+ *        is either owned by Serial and run by its own io thread, or shared with other Serial, so that one event loop
+ *        drives many devices. Blocking counterparts of the coroutines are provided for the former.
+ *
+ * @note  A shared io_context must be run by a single thread, and a Serial on it must be closed with async_close before
+ *        being destroyed.
+ */
 template <typename PacketProtocol>
 class Serial : PacketProtocol {
   enum class Set : std::uint64_t { High = TIOCMBIC, Low = TIOCMBIS };
+  // pseudo terminals have no modem control lines, ENOTTY is tolerated so that Serial can be tested against simulator,
+  // any other error leaves esp chip where it is, which the next request finds out
+  void set_modem_line(auto const& t_native_handle, std::uint64_t t_line, Set const t_set) const noexcept {
+    if (ioctl(t_native_handle, to_underlying(t_set), &t_line) != 0 and errno != ENOTTY) {
+      spdlog::warn("Failed to set {}: {}", t_line == TIOCM_DTR ? "DTR" : "RTS", std::strerror(errno));
+    }
+  }
+
   void set_dtr(auto const& t_native_handle, Set const t_set) const noexcept {
-    std::uint64_t out_val     = TIOCM_DTR;
-    [[maybe_unused]] auto ret = ioctl(t_native_handle, to_underlying(t_set), &out_val);
-    assert(ret == 0);
+    this->set_modem_line(t_native_handle, TIOCM_DTR, t_set);
   }
 
   void set_rts(auto const& t_native_handle, Set const t_set) const noexcept {
-    std::uint64_t out_val     = TIOCM_RTS;
-    [[maybe_unused]] auto ret = ioctl(t_native_handle, to_underlying(t_set), &out_val);
-    assert(ret == 0);
+    this->set_modem_line(t_native_handle, TIOCM_RTS, t_set);
   }
 
   void hard_reset() noexcept {
@@ -52,6 +88,18 @@ class Serial : PacketProtocol {
     this->set_rts(native_handle, Set::High);
   }
 
+  boost::asio::awaitable<void> async_hard_reset() {
+    using namespace std::chrono_literals;
+    boost::asio::steady_timer sleep_timer(this->context_);
+    auto const& native_handle = this->port_.lowest_layer().native_handle();
+
+    this->set_dtr(native_handle, Set::High);
+    this->set_rts(native_handle, Set::Low);
+    sleep_timer.expires_after(100ms);
+    co_await sleep_timer.async_wait(boost::asio::use_awaitable);
+    this->set_rts(native_handle, Set::High);
+  }
+
   void reset() noexcept {
     using namespace std::chrono_literals;
     boost::asio::high_resolution_timer sleep_timer(this->port_.get_executor());
@@ -77,31 +125,67 @@ class Serial : PacketProtocol {
 
   void flush_io() noexcept { tcflush(this->port_.lowest_layer().native_handle(), TCIOFLUSH); }
 
-  using PacketProtocol::complete_condition;
-  using PacketProtocol::decode_packet;
-  using PacketProtocol::generate_packet;
+  using PacketProtocol::decode_frame;
+  using PacketProtocol::encode_packet;
+  using PacketProtocol::is_response;
 
-  boost::asio::io_context context_{};
-  boost::asio::serial_port port_;
+  using Frame     = typename PacketProtocol::Frame;
+  using WorkGuard = boost::asio::executor_work_guard<boost::asio::io_context::executor_type>;
 
-#if BOOST_ASIO_HAS_POSIX_STREAM_DESCRIPTOR
-  using bytes_readable = boost::asio::posix::stream_descriptor::bytes_readable;
-  boost::asio::posix::stream_descriptor port_helper_{context_, fcntl(port_.native_handle(), F_DUPFD_CLOEXEC)};
-#elif BOOST_ASIO_HAS_WINDOWS_OBJECT_HANDLE
-#error "not done yet"
-#endif
+  static constexpr std::size_t RX_RING_SIZE = 0x10000;
+  // follows the link once it's measured, so that a slow link isn't cut off, nor a fast one waited for in vain
+  static constexpr Timeout DEFAULT_TIMEOUT = Timeout::adaptive(std::chrono::milliseconds{1000},  //
+                                                               std::chrono::milliseconds{100});
 
-  friend MatchCondition<PacketProtocol>;
+  std::unique_ptr<boost::asio::io_context> own_context_;  // null if io_context is shared
+  boost::asio::io_context& context_;
+  std::optional<WorkGuard> work_guard_;
+  boost::asio::serial_port port_;
 
- public:
-  using TransceiveResult = typename PacketProtocol::Result;
+  // receive side: read handler fills rx_ring_ for as long as the port is open, coroutines decode frames from it.
+  // Both ends of the ring belong to the io thread, the producer being start_read, and the consumer decode_received and
+  // clear_input, so that public functions touching it run there as coroutines.
+  SpscRing<std::uint8_t> rx_ring_{RX_RING_SIZE};
+  boost::asio::steady_timer rx_retry_timer_{context_};  // ring full, wait for consumer to catch up
+  boost::asio::steady_timer rx_signal_{context_};       // cancelled whenever bytes arrive
+  bool rx_failed_ = false;
+  typename PacketProtocol::Decoder decoder_{};
+  std::deque<std::vector<std::uint8_t>> rx_frames_{};  // decoded frames not yet claimed by receive
+
+  // transmit side: send encodes into a frame and queues it, frames queued are written in order
+  struct Outgoing {
+    Frame frame_;
+    std::optional<std::uint8_t> command_;  // none for frames without command header
+  };
+
+  std::mutex tx_mutex_;
+  boost::asio::steady_timer tx_signal_{context_};  // cancelled whenever the queue is drained
+  std::deque<Outgoing> tx_queue_{};
+  std::vector<Frame> tx_spare_{};  // frames already written, reused so that encoding allocates nothing
+  bool tx_busy_ = false;
+
+  // instrumentation, only touched on the io thread: the first byte received after the last write is when esp chip
+  // started answering, provided nothing else is in flight
+  SessionMetrics metrics_{};
+  std::chrono::steady_clock::time_point tx_done_at_{};
+  std::optional<std::chrono::steady_clock::time_point> rx_first_at_{};
+
+  LinkEstimator link_;  // fed by requests with adaptive timeout answered at the first attempt
+
+  // 8N1, every byte is framed by a start bit and a stop bit
+  static LinkEstimator::Seconds byte_time(std::uint32_t const t_baud) noexcept {
+    constexpr double BITS_PER_BYTE = 10;
+    return LinkEstimator::Seconds{BITS_PER_BYTE / t_baud};
+  }
 
-  Serial(Serial const& t_ser) noexcept            = default;
-  Serial(Serial&& t_ser) noexcept                 = default;
-  Serial& operator=(Serial const& t_ser) noexcept = default;
-  Serial& operator=(Serial&& t_ser) noexcept      = default;
+  std::thread io_thread_;
 
-  explicit Serial(std::string_view const t_port, std::uint32_t const t_baud = 115200) : port_{context_, t_port.data()} {
+  Serial(std::unique_ptr<boost::asio::io_context> t_own_context, boost::asio::io_context* t_shared_context,
+         std::string_view const t_port, std::uint32_t const t_baud)
+    : own_context_{std::move(t_own_context)},
+      context_{own_context_ != nullptr ? *own_context_ : *t_shared_context},
+      port_{context_, t_port.data()},
+      link_{byte_time(t_baud)} {
     spdlog::info("Connection Success: {}, baudrate: {}", t_port, t_baud);
     this->reset();
     this->flush_io();
@@ -113,101 +197,650 @@ class Serial : PacketProtocol {
     this->port_.set_option(serial_port_base::parity{serial_port_base::parity::none});
     this->port_.set_option(serial_port_base::flow_control{serial_port_base::flow_control::none});
     spdlog::info("Setting serial port options: {} bps, 8 bits, parity: none, flow_control: none", t_baud);
+
+    // reading starts on the io_context, so that the read handler and coroutines never run concurrently
+    boost::asio::post(this->context_, [this] { this->start_read(); });
+    if (this->own_context_ != nullptr) {
+      this->work_guard_.emplace(this->context_.get_executor());
+      this->io_thread_ = std::thread([this] { this->context_.run(); });
+    }
+  }
+
+  void start_read() {
+    auto const space = this->rx_ring_.writable();
+    if (space.empty()) {
+      this->rx_retry_timer_.expires_after(std::chrono::milliseconds(1));
+      this->rx_retry_timer_.async_wait([this](auto t_err) {
+        if (not t_err) {
+          this->start_read();
+        }
+      });
+      return;
+    }
+
+    this->port_.async_read_some(boost::asio::buffer(space.data(), space.size()), [this](auto t_err, auto t_byte_read) {
+      if (t_err) {
+        if (t_err != boost::asio::error::operation_aborted) {
+          spdlog::error("Serial port read failed: {}", t_err.message());
+          this->rx_failed_ = true;
+          this->rx_signal_.cancel();
+        }
+        return;
+      }
+
+      this->rx_ring_.commit(t_byte_read);
+      this->metrics_.add_received(t_byte_read);
+      if (not this->rx_first_at_.has_value()) {
+        this->rx_first_at_ = std::chrono::steady_clock::now();
+      }
+      this->rx_signal_.cancel();
+      this->start_read();
+    });
+  }
+
+  void start_write() {
+    Outgoing const* outgoing = nullptr;
+    {
+      std::lock_guard const lock{this->tx_mutex_};
+      if (this->tx_queue_.empty()) {
+        this->tx_busy_ = false;
+        this->tx_signal_.cancel();
+        return;
+      }
+
+      outgoing = &this->tx_queue_.front();  // stays valid, queue only grows at the back while it is being written
+    }
+
+    auto const write_start = std::chrono::steady_clock::now();
+    auto const on_written  = [this, write_start, command = outgoing->command_](auto t_err, std::size_t /**/) {
+      if (t_err) {
+        spdlog::error("Serial port write failed: {}", t_err.message());
+      }
+
+      this->tx_done_at_ = std::chrono::steady_clock::now();
+      this->rx_first_at_.reset();
+      if (command.has_value()) {
+        this->metrics_.of(*command).write_time_.observe(this->tx_done_at_ - write_start);
+      }
+
+      {
+        std::lock_guard const lock{this->tx_mutex_};
+        this->tx_spare_.push_back(std::move(this->tx_queue_.front().frame_));
+        this->tx_queue_.pop_front();
+      }
+
+      this->start_write();
+    };
+    boost::asio::async_write(this->port_, outgoing->frame_.buffers(), on_written);
   }
 
   /**
-   * @brief This function reads available bytes sent by esp chip, recieved data don't necessary comply to communication
-   *        protocol
+   * @brief This function waits until t_signal is cancelled, or t_deadline is reached
    *
-   * @return auto
+   * @return false if t_deadline is reached
    */
-  auto read_raw() {
-    boost::asio::streambuf input;
-    bytes_readable command(1);
-    this->port_helper_.io_control(command);
-    auto const byte_read = boost::asio::read(this->port_helper_, input, boost::asio::transfer_exactly(command.get()));
+  static boost::asio::awaitable<bool> wait_signal(boost::asio::steady_timer& t_signal,
+                                                  std::chrono::steady_clock::time_point const t_deadline) {
+    boost::system::error_code err;
+    t_signal.expires_at(t_deadline);
+    co_await t_signal.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, err));
+    co_return err == boost::asio::error::operation_aborted;
+  }
 
-    auto begin = boost::asio::buffers_begin(input.data());
-    auto end   = boost::next(begin, byte_read);
+  /**
+   * @brief This function runs t_operation on the io thread owned by Serial, and blocks until it is done
+   */
+  template <typename T>
+  T run_sync(boost::asio::awaitable<T> t_operation) {
+    if (this->own_context_ == nullptr or this->context_.get_executor().running_in_this_thread()) {
+      throw std::logic_error("Blocking operations are only available to Serial running its own io thread");
+    }
 
-    this->flush_io();
-    return std::string(begin, end);
+    return boost::asio::co_spawn(this->context_, std::move(t_operation), boost::asio::use_future).get();
+  }
+
+  Frame take_spare_frame() {
+    std::lock_guard const lock{this->tx_mutex_};
+    if (this->tx_spare_.empty()) {
+      return {};
+    }
+
+    auto frame = std::move(this->tx_spare_.back());
+    this->tx_spare_.pop_back();
+    return frame;
+  }
+
+  std::size_t queue_frame(Frame t_frame, std::optional<std::uint8_t> const t_command) {
+    SPDLOG_TRACE("Packet content ({} byte):{}{}", t_frame.size(), HexDump{t_frame.header_},
+                 HexDump{t_frame.body(), t_frame.header_.size()});
+
+    auto const frame_size = t_frame.size();
+    std::lock_guard const lock{this->tx_mutex_};
+    this->tx_queue_.push_back({std::move(t_frame), t_command});
+    if (not this->tx_busy_) {
+      this->tx_busy_ = true;
+      boost::asio::post(this->context_, [this] { this->start_write(); });
+    }
+
+    return frame_size;
+  }
+
+  /**
+   * @brief This function records the response to a request queued at t_sent_at, time to first byte is only known if
+   *        the request is the only one in flight (t_alone)
+   */
+  void record_response(CommandMetrics& t_metrics, std::chrono::steady_clock::time_point const t_sent_at,
+                       bool const t_alone) {
+    ++t_metrics.responses_;
+    t_metrics.round_trip_.observe(std::chrono::steady_clock::now() - t_sent_at);
+    if (t_alone and this->rx_first_at_.has_value() and this->tx_done_at_ >= t_sent_at) {
+      t_metrics.first_byte_.observe(*this->rx_first_at_ - this->tx_done_at_);
+    }
   }
 
-  void transfer_raw(boost::asio::streambuf& t_buffer) { boost::asio::write(this->port_, t_buffer); }
+  /**
+   * @brief This function decodes every byte received so far
+   */
+  void decode_received() {
+    for (auto chunk = this->rx_ring_.readable(); not chunk.empty(); chunk = this->rx_ring_.readable()) {
+      SPDLOG_TRACE("Received ({} byte):{}", chunk.size(), HexDump{chunk});
+      this->decoder_.feed(chunk, [this](auto t_frame) {
+        this->rx_frames_.emplace_back(t_frame.begin(), t_frame.end());
+      });
+      this->rx_ring_.consume(chunk.size());
+    }
+  }
+
+  /**
+   * @brief This function drops everything sent by esp chip so far, including bytes the driver buffered
+   */
+  void clear_input() noexcept {
+    tcflush(this->port_.lowest_layer().native_handle(), TCIFLUSH);
+    this->rx_ring_.clear();
+    this->decoder_.reset();
+    this->rx_frames_.clear();
+  }
+
+  /**
+   * @brief This function waits for a frame accepted by t_accept, frames rejected are dropped
+   *
+   * @return The frame, or std::nullopt if none arrived before timeout
+   *
+   * @throw std::runtime_error if the port can't be read anymore
+   */
+  template <typename Accept>
+  boost::asio::awaitable<std::optional<std::vector<std::uint8_t>>> async_receive_frame(
+    std::chrono::milliseconds const t_timeout, Accept t_accept) {
+    auto const deadline = std::chrono::steady_clock::now() + t_timeout;
+    do {
+      this->decode_received();
+      while (not this->rx_frames_.empty()) {
+        auto frame = std::move(this->rx_frames_.front());
+        this->rx_frames_.pop_front();
+        if (t_accept(frame)) {
+          co_return frame;
+        }
+
+        SPDLOG_DEBUG("Dropping unrelated frame ({} byte)", frame.size());
+      }
+
+      if (this->rx_failed_) {
+        throw std::runtime_error("Serial port can't be read anymore");
+      }
+    } while (co_await wait_signal(this->rx_signal_, deadline));
+
+    spdlog::warn("Serial port read timeout");
+    co_return std::nullopt;
+  }
+
+ public:
+  using TransceiveResult = typename PacketProtocol::Result;
+
+  // io_context refers to this
+  Serial(Serial const& t_ser)            = delete;
+  Serial(Serial&& t_ser)                 = delete;
+  Serial& operator=(Serial const& t_ser) = delete;
+  Serial& operator=(Serial&& t_ser)      = delete;
+
+  /**
+   * @brief Opens t_port, with its own io thread
+   */
+  explicit Serial(std::string_view const t_port, std::uint32_t const t_baud = 115200)
+    : Serial(std::make_unique<boost::asio::io_context>(), nullptr, t_port, t_baud) {}
+
+  /**
+   * @brief Opens t_port on t_context shared with other Serial, only coroutines can be used then
+   */
+  Serial(boost::asio::io_context& t_context, std::string_view const t_port, std::uint32_t const t_baud = 115200)
+    : Serial(nullptr, &t_context, t_port, t_baud) {}
+
+  /**
+   * @brief This function takes bytes sent by esp chip that haven't been decoded yet, recieved data don't necessary
+   *        comply to communication protocol
+   */
+  boost::asio::awaitable<std::string> async_read_raw() {
+    std::string ret_val;
+    for (auto chunk = this->rx_ring_.readable(); not chunk.empty(); chunk = this->rx_ring_.readable()) {
+      ret_val.append(chunk.begin(), chunk.end());
+      this->rx_ring_.consume(chunk.size());
+    }
+
+    co_return ret_val;
+  }
+
+  std::string read_raw() { return this->run_sync(this->async_read_raw()); }
+
+  void transfer_raw(boost::asio::streambuf& t_buffer) {
+    this->flush_tx();
+    boost::asio::write(this->port_, t_buffer);
+  }
 
   auto& get_io_context() noexcept { return this->context_; }
 
+  /**
+   * @brief This function changes baudrate of the port, bytes received at previous baudrate are discarded
+   *
+   * @throw boost::system::system_error if the adapter doesn't support t_baud
+   */
+  boost::asio::awaitable<void> async_set_baud_rate(std::uint32_t const t_baud) {
+    co_await this->async_flush_tx();  // packets queued are meant to be sent at previous baudrate
+    this->port_.set_option(boost::asio::serial_port_base::baud_rate(t_baud));
+    this->clear_input();
+    this->link_.reset(byte_time(t_baud));
+    spdlog::info("Setting serial port baudrate: {} bps", t_baud);
+  }
+
+  void set_baud_rate(std::uint32_t const t_baud) { this->run_sync(this->async_set_baud_rate(t_baud)); }
+
+  /**
+   * @brief This function resets esp chip into download mode again, as opening the port does, e.g. after the chip stops
+   *        responding, and brings the port back to t_baud, which ROM loader starts with
+   */
+  boost::asio::awaitable<void> async_reset(std::uint32_t const t_baud) {
+    using namespace std::chrono_literals;
+    co_await this->async_flush_tx();
+
+    boost::asio::steady_timer sleep_timer(this->context_);
+    auto const& native_handle = this->port_.lowest_layer().native_handle();
+    auto const sleep          = [&sleep_timer](auto const t_duration) {
+      sleep_timer.expires_after(t_duration);
+      return sleep_timer.async_wait(boost::asio::use_awaitable);
+    };
+
+    // same sequence as reset(), see the table there
+    this->set_dtr(native_handle, Set::High);
+    this->set_rts(native_handle, Set::Low);
+    co_await sleep(100ms);
+    this->set_dtr(native_handle, Set::Low);
+    this->set_rts(native_handle, Set::High);
+    co_await sleep(50ms);
+    this->set_dtr(native_handle, Set::High);
+
+    co_await this->async_set_baud_rate(t_baud);
+  }
+
+  [[nodiscard]] std::uint32_t get_baud_rate() {
+    boost::asio::serial_port_base::baud_rate baud;
+    this->port_.get_option(baud);
+    return baud.value();
+  }
+
+  auto& get_protocol() noexcept { return static_cast<PacketProtocol&>(*this); }
+
+  /**
+   * @brief Round trip time and loss rate measured so far at current baudrate
+   */
+  [[nodiscard]] LinkEstimator const& link() const noexcept { return this->link_; }
+
+  /**
+   * @brief Per command counters and latency histograms of everything sent so far, must only be read while no
+   *        operation is running on the port
+   */
+  [[nodiscard]] SessionMetrics const& metrics() const noexcept { return this->metrics_; }
+
+  /**
+   * @brief This function waits until a frame whose content is exactly t_content is received, e.g. the greeting sent by
+   *        flasher stub after it starts
+   *
+   * @param t_content Frame content to wait for
+   * @param t_timeout Maximum wait time for income data
+   *
+   * @return true if the frame is received before timeout
+   */
+  boost::asio::awaitable<bool> async_wait_for_frame(std::string_view const t_content,
+                                                    std::chrono::milliseconds const t_timeout) {
+    auto const frame = co_await this->async_receive_frame(t_timeout, [t_content](auto const& t_frame) {
+      return std::equal(t_frame.begin(), t_frame.end(), t_content.begin(), t_content.end(),
+                        [](auto t_lhs, auto t_rhs) { return t_lhs == static_cast<std::uint8_t>(t_rhs); });
+    });
+    co_return frame.has_value();
+  }
+
+  bool wait_for_frame(std::string_view const t_content, std::chrono::milliseconds const t_timeout) {
+    return this->run_sync(this->async_wait_for_frame(t_content, t_timeout));
+  }
+
+  /**
+   * @brief This function waits for the next frame, whatever it holds, e.g. data streamed by flasher stub
+   *
+   * @return Unescaped frame content, or std::nullopt if nothing complete arrived before timeout
+   *
+   * @throw std::runtime_error if the port can't be read anymore
+   */
+  boost::asio::awaitable<std::optional<std::vector<std::uint8_t>>> async_receive_frame(
+    std::chrono::milliseconds const t_timeout) {
+    return this->async_receive_frame(t_timeout, [](auto const& /**/) { return true; });
+  }
+
+  std::optional<std::vector<std::uint8_t>> receive_frame(std::chrono::milliseconds const t_timeout) {
+    return this->run_sync(this->async_receive_frame(t_timeout));
+  }
+
+  /**
+   * @brief This function generates protocol compliant packet from t_data and queues it to be written, without waiting
+   *        for it to be written, nor for the response
+   *
+   * @param t_data  Data to be sent to, the data will be passed to PacketProtocol::encode_packet to generate protocol
+   *                compliant packet
+   *
+   * @return Size of the packet on the wire
+   */
+  std::size_t send(auto const& t_data) {
+    auto frame = this->take_spare_frame();
+    this->encode_packet(frame, t_data);
+    SPDLOG_DEBUG("Sending Packet: {} ({:x})", t_data.NAME, t_data.COMMAND_BYTE);
+
+    auto& metrics = this->metrics_.of(t_data.COMMAND_BYTE, t_data.NAME);
+    ++metrics.requests_;
+    metrics.wire_bytes_ += frame.size();
+    metrics.escape_bytes_ += frame.size() - frame.raw_size_;
+    return this->queue_frame(std::move(frame), t_data.COMMAND_BYTE);
+  }
+
+  /**
+   * @brief This function queues a frame holding t_content as is, without command header, to be written
+   *
+   * @return Size of the frame on the wire
+   */
+  std::size_t send_frame(std::span<std::uint8_t const> const t_content) {
+    auto frame = this->take_spare_frame();
+    PacketProtocol::encode_frame(frame, t_content);
+    return this->queue_frame(std::move(frame), std::nullopt);
+  }
+
+  /**
+   * @brief This function waits until every packet queued by send is written to the port
+   */
+  boost::asio::awaitable<void> async_flush_tx() {
+    while (true) {
+      {
+        std::lock_guard const lock{this->tx_mutex_};
+        if (not this->tx_busy_) {
+          co_return;
+        }
+      }
+
+      co_await wait_signal(this->tx_signal_, std::chrono::steady_clock::time_point::max());
+    }
+  }
+
+  void flush_tx() { this->run_sync(this->async_flush_tx()); }
+
+  /**
+   * @brief This function waits for the response to command t_command. Frames arriving with the response are kept, so
+   *        that responses of packets sent back to back are not lost, while frames not being a response to t_command,
+   *        e.g. extra responses of SYNC, or late responses of a packet sent again, are dropped.
+   *
+   * @param t_timeout Maximum wait time for income data
+   * @param t_command Command byte of the request
+   *
+   * @return Decoded packet, or std::nullopt if nothing complete arrived before timeout
+   *
+   * @throw std::runtime_error if the packet reports an error status
+   */
+  boost::asio::awaitable<std::optional<TransceiveResult>> async_receive(std::chrono::milliseconds const t_timeout,
+                                                                        std::uint8_t const t_command) {
+    auto const frame = co_await this->async_receive_frame(t_timeout, [this, t_command](auto const& t_frame) {
+      return this->is_response(t_frame, t_command);
+    });
+
+    if (not frame.has_value()) {
+      co_return std::nullopt;
+    }
+
+    co_return this->decode_frame(*frame);
+  }
+
+  /**
+   * @brief This function discards everything sent by esp chip so far, including bytes already buffered
+   */
+  boost::asio::awaitable<void> async_discard_input() {
+    this->clear_input();
+    co_return;
+  }
+
+  void discard_input() { this->run_sync(this->async_discard_input()); }
+
   /**
    * @brief This function transmits and recieves data from esp chip, it assumes the data to send and recieve comply to
    *        certain communication protocol defined by PacketProtocol
    *
-   * @param t_data  Data to be sent to, the data will be passed to PacketProtocol::generate_packet to generate protocol
+   * @param t_data  Data to be sent to, the data will be passed to PacketProtocol::encode_packet to generate protocol
    *                compliant packet
-   * @param t_retry Number of time to retry if error happened, including timeout
-   * @param t_timeout Maximum wait time for income data
+   * @param t_retry Number of attempts, the first one included, before giving up on timeout, 0 retries forever. Error
+   *                reported by esp chip isn't retried.
+   * @param t_timeout Maximum wait time for income data, fixed, or adaptive to the link
    *
    * @return TransceiveResult, defined by PacketProtocol, is the return value of PacketProtocol::decode_packet
    */
-  TransceiveResult transceive(auto const& t_data, int t_retry = 0,
-                              std::chrono::milliseconds t_timeout = std::chrono::milliseconds(100)) {
+  template <typename Data>
+  boost::asio::awaitable<TransceiveResult> async_transceive(Data const t_data, int t_retry = 0,
+                                                            Timeout const t_timeout = DEFAULT_TIMEOUT) {
     int const retried = t_retry;
     do {
-      this->flush_io();  // flush all data sent previously from ESP32
+      auto const sent_at = std::chrono::steady_clock::now();
+      auto const size    = this->send(t_data);
+      auto& metrics      = this->metrics_.of(t_data.COMMAND_BYTE);
+      metrics.retries_ += t_retry == retried ? 0 : 1;
+
+      try {
+        auto result = co_await this->async_receive(t_timeout.resolve(this->link_, size), t_data.COMMAND_BYTE);
+        if (result.has_value()) {
+          this->record_response(metrics, sent_at, true);
+
+          // commands with fixed timeout wait for esp chip to do some work, e.g. erasing, which says nothing of the link
+          if (t_timeout.is_adaptive() and t_retry == retried) {
+            this->link_.add_sample(size, std::chrono::steady_clock::now() - sent_at);
+          }
+          co_return *std::move(result);
+        }
+      } catch (std::exception& t_e) {
+        ++metrics.errors_;
+        throw std::runtime_error(fmt::format("{}: {}", t_data.NAME, t_e.what()));
+      }
 
-      auto const packet       = this->generate_packet(t_data);
-      auto const byte_written = boost::asio::write(this->port_, boost::asio::buffer(packet));
-      spdlog::info("Sending Packet: {} ({:x})", t_data.NAME, t_data.COMMAND_BYTE);
-      spdlog::debug("Packet content: ({} byte)\n", byte_written);
-      print_byte_stream(packet.begin(), packet.end());
+      ++metrics.timeouts_;
+      this->link_.add_loss(size);
+      this->link_.back_off();
+      this->clear_input();  // late response to this attempt shouldn't be taken as response of the next one
+    } while (--t_retry != 0);
 
-      boost::asio::high_resolution_timer timeout_timer{this->context_, t_timeout};
-      timeout_timer.async_wait([this](auto t_err) mutable {
-        if (not t_err) {
-          spdlog::warn("Serial port read timeout");
+    throw std::runtime_error(fmt::format("{}: Read failed after retrying for {} times",  //
+                                         t_data.NAME, retried));
+  }
+
+  TransceiveResult transceive(auto const& t_data, int t_retry = 0, Timeout const t_timeout = DEFAULT_TIMEOUT) {
+    return this->run_sync(this->async_transceive(t_data, t_retry, t_timeout));
+  }
+
+  /**
+   * @brief This function waits for, and throws away, up to t_count responses to t_command, it stops early on timeout
+   */
+  boost::asio::awaitable<void> async_drain_responses(std::size_t const t_count, std::chrono::milliseconds t_timeout,
+                                                     std::uint8_t const t_command) {
+    for (std::size_t i = 0; i < t_count; ++i) {
+      try {
+        auto const result = co_await this->async_receive(t_timeout, t_command);
+        if (not result.has_value()) {
+          break;
         }
-        this->port_.cancel();
-      });
+      } catch (std::runtime_error& /**/) {
+        // error responses are expected for packets sent after a failed one
+      }
+    }
 
-      std::size_t byte_read = 0;
-      auto read_done_cb     = [&](auto t_err, auto t_byte_read) mutable {
-        if (not t_err) {
-          byte_read = t_byte_read;  // if any error happened, discard all buffer, therefore only assign on success
-          timeout_timer.cancel();
+    this->clear_input();
+  }
+
+  /**
+   * @brief This function transmits a sequence of packets while keeping up to t_window of them in flight, instead of
+   *        waiting for the response of each packet before sending the next one. Esp chip answers requests in order,
+   *        therefore the n-th response belongs to the n-th outstanding packet. A packet reported as failed, or whose
+   *        response times out, is sent again, followed by every packet sent after it, once their responses still on
+   *        the way are drained. Adaptive timeout is measured from the response to the previous packet, or from sending
+   *        the packet if that's later, which is also the round trip fed to the link estimator.
+   *
+   * @param t_packets Random access range of data to be sent, must outlive the coroutine
+   * @param t_window  Maximum number of packets waiting for response, 1 falls back to stop-and-wait
+   * @param t_retry Number of attempts of each packet, the first one included, before giving up on error or timeout, 0
+   *                retries forever, same as async_transceive. Packets sent again behind a failed one aren't charged.
+   *                Responses carry nothing to tell which request they answer, a request lost on the way shifts the
+   *                responses behind it onto the packets ahead of them, which only shows as a timeout once responses
+   *                run out. Unless esp chip refuses packets out of order, or t_window is 1, responses already handed
+   *                to t_on_response can't be trusted by then, t_retry should be 1 and the caller start over. A
+   *                request whose response is lost is acted on twice once sent again, therefore t_retry should be 1
+   *                as well for requests acted on by position rather than by what they carry, e.g. MEM_DATA written at
+   *                the running pointer of ROM loader, whatever t_window is.
+   * @param t_timeout Maximum wait time for the response to the oldest outstanding packet, fixed or adaptive
+   * @param t_on_response Called with index of the packet and its response for every packet acknowledged
+   *
+   * @throw PipelineError if a packet is out of attempts, responses of packets behind it are drained by then
+   */
+  template <typename Packets>
+  boost::asio::awaitable<void> async_transceive_pipelined(
+    Packets const& t_packets, std::size_t const t_window, int const t_retry = 0,
+    Timeout const t_timeout                                                 = DEFAULT_TIMEOUT,
+    std::function<void(std::size_t, TransceiveResult const&)> t_on_response = {}) {
+    struct Outstanding {
+      std::size_t index_;
+      std::size_t size_;
+      std::chrono::steady_clock::time_point sent_;
+    };
+
+    std::deque<std::size_t> pending(std::size(t_packets));
+    std::iota(pending.begin(), pending.end(), 0);
+    std::deque<Outstanding> in_flight;
+    std::vector<int> retried(std::size(t_packets), 0);
+    std::chrono::steady_clock::time_point last_response{};
+
+    auto const resend_later = [&](std::size_t const t_idx, std::string_view t_reason) {
+      auto const& packet = t_packets[t_idx];
+      ++retried[t_idx];
+      if (t_retry != 0 and retried[t_idx] >= t_retry) {
+        throw PipelineError(fmt::format("{} #{}: {}", packet.NAME, t_idx, t_reason), t_idx);
+      }
+      spdlog::warn("{} #{}: {}, {} attempts left", packet.NAME, t_idx, t_reason,
+                   t_retry != 0 ? fmt::to_string(t_retry - retried[t_idx]) : "unlimited");
+      ++this->metrics_.of(packet.COMMAND_BYTE).retries_;
+      pending.push_front(t_idx);
+    };
+
+    this->clear_input();
+    while (not pending.empty() or not in_flight.empty()) {
+      while (in_flight.size() < std::max<std::size_t>(t_window, 1) and not pending.empty()) {
+        auto const size = this->send(t_packets[pending.front()]);
+        in_flight.push_back({pending.front(), size, std::chrono::steady_clock::now()});
+        pending.pop_front();
+      }
+
+      auto const front   = in_flight.front();
+      auto const command = t_packets[front.index_].COMMAND_BYTE;
+      auto const timeout = t_timeout.resolve(this->link_, front.size_);
+      std::optional<TransceiveResult> result;
+      std::optional<std::string> error;
+      try {
+        result = co_await this->async_receive(timeout, command);
+      } catch (std::runtime_error& t_e) {
+        error = t_e.what();
+      }
+
+      auto& metrics = this->metrics_.of(command);
+      if (result.has_value()) {
+        this->record_response(metrics, front.sent_, in_flight.size() == 1);
+
+        auto const now = std::chrono::steady_clock::now();
+        if (t_timeout.is_adaptive() and retried[front.index_] == 0) {
+          this->link_.add_sample(front.size_, now - std::max(front.sent_, last_response));
         }
-      };
-      boost::asio::streambuf input_buffer;  // local streambuf so that the content will be cleaned up automatically
-      boost::asio::async_read_until(this->port_, input_buffer, MatchCondition{this}, read_done_cb);
+        last_response = now;
 
-      this->context_.run();
-      this->context_.reset();
+        if (t_on_response) {
+          t_on_response(front.index_, *result);
+        }
 
-      if (byte_read == 0) {
+        in_flight.pop_front();
         continue;
       }
 
-      try {
-        return this->decode_packet(boost::asio::buffers_begin(input_buffer.data()), byte_read);
-      } catch (std::exception& t_e) {
-        throw std::runtime_error(fmt::format("{}: {}", t_data.NAME, t_e.what()));
+      if (error.has_value()) {
+        ++metrics.errors_;
+      } else {
+        ++metrics.timeouts_;
+        this->link_.back_off();
+        error = "Timeout";
       }
-    } while (--t_retry != 0);
 
-    throw std::runtime_error(fmt::format("{}: Read failed after retrying for {} times",  //
-                                         t_data.NAME, retried));
+      // packets sent after the failed or lost one were sent assuming it succeeded, esp chip may have refused them, so
+      // their responses are drained and they are sent again in order after it (go-back-N), only the failed or lost one
+      // is charged a retry
+      this->link_.add_loss(front.size_);
+      in_flight.pop_front();
+      co_await this->async_drain_responses(in_flight.size(), timeout, command);
+      std::transform(in_flight.rbegin(), in_flight.rend(), std::front_inserter(pending),
+                     [](auto const& t_out) { return t_out.index_; });
+      in_flight.clear();
+      resend_later(front.index_, *error);
+    }
   }
 
-  ~Serial() { this->hard_reset(); }
-};
+  void transceive_pipelined(auto const& t_packets, std::size_t const t_window, int const t_retry = 0,
+                            Timeout const t_timeout = DEFAULT_TIMEOUT,
+                            std::function<void(std::size_t, TransceiveResult const&)> const& t_on_response = {}) {
+    this->run_sync(this->async_transceive_pipelined(t_packets, t_window, t_retry, t_timeout, t_on_response));
+  }
+
+  /**
+   * @brief This function resets esp chip out of download mode and closes the port, nothing can be sent afterwards
+   */
+  boost::asio::awaitable<void> async_close() {
+    co_await this->async_flush_tx();
+    co_await this->async_hard_reset();
 
-template <typename P>
-struct MatchCondition {
-  Serial<P>* port_;
+    boost::system::error_code err;
+    this->port_.close(err);
+    this->rx_retry_timer_.cancel();
+  }
+
+  ~Serial() {
+    if (this->own_context_ == nullptr) {
+      if (this->port_.is_open()) {
+        this->hard_reset();
+      }
+      return;
+    }
 
-  auto operator()(auto t_begin, auto t_end) { return this->port_->complete_condition(t_begin, t_end); }
+    try {
+      if (this->port_.is_open()) {
+        this->run_sync(this->async_close());
+      }
+    } catch (std::exception const& t_e) {
+      spdlog::error("Failed to close serial port: {}", t_e.what());
+    }
+
+    this->work_guard_.reset();
+    this->context_.stop();
+    this->io_thread_.join();
+  }
 };
 
 }  // namespace esplink
-
-template <typename P>
-struct boost::asio::is_match_condition<esplink::MatchCondition<P>> : boost::true_type {};
@@ -2,26 +2,30 @@
 
 #include <algorithm>
 #include <boost/asio.hpp>
-#include <boost/asio/high_resolution_timer.hpp>
-#include <boost/next_prior.hpp>
 #include <chrono>
+#include <cstring>
 #include <fmt/ranges.h>
 #include <iterator>
+#include <memory>
+#include <optional>
+#include <span>
 #include <range/v3/algorithm/for_each.hpp>
 #include <spdlog/spdlog.h>
 #include <vector>
 
+#include "esp_common/constants.hpp"
+#include "esp_common/logging.hpp"
 #include "esp_common/utility.hpp"
+#include "esp_serial/slip_kernel.hpp"
 
 namespace esplink {
 
 class ESPSLIP {
  private:
-  static constexpr auto SLIP_HEADER_SIZE           = 8;
-  static constexpr auto MINIMUM_DATA_SIZE          = 2;
-  static constexpr auto MINIMUM_PACKET_SIZE        = SLIP_HEADER_SIZE + MINIMUM_DATA_SIZE + 2;  // 2: start and end END
+  static constexpr std::size_t SLIP_HEADER_SIZE    = 8;
   static constexpr std::uint8_t REQUEST_DIRECTION  = 0x0;
   static constexpr std::uint8_t RESPONSE_DIRECTION = 0x01;
+  static constexpr std::size_t FRAME_OVERHEAD      = SLIP_HEADER_SIZE + 2;  // header, and END on both sides
 
   static constexpr auto get_err_string = [](std::uint32_t t_err) {
     constexpr auto RCV_MSG_INVALID    = 0x5;
@@ -52,15 +56,13 @@ class ESPSLIP {
     }
   };
 
-  using iterator       = boost::asio::buffers_iterator<boost::asio::const_buffers_1>;
-  bool unpaired_start_ = false;
+  std::size_t status_size_ = ROM_STATUS_SIZE;
 
  public:
   static constexpr std::uint8_t SLIP_END     = 0xC0;
   static constexpr std::uint8_t SLIP_ESC     = 0xDB;
   static constexpr std::uint8_t SLIP_ESC_END = 0xDC;
   static constexpr std::uint8_t SLIP_ESC_ESC = 0xDD;
-  static constexpr auto is_slip_end = [](auto const t_in) { return static_cast<std::uint8_t>(t_in) == SLIP_END; };
 
   struct Response {
     std::uint8_t directions_ = RESPONSE_DIRECTION; /*!< direction, must be 0x01 (RESPONSE_DIRECTION) */
@@ -72,147 +74,292 @@ class ESPSLIP {
 
   using Result = Response;
 
+  static constexpr std::size_t ROM_STATUS_SIZE  = 4;
+  static constexpr std::size_t STUB_STATUS_SIZE = 2;
+
   /**
-   * @brief This function decodes slip packet
-   *
-   * @param t_buffer  Buffer iterator of data sent by esp chips
-   * @param t_byte_read Size of buffer
-   * @return Result
-   *
-   * @note This function assumes input data to be slip compliant since this will be called only if complete_condition is
-   *       satisfied
+   * @brief ROM loader of esp32 series ends every response with 4 status bytes, while flasher stub and ROM loader of
+   *        esp8266 use only 2
    */
-  [[nodiscard]] Result decode_packet(auto t_buffer, std::size_t t_byte_read) const {
-    auto const vec = [=]() {
-      auto const buffer_end = boost::next(t_buffer, t_byte_read);
-      auto packet_start     = boost::next(std::find_if(t_buffer, buffer_end, is_slip_end));
-      std::vector<std::uint32_t> ret;  // prevent std::uint8_t overflow during arithmetic
-      ret.reserve(t_byte_read);
-      for (std::uint8_t prev = 0, curr = static_cast<std::uint8_t>(*packet_start); packet_start != buffer_end;
-           prev = curr, curr = static_cast<std::uint8_t>(*++packet_start)) {
-        if (curr == SLIP_ESC) {
-          continue;
+  void set_status_size(std::size_t const t_status_size) noexcept { this->status_size_ = t_status_size; }
+
+  /**
+   * @brief Resumable SLIP decoder, bytes are fed as they arrive and complete frames are handed out as soon as their
+   *        closing END is seen. Scanning state, including an escape split across two reads, is kept between calls, so
+   *        that every byte is looked at once. Bytes before the first END are treated as garbage, a frame growing past
+   *        MAX_FRAME_SIZE is dropped and decoding resumes at the next END.
+   */
+  class Decoder {
+   public:
+    static constexpr std::size_t MAX_FRAME_SIZE = 0x10000;
+
+    /**
+     * @brief This function consumes t_chunk, t_on_frame is called with the unescaped content of every complete
+     *        non-empty frame, i.e. without the enclosing ENDs. The span is only valid during the call.
+     */
+    void feed(std::span<std::uint8_t const> t_chunk, auto&& t_on_frame) {
+      while (not t_chunk.empty()) {
+        auto const* const end_pos =
+          static_cast<std::uint8_t const*>(std::memchr(t_chunk.data(), SLIP_END, t_chunk.size()));
+        auto const run_size = end_pos == nullptr ? t_chunk.size() : static_cast<std::size_t>(end_pos - t_chunk.data());
+
+        if (this->in_frame_) {
+          this->append(t_chunk.first(run_size));
         }
 
-        if (curr == SLIP_ESC_END and prev == SLIP_ESC) {
-          ret.push_back(SLIP_END);
-        } else if (curr == SLIP_ESC_ESC and prev == SLIP_ESC) {
-          ret.push_back(SLIP_ESC);
-        } else {
-          ret.push_back(curr);
+        if (end_pos == nullptr) {
+          break;
         }
+
+        if (this->in_frame_ and not this->frame_.empty()) {
+          t_on_frame(std::span<std::uint8_t const>{this->frame_});
+        }
+
+        // END closing a frame is also taken as the start of the next one, empty frames in between are skipped
+        this->frame_.clear();
+        this->in_frame_       = true;
+        this->pending_escape_ = false;
+        t_chunk               = t_chunk.subspan(run_size + 1);
+      }
+    }
+
+    /**
+     * @brief This function drops partially received frame, following bytes are garbage until next END
+     */
+    void reset() noexcept {
+      this->frame_.clear();
+      this->in_frame_       = false;
+      this->pending_escape_ = false;
+    }
+
+   private:
+    void append(std::span<std::uint8_t const> t_run) {
+      if (t_run.empty()) {
+        return;
       }
 
-      return ret;
-    }();
+      if (this->pending_escape_) {
+        auto const escaped = t_run.front();
+        this->frame_.push_back(escaped == SLIP_ESC_END ? SLIP_END : (escaped == SLIP_ESC_ESC ? SLIP_ESC : escaped));
+        this->pending_escape_ = false;
+        t_run                 = t_run.subspan(1);
+      }
+
+      auto const old_size = this->frame_.size();
+      if (old_size + t_run.size() > MAX_FRAME_SIZE) {
+        spdlog::warn("Received frame exceeds {} bytes, dropped", MAX_FRAME_SIZE);
+        this->reset();
+        return;
+      }
 
-    auto const low_byte  = vec[2];
-    auto const high_byte = vec[3];
-    auto const data_size = high_byte << 8 | low_byte;
+      this->frame_.resize(old_size + t_run.size());
+      auto* const out       = this->frame_.data() + old_size;
+      auto const result     = slip::unescape(t_run.data(), t_run.data() + t_run.size(), out);
+      this->pending_escape_ = result.in_ != t_run.data() + t_run.size();  // ESC is the last byte of this read
+      this->frame_.resize(static_cast<std::size_t>(result.out_ - this->frame_.data()));
+    }
+
+    std::vector<std::uint8_t> frame_;
+    bool in_frame_       = false;
+    bool pending_escape_ = false;
+  };
 
-    spdlog::debug("Raw bytes (len = {}):\n", vec.size());
-    print_byte_stream(vec.begin(), vec.end());
+  /**
+   * @brief This function checks whether t_frame, as handed out by Decoder, is a response to t_command. Anything else,
+   *        e.g. boot messages, or extra responses of SYNC, is expected to be ignored
+   */
+  [[nodiscard]] bool is_response(std::span<std::uint8_t const> t_frame, std::uint8_t const t_command) const noexcept {
+    if (t_frame.size() < SLIP_HEADER_SIZE + this->status_size_ or t_frame[0] != RESPONSE_DIRECTION) {
+      return false;
+    }
+
+    return t_frame[1] == t_command;
+  }
 
-    assert(vec.front() == RESPONSE_DIRECTION);
-    assert(t_byte_read == SLIP_HEADER_SIZE + data_size + 1U);
-    auto const status_byte_idx = vec.size() - 4;
-    if (vec.at(status_byte_idx) != 0) {
-      auto const& code = vec.at(status_byte_idx + 1);
+  /**
+   * @brief This function decodes one unescaped frame, as handed out by Decoder
+   *
+   * @throw std::runtime_error if the frame reports an error status
+   */
+  [[nodiscard]] Result decode_frame(std::span<std::uint8_t const> const t_frame) const {
+    SPDLOG_TRACE("Response ({} byte):{}", t_frame.size(), HexDump{t_frame});
+
+    if (t_frame.size() < SLIP_HEADER_SIZE + this->status_size_) {
+      throw std::runtime_error(fmt::format("Response of {} bytes is too short", t_frame.size()));
+    }
+
+    assert(t_frame.front() == RESPONSE_DIRECTION);
+    auto const status_byte_idx = t_frame.size() - this->status_size_;
+    if (t_frame[status_byte_idx] != 0) {
+      auto const& code = t_frame[status_byte_idx + 1];
       auto const& desc = get_err_string(code);
       throw std::runtime_error(fmt::format("Operation failed with error code \"{:02X}\": {}", code, desc));
     }
 
+    auto const data_size = static_cast<std::uint32_t>(t_frame[3]) << 8U | t_frame[2];
+
     Response resp;
 
-    resp.command_ = static_cast<std::uint8_t>(vec[1]);
+    resp.command_ = t_frame[1];
     resp.size_    = static_cast<std::uint16_t>(data_size);
-    resp.value_   = (vec[7] << 24) | (vec[6] << 16) | (vec[5] << 8) | vec[4];
-    resp.data_ = std::vector<std::uint8_t>(vec.begin() + SLIP_HEADER_SIZE, vec.begin() + SLIP_HEADER_SIZE + data_size);
+    resp.value_   = static_cast<std::uint32_t>(t_frame[7] << 24U | t_frame[6] << 16U | t_frame[5] << 8U | t_frame[4]);
+
+    auto const data = t_frame.subspan(SLIP_HEADER_SIZE);
+    resp.data_.assign(data.begin(), data.begin() + std::min<std::ptrdiff_t>(data_size, std::ssize(data)));
 
     return resp;
   }
 
-  [[nodiscard]] auto generate_packet(auto&& t_cmd) {
-    auto const data_content = t_cmd();
-
-    auto const size_of_data = static_cast<std::uint16_t>(std::size(data_content));
-    auto packet             = std::vector<std::uint8_t>{SLIP_END, REQUEST_DIRECTION, t_cmd.COMMAND_BYTE};
-    auto insert_byte        = [&packet](auto const t_byte) {
-      switch (t_byte) {
-        case SLIP_END:
-          packet.push_back(SLIP_ESC);
-          packet.push_back(SLIP_ESC_END);
-          break;
-        case SLIP_ESC:
-          packet.push_back(SLIP_ESC);
-          packet.push_back(SLIP_ESC_ESC);
-          break;
-        case SLIP_ESC_END:
-          [[fallthrough]];
-        case SLIP_ESC_ESC:
-          [[fallthrough]];
-        default:
-          packet.push_back(t_byte);
-          break;
-      }
-    };
-
-    packet.reserve(size_of_data + SLIP_HEADER_SIZE + 2);  // 2: initial END and end END
-    ranges::for_each(std::bit_cast<std::array<std::uint8_t, sizeof(size_of_data)>>(size_of_data), insert_byte);
+  /**
+   * @brief This function decodes the first slip packet in the buffer, bytes before its starting END are skipped
+   *
+   * @param t_buffer  Buffer iterator of data sent by esp chips
+   * @param t_byte_read Size of buffer
+   * @return Result
+   */
+  [[nodiscard]] Result decode_packet(auto t_buffer, std::size_t t_byte_read) const {
+    std::vector<std::uint8_t> const raw(t_buffer, std::next(t_buffer, static_cast<std::ptrdiff_t>(t_byte_read)));
+    std::vector<std::uint8_t> closed{SLIP_END};  // last END may not be included
+    closed.insert(closed.end(), std::find(raw.begin(), raw.end(), SLIP_END), raw.end());
+    closed.push_back(SLIP_END);
 
-    std::uint32_t const check_sum = [&]() {
-      if constexpr (requires { t_cmd.check_sum(); }) {
-        return t_cmd.check_sum();
+    std::optional<Result> result;
+    Decoder decoder;
+    decoder.feed(closed, [&](auto t_frame) {
+      if (not result.has_value()) {
+        result = this->decode_frame(t_frame);
       }
+    });
 
-      return std::uint8_t{};
-    }();
-    ranges::for_each(std::bit_cast<std::array<std::uint8_t, sizeof(check_sum)>>(check_sum), insert_byte);
-    ranges::for_each(data_content, insert_byte);
+    if (not result.has_value()) {
+      throw std::runtime_error("No complete packet in buffer");
+    }
 
-    packet.push_back(SLIP_END);
-    return packet;
+    return *std::move(result);
   }
 
   /**
-   * @brief This function checks whether ESP send complete message to us. The protocol adopted by ESP is SLIP, where
-   *        the special byte END (0xC) serves as start and end of the signal. A typical read may look like following:
-   *
-   *        DB DC C0 XX |  C0  01 08 04 00 07 07 12 20 DB DC 00 00 C0 | XX C0 XX XX
-   *        ^^^^^^^^^^^ |  ^^                          ^^ ^^       ^^ | ^^^^^^^^^^^
-   *    redundant bytes | END                         ESC ESC_END END | redundant bytes
-   *
-   * @param t_begin
-   * @param t_end
-   * @return auto
+   * @brief Encoded packet, split into the part before and the part after payload, both buffers are reused between
+   *        packets so that framing allocates nothing once they have grown to the largest packet sent
    */
-  auto complete_condition(iterator const t_begin, iterator const t_end) {
-    auto const read_size = t_end - t_begin;
-    if (read_size != 0) {
-      spdlog::debug("Received: \n");
-      print_byte_stream(t_begin, t_end);
+  struct Frame {
+    std::vector<std::uint8_t> header_;  // END, direction, command, size, checksum, and fixed size data of command
+    std::vector<std::uint8_t> body_;    // payload and the final END, only the first body_size_ bytes are valid
+    std::size_t body_size_ = 0;
+    std::size_t raw_size_  = 0;  // size before escaping
+
+    [[nodiscard]] auto body() const noexcept {
+      return std::span<std::uint8_t const>{this->body_.data(), this->body_size_};
     }
 
-    if (read_size < MINIMUM_PACKET_SIZE) {
-      return std::pair{t_end, false};
+    [[nodiscard]] auto buffers() const noexcept {
+      return std::array{boost::asio::buffer(this->header_), boost::asio::buffer(this->body_.data(), this->body_size_)};
     }
 
-    if (auto const slip_start = std::find_if(t_begin, t_end, is_slip_end); slip_start != t_end) {
-      bool const is_start = *boost::next(slip_start) == RESPONSE_DIRECTION;
-      if (not is_start and this->unpaired_start_) {
-        this->unpaired_start_ = false;
-        return std::pair{slip_start, true};
+    [[nodiscard]] std::size_t size() const noexcept { return this->header_.size() + this->body_size_; }
+  };
+
+  /**
+   * @brief This function encodes t_cmd into t_frame. Commands exposing header() and payload() have their payload
+   *        escaped straight from where it is stored, and its checksum computed in the same pass.
+   *
+   * @param t_frame Frame to encode into, previous content is discarded
+   * @param t_cmd   Command to encode
+   */
+  void encode_packet(Frame& t_frame, auto const& t_cmd) const {
+    auto& header = t_frame.header_;
+    auto& body   = t_frame.body_;
+    header.clear();
+
+    auto const insert_byte_to = [](std::vector<std::uint8_t>& t_packet) {
+      return [&t_packet](auto const t_chr) {
+        switch (auto const byte = static_cast<std::uint8_t>(t_chr); byte) {
+          case SLIP_END:
+            t_packet.push_back(SLIP_ESC);
+            t_packet.push_back(SLIP_ESC_END);
+            break;
+          case SLIP_ESC:
+            t_packet.push_back(SLIP_ESC);
+            t_packet.push_back(SLIP_ESC_ESC);
+            break;
+          default:
+            t_packet.push_back(byte);
+            break;
+        }
+      };
+    };
+
+    auto const insert_word = [&](auto const t_word) {
+      ranges::for_each(std::bit_cast<std::array<std::uint8_t, sizeof(t_word)>>(t_word), insert_byte_to(header));
+    };
+
+    header.insert(header.end(), {SLIP_END, REQUEST_DIRECTION, t_cmd.COMMAND_BYTE});
+    if constexpr (requires { t_cmd.header(); t_cmd.payload(); }) {
+      auto const command_header = t_cmd.header();
+      auto const payload        = t_cmd.payload();
+      if (auto const worst_case = 2 * payload.size() + 1; body.size() < worst_case) {
+        body.resize(worst_case);  // never shrunk, so that it isn't filled again for every packet
       }
 
-      this->unpaired_start_ = is_start;
-      if (auto const slip_end = std::find_if(boost::next(slip_start), t_end, is_slip_end);
-          slip_end != t_end and (slip_end - slip_start) >= MINIMUM_PACKET_SIZE and is_start) {
-        this->unpaired_start_ = false;
-        return std::pair{slip_end, true};  // skip last END
+      std::uint8_t check_sum  = ESP32_CHECKSUM_MAGIC;
+      auto const* const first = reinterpret_cast<std::uint8_t const*>(payload.data());  // NOLINT
+      auto* const last        = slip::escape(first, first + payload.size(), body.data(), check_sum);
+      *last                   = SLIP_END;
+      t_frame.body_size_      = static_cast<std::size_t>(last - body.data()) + 1;
+
+      insert_word(static_cast<std::uint16_t>(command_header.size() + payload.size()));
+      insert_word(static_cast<std::uint32_t>(check_sum));
+      ranges::for_each(command_header, insert_byte_to(header));
+      t_frame.raw_size_ = FRAME_OVERHEAD + command_header.size() + payload.size();
+    } else {
+      auto const data_content       = t_cmd();
+      std::uint32_t const check_sum = [&]() {
+        if constexpr (requires { t_cmd.check_sum(); }) {
+          return t_cmd.check_sum();
+        }
+
+        return std::uint8_t{};
+      }();
+
+      insert_word(static_cast<std::uint16_t>(std::size(data_content)));
+      insert_word(check_sum);
+      ranges::for_each(data_content, insert_byte_to(header));
+
+      if (body.empty()) {
+        body.resize(1);
       }
+      body.front()       = SLIP_END;
+      t_frame.body_size_ = 1;
+      t_frame.raw_size_  = FRAME_OVERHEAD + std::size(data_content);
+    }
+  }
+
+  /**
+   * @brief This function encodes t_content into t_frame as is, without command header, e.g. acknowledgement of data
+   *        streamed by flasher stub
+   */
+  static void encode_frame(Frame& t_frame, std::span<std::uint8_t const> const t_content) {
+    t_frame.header_.assign({SLIP_END});
+    if (auto const worst_case = 2 * t_content.size() + 1; t_frame.body_.size() < worst_case) {
+      t_frame.body_.resize(worst_case);
     }
 
-    return std::pair{t_end, false};
+    std::uint8_t unused_check_sum{};
+    auto* const last = slip::escape(t_content.data(), t_content.data() + t_content.size(), t_frame.body_.data(),
+                                    unused_check_sum);
+    *last              = SLIP_END;
+    t_frame.body_size_ = static_cast<std::size_t>(last - t_frame.body_.data()) + 1;
+    t_frame.raw_size_  = t_content.size() + 2;
+  }
+
+  [[nodiscard]] auto generate_packet(auto&& t_cmd) const {
+    Frame frame;
+    this->encode_packet(frame, t_cmd);
+
+    auto packet = std::move(frame.header_);
+    auto const body = frame.body();
+    packet.insert(packet.end(), body.begin(), body.end());
+    return packet;
   }
 };
 
@@ -0,0 +1,244 @@
+#pragma once
+
+#include "esp_common/cpu_dispatch.hpp"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * SLIP escape and unescape kernels. The SIMD versions scan 16 (SSE2) or 32 (AVX2) bytes at a time for END/ESC, copy
+ * clean runs as a whole and only branch on the special bytes, scalar versions handle what is left and serve as
+ * reference. escape() and unescape() pick the widest kernel the running CPU supports.
+ */
+namespace esplink::slip {
+
+inline constexpr std::uint8_t END     = 0xC0;
+inline constexpr std::uint8_t ESC     = 0xDB;
+inline constexpr std::uint8_t ESC_END = 0xDC;
+inline constexpr std::uint8_t ESC_ESC = 0xDD;
+
+struct UnescapeResult {
+  std::uint8_t const* in_;  // where unescaping stopped, points to a dangling ESC if input ends with one
+  std::uint8_t* out_;       // past the last byte written
+};
+
+/**
+ * @brief This function escapes [t_first, t_last) into t_out, and XORs every input byte into t_check_sum
+ *
+ * @param t_out Must have room for 2 * (t_last - t_first) bytes
+ * @return Past the last byte written
+ */
+inline std::uint8_t* escape_scalar(std::uint8_t const* t_first, std::uint8_t const* t_last, std::uint8_t* t_out,
+                                   std::uint8_t& t_check_sum) noexcept {
+  for (; t_first != t_last; ++t_first) {
+    auto const byte = *t_first;
+    t_check_sum ^= byte;
+    if (byte == END or byte == ESC) {
+      *t_out++ = ESC;
+      *t_out++ = byte == END ? ESC_END : ESC_ESC;
+    } else {
+      *t_out++ = byte;
+    }
+  }
+
+  return t_out;
+}
+
+/**
+ * @brief This function reverts escape sequences in [t_first, t_last) into t_out. Of ESC followed by anything other
+ *        than ESC_END or ESC_ESC, the ESC is dropped and the byte after it is kept as is. Input is expected not to
+ *        contain END.
+ *
+ * @param t_out Must have room for t_last - t_first bytes
+ */
+inline UnescapeResult unescape_scalar(std::uint8_t const* t_first, std::uint8_t const* t_last,
+                                      std::uint8_t* t_out) noexcept {
+  while (t_first != t_last) {
+    if (*t_first != ESC) {
+      *t_out++ = *t_first++;
+      continue;
+    }
+
+    if (t_last - t_first < 2) {
+      break;
+    }
+
+    auto const escaped = t_first[1];
+    *t_out++           = escaped == ESC_END ? END : (escaped == ESC_ESC ? ESC : escaped);
+    t_first += 2;
+  }
+
+  return {t_first, t_out};
+}
+
+namespace detail {
+
+/**
+ * @brief This function escapes a chunk in which bytes to escape are marked by set bits of t_mask
+ */
+inline std::uint8_t* escape_marked(std::uint8_t const* t_in, std::size_t const t_size, std::uint32_t t_mask,
+                                   std::uint8_t* t_out) noexcept {
+  std::size_t pos = 0;
+  for (; t_mask != 0; t_mask &= t_mask - 1) {
+    auto const idx = static_cast<std::size_t>(std::countr_zero(t_mask));
+    t_out          = std::copy(t_in + pos, t_in + idx, t_out);
+    *t_out++       = ESC;
+    *t_out++       = t_in[idx] == END ? ESC_END : ESC_ESC;
+    pos            = idx + 1;
+  }
+
+  return std::copy(t_in + pos, t_in + t_size, t_out);
+}
+
+}  // namespace detail
+
+#if ESPLINK_X86_KERNEL
+
+// NOLINTBEGIN(cppcoreguidelines-pro-type-reinterpret-cast)
+__attribute__((target("sse2"))) inline std::uint8_t* escape_sse2(std::uint8_t const* t_first,
+                                                                 std::uint8_t const* t_last, std::uint8_t* t_out,
+                                                                 std::uint8_t& t_check_sum) noexcept {
+  constexpr std::ptrdiff_t STRIDE = sizeof(__m128i);
+  auto const end_v                = _mm_set1_epi8(static_cast<char>(END));
+  auto const esc_v                = _mm_set1_epi8(static_cast<char>(ESC));
+  auto check_sum_v                = _mm_setzero_si128();
+
+  for (; t_last - t_first >= STRIDE; t_first += STRIDE) {
+    auto const chunk = _mm_loadu_si128(reinterpret_cast<__m128i const*>(t_first));
+    check_sum_v      = _mm_xor_si128(check_sum_v, chunk);
+
+    auto const special = _mm_or_si128(_mm_cmpeq_epi8(chunk, end_v), _mm_cmpeq_epi8(chunk, esc_v));
+    if (auto const mask = static_cast<std::uint32_t>(_mm_movemask_epi8(special)); mask != 0) {
+      t_out = detail::escape_marked(t_first, STRIDE, mask, t_out);
+    } else {
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(t_out), chunk);
+      t_out += STRIDE;
+    }
+  }
+
+  std::array<std::uint8_t, STRIDE> lanes{};
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes.data()), check_sum_v);
+  for (auto const lane : lanes) {
+    t_check_sum ^= lane;
+  }
+
+  return escape_scalar(t_first, t_last, t_out, t_check_sum);
+}
+
+__attribute__((target("sse2"))) inline UnescapeResult unescape_sse2(std::uint8_t const* t_first,
+                                                                    std::uint8_t const* t_last,
+                                                                    std::uint8_t* t_out) noexcept {
+  constexpr std::ptrdiff_t STRIDE = sizeof(__m128i);
+  auto const esc_v                = _mm_set1_epi8(static_cast<char>(ESC));
+
+  while (t_last - t_first >= STRIDE) {
+    auto const chunk = _mm_loadu_si128(reinterpret_cast<__m128i const*>(t_first));
+    auto const mask  = static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, esc_v)));
+    if (mask == 0) {
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(t_out), chunk);
+      t_out += STRIDE;
+      t_first += STRIDE;
+      continue;
+    }
+
+    // copy up to the first ESC, unescape it, then scan again right after the escape sequence
+    auto const idx = std::countr_zero(mask);
+    t_out          = std::copy(t_first, t_first + idx, t_out);
+    t_first += idx;
+    if (t_last - t_first < 2) {
+      break;
+    }
+
+    auto const escaped = t_first[1];
+    *t_out++           = escaped == ESC_END ? END : (escaped == ESC_ESC ? ESC : escaped);
+    t_first += 2;
+  }
+
+  return unescape_scalar(t_first, t_last, t_out);
+}
+
+__attribute__((target("avx2"))) inline std::uint8_t* escape_avx2(std::uint8_t const* t_first,
+                                                                 std::uint8_t const* t_last, std::uint8_t* t_out,
+                                                                 std::uint8_t& t_check_sum) noexcept {
+  constexpr std::ptrdiff_t STRIDE = sizeof(__m256i);
+  auto const end_v                = _mm256_set1_epi8(static_cast<char>(END));
+  auto const esc_v                = _mm256_set1_epi8(static_cast<char>(ESC));
+  auto check_sum_v                = _mm256_setzero_si256();
+
+  for (; t_last - t_first >= STRIDE; t_first += STRIDE) {
+    auto const chunk = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(t_first));
+    check_sum_v      = _mm256_xor_si256(check_sum_v, chunk);
+
+    auto const special = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, end_v), _mm256_cmpeq_epi8(chunk, esc_v));
+    if (auto const mask = static_cast<std::uint32_t>(_mm256_movemask_epi8(special)); mask != 0) {
+      t_out = detail::escape_marked(t_first, STRIDE, mask, t_out);
+    } else {
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(t_out), chunk);
+      t_out += STRIDE;
+    }
+  }
+
+  std::array<std::uint8_t, STRIDE> lanes{};
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes.data()), check_sum_v);
+  for (auto const lane : lanes) {
+    t_check_sum ^= lane;
+  }
+
+  return escape_sse2(t_first, t_last, t_out, t_check_sum);
+}
+
+__attribute__((target("avx2"))) inline UnescapeResult unescape_avx2(std::uint8_t const* t_first,
+                                                                    std::uint8_t const* t_last,
+                                                                    std::uint8_t* t_out) noexcept {
+  constexpr std::ptrdiff_t STRIDE = sizeof(__m256i);
+  auto const esc_v                = _mm256_set1_epi8(static_cast<char>(ESC));
+
+  while (t_last - t_first >= STRIDE) {
+    auto const chunk = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(t_first));
+    auto const mask  = static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, esc_v)));
+    if (mask == 0) {
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(t_out), chunk);
+      t_out += STRIDE;
+      t_first += STRIDE;
+      continue;
+    }
+
+    auto const idx = std::countr_zero(mask);
+    t_out          = std::copy(t_first, t_first + idx, t_out);
+    t_first += idx;
+    if (t_last - t_first < 2) {
+      break;
+    }
+
+    auto const escaped = t_first[1];
+    *t_out++           = escaped == ESC_END ? END : (escaped == ESC_ESC ? ESC : escaped);
+    t_first += 2;
+  }
+
+  return unescape_sse2(t_first, t_last, t_out);
+}
+// NOLINTEND(cppcoreguidelines-pro-type-reinterpret-cast)
+
+#endif
+
+inline std::uint8_t* escape(std::uint8_t const* t_first, std::uint8_t const* t_last, std::uint8_t* t_out,
+                            std::uint8_t& t_check_sum) noexcept {
+#if ESPLINK_X86_KERNEL
+  return has_avx2() ? escape_avx2(t_first, t_last, t_out, t_check_sum)
+                    : escape_sse2(t_first, t_last, t_out, t_check_sum);
+#else
+  return escape_scalar(t_first, t_last, t_out, t_check_sum);
+#endif
+}
+
+inline UnescapeResult unescape(std::uint8_t const* t_first, std::uint8_t const* t_last, std::uint8_t* t_out) noexcept {
+#if ESPLINK_X86_KERNEL
+  return has_avx2() ? unescape_avx2(t_first, t_last, t_out) : unescape_sse2(t_first, t_last, t_out);
+#else
+  return unescape_scalar(t_first, t_last, t_out);
+#endif
+}
+
+}  // namespace esplink::slip
@@ -0,0 +1,819 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <fmt/format.h>
+#include <fmt/ranges.h>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <poll.h>
+#include <pty.h>
+#include <random>
+#include <span>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <termios.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+#include <zlib.h>
+
+#include "esp_common/checksum.hpp"
+#include "esp_common/chip.hpp"
+#include "esp_common/constants.hpp"
+#include "esp_common/md5.hpp"
+#include "esp_common/utility.hpp"
+#include "esp_serial/erase_plan.hpp"
+#include "esp_serial/slip.hpp"
+#include "esp_serial/slip_kernel.hpp"
+
+namespace esplink::sim {
+
+struct SimulatorOption {
+  std::size_t flash_size_ = 4 * 1024 * 1024;
+  std::uint32_t chip_id_  = to_underlying(ChipID::ESP32_C3_ECO3);
+
+  // time every byte spends on the wire in either direction, 0 means infinitely fast link. If non-zero, CHANGE_BAUDRATE
+  // rescales it to 10 bit times (8N1) at the new baudrate
+  std::chrono::nanoseconds byte_latency_{0};
+  std::chrono::microseconds turnaround_{0};  // time between the last byte of request and the first byte of response
+  std::chrono::microseconds erase_time_{0};  // time every sector erased takes, a 64 KiB block erased at once 4 times
+
+  // fault injection, every request rolls for each of them, in this order
+  double drop_rate_    = 0.0;  // request is ignored, as if it was corrupted on the wire
+  double error_rate_   = 0.0;  // request isn't acted on and is answered with FAILED_TO_ACT
+  double garbage_rate_ = 0.0;  // random bytes are sent ahead of response
+  std::uint32_t seed_  = 0;
+
+  // first request of the command is ignored, or acted on without being answered, to lose a chosen packet either way
+  std::optional<std::uint8_t> drop_request_once_{};
+  std::optional<std::uint8_t> drop_response_once_{};
+
+  // highest baudrate the chip keeps up with, 0 for any. Once CHANGE_BAUDRATE goes above it, every request is garbled
+  // on the wire, and ignored, until reset()
+  std::uint32_t max_baud_ = 0;
+
+  // answer as flasher stub already running: 2 status bytes, raw MD5 digest, READ_FLASH instead of FLASH_READ_SLOW
+  bool stub_ = false;
+
+  // data packets are written by sequence number instead of at the running write pointer, and READ_FLASH stream is
+  // abandoned by any frame other than an acknowledgement instead of taking it as one
+  bool strict_sequence_ = false;
+};
+
+/**
+ * @brief Timing of a request, as seen by simulator
+ */
+struct RequestRecord {
+  std::uint8_t command_ = 0;
+  std::size_t size_     = 0;                                      // size of data field
+  std::chrono::steady_clock::time_point received_{};              // when the request was read from pty
+  std::optional<std::chrono::steady_clock::time_point> replied_;  // when the response was written, unless dropped
+};
+
+struct SimulatorStats {
+  std::size_t requests_ = 0;
+  std::size_t dropped_  = 0;
+  std::size_t failed_   = 0;
+  std::size_t garbled_  = 0;
+};
+
+/**
+ * @brief Stand-in for the ROM loader of esp chip, sitting behind a pseudo terminal, so that Serial and the flashing
+ *        sequence can be exercised without hardware. Flash is an in-memory array, blank except for an image header at
+ *        offset 0, which esp-flash reads flash parameters from. Requests are served on a thread of its own.
+ *
+ *        Supported commands are SYNC, READ_REG, SPI_ATTACH, SPI_SET_PARAMS, FLASH_BEGIN/DATA/END,
+ *        FLASH_DEFL_BEGIN/DATA/END, FLASH_READ_SLOW, SPI_FLASH_MD5 and CHANGE_BAUDRATE, anything else is answered with
+ *        RCV_MSG_INVALID. Posing as flasher stub, it serves READ_FLASH instead of FLASH_READ_SLOW, streaming data as
+ *        long as the host keeps acknowledging, as well as ERASE_FLASH and ERASE_REGION. Code uploaded by
+ *        MEM_BEGIN/DATA is discarded, though MEM_DATA beyond the size given to MEM_BEGIN is refused, and so is MEM_END
+ *        before all of it arrives. MEM_END with an entry point greets with OHAI and poses as flasher stub from then on.
+ *
+ *        Like the real flash, programming can only clear bits, and FLASH_BEGIN erases whole sectors. Like the real
+ *        loader, data packets are written at the running write pointer whatever their sequence number, and any frame
+ *        received while streaming READ_FLASH is taken as an acknowledgement. With strict_sequence_, data packets are
+ *        written by sequence number instead, a repeated packet is acknowledged without being written again, one
+ *        arriving ahead of its predecessor is refused, and any frame but an acknowledgement abandons the stream.
+ *
+ *        CHANGE_BAUDRATE above max_baud_ leaves the chip out of step with the host, every request is then ignored
+ *        until reset() brings the chip back to ROM loader at INITIAL_BAUD.
+ */
+class RomSimulator {
+ public:
+  static constexpr std::uint32_t SECTOR_SIZE = 0x1000;
+
+  static constexpr std::uint32_t INITIAL_BAUD = 115200;
+
+  explicit RomSimulator(SimulatorOption const& t_option = {})
+    : option_{t_option},
+      flash_(t_option.flash_size_, ERASED),
+      random_{t_option.seed_},
+      initial_byte_latency_{t_option.byte_latency_} {
+    std::array<char, PATH_MAX> name{};
+    if (openpty(&this->master_fd_, &this->slave_fd_, name.data(), nullptr, nullptr) != 0) {
+      throw std::system_error(errno, std::generic_category(), "Failed to open pseudo terminal");
+    }
+    this->port_ = name.data();
+
+    // nothing may be echoed or translated before the other end opens the port and configures it
+    termios tty{};
+    tcgetattr(this->slave_fd_, &tty);
+    cfmakeraw(&tty);
+    tcsetattr(this->slave_fd_, TCSANOW, &tty);
+    fcntl(this->master_fd_, F_SETFL, fcntl(this->master_fd_, F_GETFL) | O_NONBLOCK);
+
+    constexpr std::array<std::uint8_t, 4> IMAGE_HEADER{ESP32_MAGIC_NUMBER, 0x03, 0x02, 0x20};
+    std::copy(IMAGE_HEADER.begin(), IMAGE_HEADER.end(), this->flash_.begin());
+
+    this->thread_ = std::thread([this] { this->run(); });
+  }
+
+  RomSimulator(RomSimulator const&)            = delete;
+  RomSimulator(RomSimulator&&)                 = delete;
+  RomSimulator& operator=(RomSimulator const&) = delete;
+  RomSimulator& operator=(RomSimulator&&)      = delete;
+
+  ~RomSimulator() {
+    this->stop_ = true;
+    this->thread_.join();
+    if (this->inflating_) {
+      inflateEnd(&this->inflate_);
+    }
+    close(this->master_fd_);
+    close(this->slave_fd_);
+  }
+
+  /**
+   * @brief Path of the pseudo terminal to open as serial port, e.g. /dev/pts/3
+   */
+  [[nodiscard]] std::string const& port() const noexcept { return this->port_; }
+
+  [[nodiscard]] std::vector<std::uint8_t> flash() const {
+    std::scoped_lock lock{this->mutex_};
+    return this->flash_;
+  }
+
+  /**
+   * @brief This function overwrites flash content at t_offset, as if it was programmed beforehand
+   */
+  void load_flash(std::uint32_t const t_offset, std::span<std::uint8_t const> const t_data) {
+    std::scoped_lock lock{this->mutex_};
+    if (t_offset + t_data.size() > this->flash_.size()) {
+      throw std::out_of_range(fmt::format("{} bytes at {:#x} exceed flash size", t_data.size(), t_offset));
+    }
+
+    std::copy(t_data.begin(), t_data.end(), this->flash_.begin() + t_offset);
+  }
+
+  /**
+   * @brief Every request served since construction or last clear_trace(), in order of arrival
+   */
+  [[nodiscard]] std::vector<RequestRecord> trace() const {
+    std::scoped_lock lock{this->mutex_};
+    return this->trace_;
+  }
+
+  void clear_trace() {
+    std::scoped_lock lock{this->mutex_};
+    this->trace_.clear();
+  }
+
+  /**
+   * @brief Baudrate the chip runs at, INITIAL_BAUD until CHANGE_BAUDRATE
+   */
+  [[nodiscard]] std::uint32_t baud_rate() const noexcept { return this->baud_; }
+
+  /**
+   * @brief This function stands in for resetting the chip by DTR and RTS, which a pseudo terminal doesn't carry. The
+   *        chip is back in ROM loader at INITIAL_BAUD from the next request on.
+   */
+  void reset() noexcept { this->reset_ = true; }
+
+  [[nodiscard]] SimulatorStats stats() const noexcept {
+    return {this->requests_.load(), this->dropped_.load(), this->failed_.load(), this->garbled_.load()};
+  }
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  static constexpr std::uint8_t ERASED             = 0xFF;
+  static constexpr std::size_t HEADER_SIZE         = 8;
+  static constexpr std::uint8_t REQUEST_DIRECTION  = 0x00;
+  static constexpr std::uint8_t RESPONSE_DIRECTION = 0x01;
+  static constexpr std::size_t ROM_STATUS_SIZE     = 4;
+  static constexpr std::size_t STUB_STATUS_SIZE    = 2;
+  static constexpr std::size_t ACK_SIZE            = sizeof(std::uint32_t);
+  static constexpr std::uint32_t CHIP_ID_REG       = 0x4000'1000;
+  static constexpr std::size_t DATA_HEADER_SIZE    = 16;
+  static constexpr std::size_t MAX_READ_SIZE       = 64;
+  static constexpr std::size_t SYNC_RESPONSES      = 8;
+  static constexpr std::size_t MAX_GARBAGE_SIZE    = 32;
+  static constexpr int POLL_INTERVAL_MS            = 20;
+
+  enum class Error : std::uint8_t {
+    None            = 0x0,
+    RcvMsgInvalid   = 0x5,
+    FailedToAct     = 0x6,
+    InvalidCrc      = 0x7,
+    FlashWriteErr   = 0x8,
+    FlashReadLenErr = 0xa,
+    DeflateErr      = 0xb,
+  };
+
+  enum class Command : std::uint8_t {
+    FlashBegin     = 0x02,
+    FlashData      = 0x03,
+    FlashEnd       = 0x04,
+    MemBegin       = 0x05,
+    MemEnd         = 0x06,
+    MemData        = 0x07,
+    Sync           = 0x08,
+    ReadReg        = 0x0A,
+    SpiSetParams   = 0x0B,
+    SpiAttach      = 0x0D,
+    FlashReadSlow  = 0x0E,
+    ChangeBaudrate = 0x0F,
+    FlashDeflBegin = 0x10,
+    FlashDeflData  = 0x11,
+    FlashDeflEnd   = 0x12,
+    SpiFlashMd5    = 0x13,
+    EraseFlash     = 0xD0,
+    EraseRegion    = 0xD1,
+    ReadFlash      = 0xD2,
+  };
+
+  // READ_FLASH being streamed, in bytes
+  struct ReadStream {
+    std::uint32_t address_;
+    std::uint32_t length_;
+    std::uint32_t packet_size_;
+    std::uint32_t max_inflight_;
+    std::uint32_t sent_  = 0;
+    std::uint32_t acked_ = 0;
+  };
+
+  struct Reply {
+    std::uint32_t value_ = 0;
+    std::vector<std::uint8_t> data_{};
+    Error error_ = Error::None;
+    std::chrono::microseconds busy_{0};  // time the chip would have spent acting on request
+  };
+
+  static std::uint32_t read_word(std::span<std::uint8_t const> const t_data, std::size_t const t_idx) noexcept {
+    auto const* const bytes = &t_data[t_idx * sizeof(std::uint32_t)];
+    return static_cast<std::uint32_t>(bytes[3] << 24U | bytes[2] << 16U | bytes[1] << 8U | bytes[0]);
+  }
+
+  static std::size_t wire_size(std::span<std::uint8_t const> const t_frame) noexcept {
+    auto const escaped = std::count_if(t_frame.begin(), t_frame.end(),
+                                       [](auto const t_byte) { return t_byte == slip::END or t_byte == slip::ESC; });
+    return t_frame.size() + static_cast<std::size_t>(escaped) + 2;
+  }
+
+  /**
+   * @brief This function tells whether t_command is the one t_once picks, only the first time it is asked
+   */
+  static bool take_once(std::optional<std::uint8_t>& t_once, std::uint8_t const t_command) {
+    if (t_once != t_command) {
+      return false;
+    }
+
+    t_once.reset();
+    return true;
+  }
+
+  bool roll(double const t_rate) {
+    return t_rate > 0.0 and std::uniform_real_distribution<double>{}(this->random_) < t_rate;
+  }
+
+  void run() {
+    std::array<std::uint8_t, 4096> buffer{};
+    while (not this->stop_) {
+      this->stream_flash();
+
+      pollfd pfd{this->master_fd_, POLLIN, 0};
+      if (poll(&pfd, 1, POLL_INTERVAL_MS) <= 0) {
+        continue;
+      }
+
+      auto const byte_read = read(this->master_fd_, buffer.data(), buffer.size());
+      if (byte_read <= 0) {
+        continue;
+      }
+
+      auto const arrival = Clock::now();
+      this->decoder_.feed(std::span{buffer.data(), static_cast<std::size_t>(byte_read)},
+                          [&](auto const t_frame) { this->serve(t_frame, arrival); });
+    }
+  }
+
+  void serve(std::span<std::uint8_t const> const t_frame, Clock::time_point const t_arrival) {
+    // bytes of consecutive requests queue up on the wire, the last one arrives no earlier than the host sent it
+    this->rx_clock_ = std::max(this->rx_clock_, t_arrival) + wire_size(t_frame) * this->option_.byte_latency_;
+
+    // the real stub reads acknowledgement into a word, whatever the frame is
+    auto const is_ack = this->option_.strict_sequence_ ? t_frame.size() == ACK_SIZE : t_frame.size() >= ACK_SIZE;
+    if (this->read_stream_.has_value() and is_ack) {
+      this->read_stream_->acked_ = std::max(this->read_stream_->acked_, read_word(t_frame, 0));
+      return;
+    }
+
+    if (t_frame.size() < HEADER_SIZE or t_frame[0] != REQUEST_DIRECTION) {
+      return;
+    }
+
+    this->read_stream_.reset();  // strict_sequence_ only, a stream no longer acknowledged is abandoned
+    ++this->requests_;
+    if (this->reset_.exchange(false)) {
+      this->restart();
+    }
+
+    auto const command   = t_frame[1];
+    auto const size      = static_cast<std::size_t>(t_frame[3] << 8U | t_frame[2]);
+    auto const check_sum = read_word(t_frame, 1);
+    auto const data      = t_frame.subspan(HEADER_SIZE);
+
+    RequestRecord record{.command_ = command, .size_ = size, .received_ = t_arrival, .replied_ = std::nullopt};
+    auto const add_record = [&] {
+      std::scoped_lock lock{this->mutex_};
+      this->trace_.push_back(record);
+    };
+
+    auto const out_of_step = this->option_.max_baud_ != 0 and this->baud_ > this->option_.max_baud_;
+    if (this->roll(this->option_.drop_rate_) or take_once(this->option_.drop_request_once_, command) or out_of_step) {
+      ++this->dropped_;
+      add_record();
+      return;
+    }
+
+    Reply reply;
+    if (this->roll(this->option_.error_rate_)) {
+      ++this->failed_;
+      reply.error_ = Error::FailedToAct;
+    } else if (data.size() < size) {
+      reply.error_ = Error::RcvMsgInvalid;
+    } else {
+      std::scoped_lock lock{this->mutex_};
+      reply = this->execute(static_cast<Command>(command), data.first(size), check_sum);
+    }
+    this->rx_clock_ += reply.busy_;
+    if (take_once(this->option_.drop_response_once_, command)) {
+      ++this->dropped_;
+      add_record();
+      return;
+    }
+
+    auto const is_sync        = command == to_underlying(Command::Sync) and reply.error_ == Error::None;
+    auto const response_count = is_sync ? SYNC_RESPONSES : 1;
+    for (std::size_t i = 0; i < response_count; ++i) {
+      this->respond(command, reply);
+    }
+
+    if (this->starting_stub_) {
+      constexpr std::string_view GREETING = "OHAI";
+      this->transmit(std::span{reinterpret_cast<std::uint8_t const*>(GREETING.data()), GREETING.size()});  // NOLINT
+      this->option_.stub_  = true;
+      this->starting_stub_ = false;
+    }
+
+    record.replied_ = Clock::now();
+    add_record();
+  }
+
+  Reply execute(Command const t_command, std::span<std::uint8_t const> const t_data, std::uint32_t const t_check_sum) {
+    auto const has_words = [&](std::size_t const t_count) { return t_data.size() >= t_count * sizeof(std::uint32_t); };
+
+    switch (t_command) {
+      case Command::Sync:
+      case Command::SpiAttach:
+      case Command::SpiSetParams:
+        return {};
+      case Command::MemBegin:
+        if (not has_words(4)) {
+          return {.error_ = Error::RcvMsgInvalid};
+        }
+        this->ram_size_    = read_word(t_data, 0);
+        this->ram_written_ = 0;
+        return {};
+      case Command::MemData:
+        if (not has_words(1)) {
+          return {.error_ = Error::RcvMsgInvalid};
+        }
+        // written at the running pointer like the real loader does, a packet arriving twice overflows the section
+        if (std::uint64_t{this->ram_written_} + read_word(t_data, 0) > this->ram_size_) {
+          return {.error_ = Error::FailedToAct};
+        }
+        this->ram_written_ += read_word(t_data, 0);
+        return {};
+      case Command::MemEnd:
+        if (not has_words(2)) {
+          return {.error_ = Error::RcvMsgInvalid};
+        }
+        if (this->ram_written_ != this->ram_size_) {
+          return {.error_ = Error::FailedToAct};
+        }
+        this->starting_stub_ = read_word(t_data, 0) == 0;  // execute flag is 0 if there is an entry point
+        return {};
+      case Command::ReadReg:
+        if (not has_words(1)) {
+          return {.error_ = Error::RcvMsgInvalid};
+        }
+        return {.value_ = read_word(t_data, 0) == CHIP_ID_REG ? this->option_.chip_id_ : 0};
+      case Command::ChangeBaudrate:
+        if (not has_words(2) or read_word(t_data, 0) == 0) {
+          return {.error_ = Error::RcvMsgInvalid};
+        }
+        this->pending_baud_ = read_word(t_data, 0);
+        return {};
+      case Command::FlashBegin:
+      case Command::FlashDeflBegin:
+        return this->begin(t_command == Command::FlashDeflBegin, t_data);
+      case Command::FlashData:
+      case Command::FlashDeflData:
+        return this->write(t_command == Command::FlashDeflData, t_data, t_check_sum);
+      case Command::FlashEnd:
+      case Command::FlashDeflEnd:
+        this->end_write();
+        return {};
+      case Command::FlashReadSlow:
+        return this->option_.stub_ ? Reply{.error_ = Error::RcvMsgInvalid} : this->read_flash(t_data);
+      case Command::SpiFlashMd5:
+        return this->flash_md5(t_data);
+      case Command::ReadFlash:
+        return this->option_.stub_ ? this->begin_stream(t_data) : Reply{.error_ = Error::RcvMsgInvalid};
+      case Command::EraseFlash:
+        return this->option_.stub_ ? this->erase(0, static_cast<std::uint32_t>(this->flash_.size()))
+                                   : Reply{.error_ = Error::RcvMsgInvalid};
+      case Command::EraseRegion:
+        if (not this->option_.stub_ or not has_words(2)) {
+          return {.error_ = Error::RcvMsgInvalid};
+        }
+        return this->erase(read_word(t_data, 0), read_word(t_data, 1));
+    }
+
+    return {.error_ = Error::RcvMsgInvalid};
+  }
+
+  Reply begin(bool const t_compressed, std::span<std::uint8_t const> const t_data) {
+    constexpr std::size_t BEGIN_WORDS = 4;
+    if (t_data.size() < BEGIN_WORDS * sizeof(std::uint32_t)) {
+      return {.error_ = Error::RcvMsgInvalid};
+    }
+
+    auto const erase_size = read_word(t_data, 0);
+    auto const block_size = read_word(t_data, 2);
+    auto const offset     = read_word(t_data, 3);
+    if (static_cast<std::size_t>(offset) + erase_size > this->flash_.size() or block_size == 0) {
+      return {.error_ = Error::FailedToAct};
+    }
+
+    auto const erase_begin = offset / SECTOR_SIZE * SECTOR_SIZE;
+    auto const erase_end   = std::min<std::size_t>(padded_size(offset + erase_size, SECTOR_SIZE), this->flash_.size());
+    auto reply             = this->erase(erase_begin, static_cast<std::uint32_t>(erase_end - erase_begin));
+
+    this->end_write();
+    this->write_offset_ = offset;
+    this->block_size_   = block_size;
+    this->next_seq_     = 0;
+    if (t_compressed) {
+      this->inflate_   = z_stream{};
+      this->inflating_ = inflateInit(&this->inflate_) == Z_OK;
+    }
+
+    return reply;
+  }
+
+  /**
+   * @brief This function erases t_size bytes at t_address, both multiple of sector size, busy for as long as sectors
+   *        and blocks it takes
+   */
+  Reply erase(std::uint32_t const t_address, std::uint32_t const t_size) {
+    constexpr std::int64_t BLOCK_ERASE_FACTOR = 4;
+    if (t_address % SECTOR_SIZE != 0 or t_size % SECTOR_SIZE != 0 or
+        static_cast<std::size_t>(t_address) + t_size > this->flash_.size()) {
+      return {.error_ = Error::FailedToAct};
+    }
+
+    auto const begin = this->flash_.begin() + t_address;
+    std::fill(begin, begin + t_size, ERASED);
+
+    FlashRange const range{t_address, t_size};
+    ErasePlan const plan{std::span{&range, 1}};
+    auto const sectors = std::int64_t{plan.sector_count()} + BLOCK_ERASE_FACTOR * plan.block_count();
+    return {.busy_ = sectors * this->option_.erase_time_};
+  }
+
+  Reply write(bool const t_compressed, std::span<std::uint8_t const> const t_data, std::uint32_t const t_check_sum) {
+    if (t_data.size() < DATA_HEADER_SIZE or read_word(t_data, 0) > t_data.size() - DATA_HEADER_SIZE or
+        t_compressed != this->inflating_ or this->block_size_ == 0) {
+      return {.error_ = Error::RcvMsgInvalid};
+    }
+
+    auto const payload  = t_data.subspan(DATA_HEADER_SIZE, read_word(t_data, 0));
+    auto const sequence = read_word(t_data, 1);
+    if (xor_checksum(payload) != t_check_sum) {
+      return {.error_ = Error::InvalidCrc};
+    }
+
+    if (this->option_.strict_sequence_ and sequence < this->next_seq_) {
+      return {};  // retransmission of a packet whose response was lost
+    }
+
+    if (this->option_.strict_sequence_ and sequence > this->next_seq_) {
+      return {.error_ = Error::FailedToAct};
+    }
+
+    if (t_compressed) {
+      if (not this->inflate_block(payload)) {
+        return {.error_ = Error::DeflateErr};
+      }
+    } else if (this->option_.strict_sequence_) {
+      auto const offset = static_cast<std::size_t>(this->write_offset_) + std::size_t{sequence} * this->block_size_;
+      if (not this->program(offset, payload)) {
+        return {.error_ = Error::FlashWriteErr};
+      }
+    } else {
+      if (not this->program(this->write_offset_, payload)) {
+        return {.error_ = Error::FlashWriteErr};
+      }
+      this->write_offset_ += static_cast<std::uint32_t>(payload.size());
+    }
+
+    ++this->next_seq_;
+    return {};
+  }
+
+  bool inflate_block(std::span<std::uint8_t const> const t_payload) {
+    std::array<std::uint8_t, 0x4000> out{};
+    this->inflate_.next_in  = const_cast<Bytef*>(t_payload.data());  // NOLINT(cppcoreguidelines-pro-type-const-cast)
+    this->inflate_.avail_in = static_cast<uInt>(t_payload.size());
+    do {
+      this->inflate_.next_out  = out.data();
+      this->inflate_.avail_out = static_cast<uInt>(out.size());
+      auto const ret           = inflate(&this->inflate_, Z_NO_FLUSH);
+      if (ret != Z_OK and ret != Z_STREAM_END and ret != Z_BUF_ERROR) {
+        return false;
+      }
+
+      auto const produced = out.size() - this->inflate_.avail_out;
+      if (not this->program(this->write_offset_, std::span{out.data(), produced})) {
+        return false;
+      }
+      this->write_offset_ += static_cast<std::uint32_t>(produced);
+    } while (this->inflate_.avail_out == 0);
+
+    return true;
+  }
+
+  bool program(std::size_t const t_offset, std::span<std::uint8_t const> const t_data) {
+    if (t_offset + t_data.size() > this->flash_.size()) {
+      return false;
+    }
+
+    // NOR flash, programming only clears bits
+    auto const dest = this->flash_.begin() + static_cast<std::ptrdiff_t>(t_offset);
+    std::transform(t_data.begin(), t_data.end(), dest, dest, std::bit_and{});
+    return true;
+  }
+
+  void end_write() {
+    if (this->inflating_) {
+      inflateEnd(&this->inflate_);
+      this->inflating_ = false;
+    }
+    this->block_size_ = 0;
+  }
+
+  Reply read_flash(std::span<std::uint8_t const> const t_data) const {
+    if (t_data.size() < 2 * sizeof(std::uint32_t)) {
+      return {.error_ = Error::RcvMsgInvalid};
+    }
+
+    auto const address = read_word(t_data, 0);
+    auto const size    = read_word(t_data, 1);
+    if (size > MAX_READ_SIZE) {
+      return {.error_ = Error::FlashReadLenErr};
+    }
+    if (static_cast<std::size_t>(address) + size > this->flash_.size()) {
+      return {.error_ = Error::FailedToAct};
+    }
+
+    auto const first = this->flash_.begin() + address;
+    return {.data_ = std::vector<std::uint8_t>(first, first + size)};
+  }
+
+  Reply flash_md5(std::span<std::uint8_t const> const t_data) const {
+    if (t_data.size() < 2 * sizeof(std::uint32_t)) {
+      return {.error_ = Error::RcvMsgInvalid};
+    }
+
+    auto const address = read_word(t_data, 0);
+    auto const size    = read_word(t_data, 1);
+    if (static_cast<std::size_t>(address) + size > this->flash_.size()) {
+      return {.error_ = Error::FailedToAct};
+    }
+
+    // ROM loader reports digest as hex string, stub as raw bytes
+    auto const* const first = reinterpret_cast<char const*>(this->flash_.data() + address);  // NOLINT
+    auto const digest       = MD5::compute(std::span{first, size});
+    if (this->option_.stub_) {
+      return {.data_ = std::vector<std::uint8_t>(digest.begin(), digest.end())};
+    }
+
+    auto const hex_digest = fmt::format("{:02x}", fmt::join(digest, ""));
+    return {.data_ = std::vector<std::uint8_t>(hex_digest.begin(), hex_digest.end())};
+  }
+
+  Reply begin_stream(std::span<std::uint8_t const> const t_data) {
+    constexpr std::size_t READ_FLASH_WORDS = 4;
+    if (t_data.size() < READ_FLASH_WORDS * sizeof(std::uint32_t)) {
+      return {.error_ = Error::RcvMsgInvalid};
+    }
+
+    ReadStream const stream{read_word(t_data, 0), read_word(t_data, 1), read_word(t_data, 2), read_word(t_data, 3)};
+    if (static_cast<std::size_t>(stream.address_) + stream.length_ > this->flash_.size() or
+        stream.packet_size_ == 0 or stream.max_inflight_ == 0) {
+      return {.error_ = Error::FailedToAct};
+    }
+
+    this->read_stream_ = stream;
+    return {};
+  }
+
+  /**
+   * @brief This function sends data of READ_FLASH being served while the host keeps up with acknowledgement, then the
+   *        digest once everything is acknowledged
+   */
+  void stream_flash() {
+    auto& stream        = this->read_stream_;
+    auto const can_send = [&] {
+      auto const in_flight = stream->sent_ - std::min(stream->acked_, stream->sent_);
+      auto const window    = std::uint64_t{stream->max_inflight_} * stream->packet_size_;
+      return stream->sent_ < stream->length_ and in_flight < window;
+    };
+
+    while (stream.has_value() and can_send()) {
+      auto const size = std::min(stream->packet_size_, stream->length_ - stream->sent_);
+      std::vector<std::uint8_t> packet;
+      {
+        std::scoped_lock lock{this->mutex_};
+        auto const first = this->flash_.begin() + stream->address_ + stream->sent_;
+        packet.assign(first, first + size);
+      }
+      stream->sent_ += size;
+      this->transmit(packet);
+    }
+
+    if (stream.has_value() and stream->acked_ >= stream->length_) {
+      std::vector<std::uint8_t> digest;
+      {
+        std::scoped_lock lock{this->mutex_};
+        auto const* const first = reinterpret_cast<char const*>(this->flash_.data() + stream->address_);  // NOLINT
+        auto const md5          = MD5::compute(std::span{first, stream->length_});
+        digest.assign(md5.begin(), md5.end());
+      }
+      stream.reset();
+      this->transmit(digest);
+    }
+  }
+
+  void respond(std::uint8_t const t_command, Reply const& t_reply) {
+    std::vector<std::uint8_t> packet{RESPONSE_DIRECTION, t_command};
+    auto const size = static_cast<std::uint16_t>(t_reply.data_.size() + this->status_size());
+    packet.insert(packet.end(), {static_cast<std::uint8_t>(size), static_cast<std::uint8_t>(size >> 8U)});
+    for (auto const byte : word_to_byte_array(t_reply.value_)) {
+      packet.push_back(static_cast<std::uint8_t>(byte));
+    }
+    packet.insert(packet.end(), t_reply.data_.begin(), t_reply.data_.end());
+    packet.insert(packet.end(), {t_reply.error_ != Error::None, to_underlying(t_reply.error_)});
+    packet.resize(packet.size() + this->status_size() - 2);
+    this->transmit(packet);
+
+    // ROM loader answers CHANGE_BAUDRATE at the old baudrate, and switches right after
+    if (this->pending_baud_.has_value()) {
+      constexpr std::chrono::nanoseconds BYTE_TIME_AT_ONE_BAUD = std::chrono::seconds{10};
+      if (this->option_.byte_latency_.count() != 0) {
+        this->option_.byte_latency_ = BYTE_TIME_AT_ONE_BAUD / *this->pending_baud_;
+      }
+      this->baud_ = *std::exchange(this->pending_baud_, std::nullopt);
+    }
+  }
+
+  /**
+   * @brief This function brings the chip back to ROM loader at INITIAL_BAUD, as reset does, flash is kept
+   */
+  void restart() {
+    this->end_write();
+    this->option_.stub_         = false;
+    this->option_.byte_latency_ = this->initial_byte_latency_;
+    this->baud_                 = INITIAL_BAUD;
+    this->pending_baud_.reset();
+    this->ram_size_    = 0;
+    this->ram_written_ = 0;
+  }
+
+  [[nodiscard]] std::size_t status_size() const noexcept {
+    return this->option_.stub_ ? STUB_STATUS_SIZE : ROM_STATUS_SIZE;
+  }
+
+  /**
+   * @brief This function sends a frame holding t_packet once the wire is free, possibly preceded by garbage
+   */
+  void transmit(std::span<std::uint8_t const> const t_packet) {
+    std::vector<std::uint8_t> encoded;
+    if (this->roll(this->option_.garbage_rate_)) {
+      ++this->garbled_;
+      std::uniform_int_distribution<int> byte_dist{0, UINT8_MAX};
+      encoded.resize(std::uniform_int_distribution<std::size_t>{1, MAX_GARBAGE_SIZE}(this->random_));
+      std::generate(encoded.begin(), encoded.end(),
+                    [&] { return static_cast<std::uint8_t>(byte_dist(this->random_)); });
+    }
+
+    auto const garbage_size = encoded.size();
+    encoded.resize(garbage_size + 2 * t_packet.size() + 2);
+    encoded[garbage_size] = slip::END;
+    std::uint8_t unused_check_sum{};
+    auto* last = slip::escape(t_packet.data(), t_packet.data() + t_packet.size(), &encoded[garbage_size + 1],
+                              unused_check_sum);
+    *last++    = slip::END;
+    encoded.resize(static_cast<std::size_t>(last - encoded.data()));
+
+    // response follows the request after turnaround, and queues behind responses still on the wire
+    auto const done = std::max(this->rx_clock_ + this->option_.turnaround_, this->tx_clock_) +
+                      encoded.size() * this->option_.byte_latency_;
+    std::this_thread::sleep_until(done);
+    this->tx_clock_ = done;
+    this->send(encoded);
+  }
+
+  void send(std::span<std::uint8_t const> t_bytes) const {
+    while (not t_bytes.empty() and not this->stop_) {
+      auto const written = ::write(this->master_fd_, t_bytes.data(), t_bytes.size());
+      if (written > 0) {
+        t_bytes = t_bytes.subspan(static_cast<std::size_t>(written));
+        continue;
+      }
+
+      if (written < 0 and errno != EAGAIN and errno != EINTR) {
+        spdlog::warn("Simulator failed to write to {}: {}", this->port_, std::strerror(errno));
+        return;
+      }
+
+      pollfd pfd{this->master_fd_, POLLOUT, 0};
+      poll(&pfd, 1, POLL_INTERVAL_MS);
+    }
+  }
+
+  SimulatorOption option_;
+  std::vector<std::uint8_t> flash_;
+  mutable std::mutex mutex_;  // flash_ and trace_ are read by the owner while requests are served
+
+  int master_fd_ = -1;
+  int slave_fd_  = -1;  // kept open, so that the other end closing the port doesn't hang up the master
+  std::string port_;
+
+  std::mt19937 random_;
+  ESPSLIP::Decoder decoder_{};
+  Clock::time_point rx_clock_{};  // when the last byte of the latest request is on the device side of the wire
+  Clock::time_point tx_clock_{};  // when the last byte of the latest response is on the host side of the wire
+  std::chrono::nanoseconds initial_byte_latency_;
+  std::optional<std::uint32_t> pending_baud_;
+  std::optional<ReadStream> read_stream_;
+  bool starting_stub_ = false;
+
+  // state of the ongoing MEM_BEGIN, bytes announced and bytes received
+  std::uint32_t ram_size_    = 0;
+  std::uint32_t ram_written_ = 0;
+
+  // state of the ongoing FLASH_BEGIN or FLASH_DEFL_BEGIN, block_size_ is 0 if there is none
+  std::uint32_t write_offset_ = 0;
+  std::uint32_t block_size_   = 0;
+  std::uint32_t next_seq_     = 0;
+  z_stream inflate_{};
+  bool inflating_ = false;
+
+  std::atomic<bool> stop_{false};
+  std::atomic<bool> reset_{false};
+  std::atomic<std::uint32_t> baud_{INITIAL_BAUD};
+  std::atomic<std::size_t> requests_{0};
+  std::atomic<std::size_t> dropped_{0};
+  std::atomic<std::size_t> failed_{0};
+  std::atomic<std::size_t> garbled_{0};
+  std::vector<RequestRecord> trace_;
+  std::thread thread_;
+};
+
+}  // namespace esplink::sim
@@ -1,26 +1,35 @@
+#include "esp_common/checksum.hpp"
 #include "esp_common/constants.hpp"
+#include "esp_common/mapped_file.hpp"
 #include "esp_common/utility.hpp"
 #include "esp_mkbin/app_format.hpp"
 #include "esp_mkbin/elf_reader.hpp"
+#include "esp_mkbin/segment_layout.hpp"
 #include <algorithm>
 #include <boost/program_options.hpp>
+#include <cerrno>
+#include <climits>
+#include <fcntl.h>
 #include <filesystem>
 #include <fmt/ranges.h>
-#include <fstream>
 #include <iostream>
-#include <numeric>
-#include <range/v3/algorithm/find_if.hpp>
-#include <range/v3/algorithm/sort.hpp>
-#include <range/v3/view/reverse.hpp>
+#include <range/v3/algorithm/for_each.hpp>
 #include <spdlog/spdlog.h>
 #include <stdexcept>
+#include <sys/uio.h>
+#include <system_error>
+#include <unistd.h>
 
 namespace bpo = boost::program_options;
 
 namespace {
 
-void print_elf_info(esplink::Identity const& t_ident, auto const& t_info) {
+using ELF = esplink::ELFView<esplink::Format::x86>;
+
+void print_elf_info(ELF const& t_elf) {
   spdlog::set_pattern("%v");
+  auto const& ident       = t_elf.identity();
+  auto const& file_header = t_elf.file_header();
   spdlog::debug(
     "ELF Header:\n"
     "Class:                             {}\n"
@@ -29,29 +38,30 @@ void print_elf_info(esplink::Identity const& t_ident, auto const& t_info) {
     "Entry point address:               {:#x}\n"
     "Start of program headers:          {} (bytes in file)\n"
     "Section header string table index: {}\n",
-    t_ident.get_class_str(), t_ident.get_endianess(), t_ident.get_os_abi_str(), t_info.file_header_.entry_,
-    t_info.file_header_.phoff_, t_info.file_header_.shstrndx_);
+    ident.get_class_str(), ident.get_endianess(), ident.get_os_abi_str(), file_header.entry_, file_header.phoff_,
+    file_header.shstrndx_);
 
-  auto const& section_header = t_info.section_headers_;
-  auto const length_pred = [](auto const& t_lhs, auto const& t_rhs) { return t_lhs.first.size() < t_rhs.first.size(); };
-  auto const max_length  = *std::max_element(section_header.begin(), section_header.end(), length_pred);
+  auto const& sections   = t_elf.sections();
+  auto const length_pred = [](auto const& t_lhs, auto const& t_rhs) { return t_lhs.name_.size() < t_rhs.name_.size(); };
+  auto const longest     = std::max_element(sections.begin(), sections.end(), length_pred);
+  auto const max_length  = longest != sections.end() ? longest->name_.size() : 0;
   spdlog::debug(
     "Section Headers:\n"
     " [Nr] {: <{length}} {: <15} {: <8} {: <8} {: <8} ES Flg Lk Inf Al",
-    "Name", "Type", "Addr", "Off", "Size", fmt::arg("length", max_length.first.size()));
-  ranges::for_each(section_header, [i = 0U, &max_length](auto const& t_sh) mutable {
-    auto const& [name, section] = t_sh;
+    "Name", "Type", "Addr", "Off", "Size", fmt::arg("length", max_length));
+  ranges::for_each(sections, [i = 0U, &max_length](auto const& t_sh) mutable {
+    auto const& [name, section, data] = t_sh;
     spdlog::debug(" [{:>2}] {:<{length}} {:<15} {:08x} {:08x} {:08x} {:02x} {:>3} {:>2} {:>3} {:>2}", ++i, name,
                   section.get_type_str(), section.addr_, section.offset_, section.size_, section.entsize_,
                   section.get_flag_str(), section.link_, section.info_, section.addralign_,
-                  fmt::arg("length", max_length.first.size()));
+                  fmt::arg("length", max_length));
   });
 
   spdlog::debug(
     "\nProgram Headers:\n"
     " {: <8} {: <8} {: <10} {: <10} {: <8} {: <8} {} Align",
     "Type", "Offset", "VirtAddr", "PhysAddr", "FileSiz", "MemSiz", "Flg");
-  ranges::for_each(t_info.program_headers_, [](auto const& t_ph) {
+  ranges::for_each(t_elf.program_headers(), [](auto const& t_ph) {
     spdlog::debug(" {: <8} {:#08x} {:#08x} {:#08x} {:#07x}  {:#07x}  {:<3} {:#04x}", t_ph.get_type_str(), t_ph.offset_,
                   t_ph.vaddr_, t_ph.paddr_, t_ph.filesz_, t_ph.memsz_, t_ph.get_flags_str(), t_ph.get_align());
   });
@@ -60,79 +70,117 @@ void print_elf_info(esplink::Identity const& t_ident, auto const& t_info) {
   spdlog::set_pattern("%+");
 }
 
+/**
+ * @brief This function writes every one of t_buffers to t_fd in order, as few writev as the kernel allows
+ *
+ * @throw std::system_error if writing fails
+ */
+void write_all(int const t_fd, std::vector<iovec> t_buffers) {
+  auto iter = t_buffers.begin();
+  while (iter != t_buffers.end()) {
+    auto const count   = static_cast<int>(std::min<std::ptrdiff_t>(t_buffers.end() - iter, IOV_MAX));
+    auto const written = ::writev(t_fd, &*iter, count);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::system_error(errno, std::generic_category(), "Failed to write image");
+    }
+
+    // kernel may write less than asked, the rest is written by the next writev
+    for (auto left = static_cast<std::size_t>(written); left != 0;) {
+      auto const step = std::min(left, iter->iov_len);
+      iter->iov_base  = static_cast<char*>(iter->iov_base) + step;
+      iter->iov_len -= step;
+      left -= step;
+      if (iter->iov_len == 0) {
+        ++iter;
+      }
+    }
+    while (iter != t_buffers.end() and iter->iov_len == 0) {
+      ++iter;
+    }
+  }
+}
+
 }  // namespace
 
+/**
+ * @brief This function makes esp image of t_file. Elf file is mapped, layout of image is built up front, with checksum
+ *        computed over section data as they are laid out, then the image is written by writev, section data straight
+ *        from the mapping
+ */
 void mk_bin_from_elf(std::string_view t_file, std::string_view t_output_name,
                      esplink::ImageHeaderChipID const t_chip_id) {
-  std::fstream file_handle{t_file.data(), std::ios::in | std::ios::binary};
   if (not std::filesystem::is_regular_file(t_file) or std::filesystem::path(t_file).extension() != ".elf") {
     throw std::invalid_argument("Invalid --file option");
   }
 
-  esplink::ELFFile elf{file_handle};
-  auto const& ident   = elf.identity_;
-  auto const x86_info = std::get<0>(elf.content_);
-
+  esplink::MappedFile const file{t_file};
+  ELF const elf{file.data()};
   if (spdlog::get_level() == spdlog::level::debug) {
-    ::print_elf_info(ident, x86_info);
+    ::print_elf_info(elf);
   }
 
-  auto const section_headers = [&]() {
-    auto const& path_str = std::filesystem::path(t_file).filename().string();
-    auto loadable_count  = x86_info.get_loadable_count();
-    if (loadable_count <= esplink::ESP32_IMAGE_MAX_SEGMENT) {
-      spdlog::info("Find {} loadable segments in {}, less equal than ESP32_IMAGE_MAX_SEGMENT, skip merge",
-                   loadable_count, path_str);
-      [[likely]] return x86_info.get_loadable_sections();
-    }
-
-    spdlog::info("Find {} loadable segments in {}, greater than ESP32_IMAGE_MAX_SEGMENT, merging adjacent segment",
-                 loadable_count, path_str);
+  auto const segments = esplink::lay_out_segments(elf, std::filesystem::path(t_file).filename().string());
 
-    if (auto merged_section = x86_info.merge_adjacent_loadable();
-        merged_section.size() <= esplink::ESP32_IMAGE_MAX_SEGMENT) {
-      return merged_section;
-    }
+  using SegmentHeaderBytes = std::array<char, sizeof(esplink::ImageSegmentHeader)>;
+  constexpr std::array<char, 16> ZEROS{};  // longest padding needed, of segment to word, or of image to 16 bytes
 
-    throw std::runtime_error("Invalid section count even after merged.");
-  }();
-
-  std::fstream output_file_handle(t_output_name.data(), std::ios::out | std::ios::binary);
-  auto const img_header = esplink::ImageHeader{
+  auto const img_header = std::bit_cast<std::array<char, sizeof(esplink::ImageHeader)>>(esplink::ImageHeader{
     .magic_number_  = esplink::ESP32_MAGIC_NUMBER,
-    .segment_num_   = static_cast<std::uint8_t>(section_headers.size()),
-    .entry_address_ = x86_info.file_header_.entry_,
+    .segment_num_   = static_cast<std::uint8_t>(segments.size()),
+    .entry_address_ = elf.file_header().entry_,
     .chip_id_       = esplink::to_underlying(t_chip_id),
-  };
+  });
 
-  std::uint8_t check_sum           = esplink::ESP32_CHECKSUM_MAGIC;
-  auto const write_loadable_to_bin = [&file_handle, &output_file_handle, &check_sum](auto const& t_sh) {
-    // spdlog::debug("writing: {:x}, size: {:x}", t_sh.addr_, t_sh.size_);
-    auto const& [name, section] = t_sh;
-    auto const padded_length    = esplink::padded_size(section.size_, sizeof(std::uint32_t));
-    auto const segment_header   = esplink::ImageSegmentHeader{section.addr_, padded_length};
-    auto const byte_stream      = std::bit_cast<std::array<char, sizeof(esplink::ImageSegmentHeader)>>(segment_header);
-
-    output_file_handle.write(byte_stream.data(), sizeof(esplink::ImageSegmentHeader));
-    std::vector<std::uint8_t> buffer{};  //  temporary buffer for checksum calculation (lazy implementation)
-    buffer.reserve(section.size_);
-    std::copy_n(std::istreambuf_iterator<char>(file_handle.seekg(section.offset_)), section.size_,
-                std::back_inserter(buffer));
-    std::copy_n(buffer.begin(), section.size_, std::ostreambuf_iterator<char>(output_file_handle));
-    check_sum = std::accumulate(buffer.begin(), buffer.end(), check_sum, std::bit_xor{});
-    std::fill_n(std::ostreambuf_iterator<char>(output_file_handle), padded_length - section.size_, '\0');
+  // buffers written must stay where they are until writev, therefore segment headers are reserved up front
+  std::vector<SegmentHeaderBytes> segment_headers;
+  segment_headers.reserve(segments.size());
+  std::vector<iovec> buffers;
+  auto const add_buffer = [&buffers](void const* t_data, std::size_t const t_size) {
+    if (t_size != 0) {
+      buffers.push_back({const_cast<void*>(t_data), t_size});  // NOLINT(cppcoreguidelines-pro-type-const-cast)
+    }
   };
-  auto const img_header_byte_stream = std::bit_cast<std::array<char, sizeof(img_header)>>(img_header);
-  output_file_handle.write(img_header_byte_stream.data(), img_header_byte_stream.size());
 
-  ranges::for_each(section_headers, write_loadable_to_bin);
-  auto const curr_file_size        = static_cast<std::uint32_t>(output_file_handle.tellg());
-  auto const pad_halfword_filesize = esplink::padded_size(curr_file_size + 1U, 4 * sizeof(std::uint32_t));
-  auto const size_to_fill          = pad_halfword_filesize - curr_file_size - 1U;
+  std::uint8_t check_sum = esplink::ESP32_CHECKSUM_MAGIC;
+  auto image_size        = static_cast<std::uint32_t>(img_header.size());
+  add_buffer(img_header.data(), img_header.size());
+  for (auto const& segment : segments) {
+    auto const padded_length = esplink::padded_size(segment.size_, sizeof(std::uint32_t));
+    auto const& header       = segment_headers.emplace_back(
+      std::bit_cast<SegmentHeaderBytes>(esplink::ImageSegmentHeader{segment.address_, padded_length}));
+    add_buffer(header.data(), header.size());
+    for (auto const part : segment.parts_) {
+      add_buffer(part.data(), part.size());
+      check_sum = esplink::xor_checksum(part, check_sum);
+    }
+    add_buffer(ZEROS.data(), padded_length - segment.size_);
+    image_size += static_cast<std::uint32_t>(header.size()) + padded_length;
+  }
+
+  // checksum is the last byte of image, which is padded to 16 bytes
+  auto const pad_halfword_filesize = esplink::padded_size(image_size + 1U, 4 * sizeof(std::uint32_t));
+  auto const size_to_fill          = pad_halfword_filesize - image_size - 1U;
   spdlog::info("Section write completed, current file size: {}, file size after padding: {}, checksum: {:x}",
-               curr_file_size, pad_halfword_filesize, check_sum);
-  std::fill_n(std::ostreambuf_iterator<char>(output_file_handle), size_to_fill, 0);
-  output_file_handle.write(std::bit_cast<std::array<char, 1>>(check_sum).data(), 1);
+               image_size, pad_halfword_filesize, check_sum);
+  add_buffer(ZEROS.data(), size_to_fill);
+  add_buffer(&check_sum, 1);
+
+  int const output = ::open(std::string{t_output_name}.c_str(),  // NOLINT(cppcoreguidelines-pro-type-vararg)
+                            O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (output < 0) {
+    throw std::system_error(errno, std::generic_category(), fmt::format("Failed to open {}", t_output_name));
+  }
+
+  try {
+    write_all(output, std::move(buffers));
+  } catch (...) {
+    ::close(output);
+    throw;
+  }
+  ::close(output);
 }
 
 namespace esplink {
@@ -0,0 +1,108 @@
+#include "esp_common/logging.hpp"
+#include "esp_sim/rom_simulator.hpp"
+#include <boost/program_options.hpp>
+#include <csignal>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <spdlog/spdlog.h>
+
+namespace {
+
+std::vector<std::uint8_t> read_file(std::filesystem::path const& t_path) {
+  std::ifstream file(t_path, std::ios::binary);
+  if (not file) {
+    throw std::runtime_error(fmt::format("Failed to open {}", t_path.string()));
+  }
+
+  return {std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+}
+
+}  // namespace
+
+int main(int argc, const char** argv) {
+  using namespace boost::program_options;
+  options_description sim_options("Parameter for simulator");
+  sim_options.add_options()                                                                      //
+    ("flash-size", value<std::size_t>()->default_value(4 * 1024 * 1024), "Flash size in bytes")  //
+    ("flash", value<std::string>(), "File to load into flash at offset 0 before serving requests")  //
+    ("dump", value<std::string>(), "File to write flash content to on exit")                         //
+    ("byte-latency", value<std::int64_t>()->default_value(0),
+     "Time in nanoseconds every byte spends on the wire, e.g. 86806 for 115200 baud, 0 for an infinitely fast link")  //
+    ("turnaround", value<std::int64_t>()->default_value(0),
+     "Time in microseconds between the end of request and the start of response")  //
+    ("erase-time", value<std::int64_t>()->default_value(0),
+     "Time in microseconds to erase one 4 KiB sector, a 64 KiB block erased at once takes 4 times as long")  //
+    ("drop-rate", value<double>()->default_value(0.0), "Probability of a request being ignored")  //
+    ("error-rate", value<double>()->default_value(0.0),
+     "Probability of a request being answered with FAILED_TO_ACT without being acted on")  //
+    ("garbage-rate", value<double>()->default_value(0.0),
+     "Probability of random bytes being sent ahead of a response")  //
+    ("seed", value<std::uint32_t>()->default_value(0), "Seed of fault injection")  //
+    ("strict-sequence", "Write data packets by sequence number, refusing those out of order, instead of at the running "
+                        "write pointer like the real loader");
+
+  options_description visible_options("All options");
+  visible_options.add(sim_options)
+    .add_options()                               //
+    ("help", "Show this help message and exit")  //
+    ("verbose", "Show debug message during execution");
+
+  variables_map vm;
+  store(parse_command_line(argc, argv, visible_options), vm);
+  notify(vm);
+
+  if (vm.count("help") != 0) {
+    std::cout << visible_options << '\n';
+    return EXIT_SUCCESS;
+  }
+
+  // port is the only thing on stdout, so that scripts can pick it up
+  esplink::AsyncLogging const logging{"esp-sim", true};
+  if (vm.count("verbose") != 0) {
+    spdlog::set_level(spdlog::level::trace);
+  }
+
+  esplink::sim::SimulatorOption const option{
+    .flash_size_      = vm["flash-size"].as<std::size_t>(),
+    .byte_latency_    = std::chrono::nanoseconds{vm["byte-latency"].as<std::int64_t>()},
+    .turnaround_      = std::chrono::microseconds{vm["turnaround"].as<std::int64_t>()},
+    .erase_time_      = std::chrono::microseconds{vm["erase-time"].as<std::int64_t>()},
+    .drop_rate_       = vm["drop-rate"].as<double>(),
+    .error_rate_      = vm["error-rate"].as<double>(),
+    .garbage_rate_    = vm["garbage-rate"].as<double>(),
+    .seed_            = vm["seed"].as<std::uint32_t>(),
+    .strict_sequence_ = vm.count("strict-sequence") != 0,
+  };
+
+  // signals are blocked before simulator thread starts, so that only sigwait below receives them
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+  esplink::sim::RomSimulator simulator{option};
+  if (vm.count("flash") != 0) {
+    simulator.load_flash(0, read_file(vm["flash"].as<std::string>()));
+  }
+
+  std::cout << simulator.port() << std::endl;
+  spdlog::info("Simulating ROM loader on {}, press Ctrl-C to stop", simulator.port());
+
+  int signal = 0;
+  sigwait(&signals, &signal);
+
+  auto const stats = simulator.stats();
+  spdlog::info("Served {} requests, dropped {}, failed {}, garbled {}", stats.requests_, stats.dropped_, stats.failed_,
+               stats.garbled_);
+
+  if (vm.count("dump") != 0) {
+    auto const flash = simulator.flash();
+    std::ofstream dump(vm["dump"].as<std::string>(), std::ios::binary);
+    dump.write(reinterpret_cast<char const*>(flash.data()), static_cast<std::streamsize>(flash.size()));  // NOLINT
+  }
+
+  return EXIT_SUCCESS;
+}
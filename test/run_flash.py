@@ -0,0 +1,60 @@
+import argparse
+import random
+import signal
+import subprocess
+import sys
+import tempfile
+from pathlib import Path
+
+parser = argparse.ArgumentParser()
+parser.add_argument('--bin-dir', type=Path, required=True)
+
+FLASH_OFFSET = 0x10000
+IMAGE_SIZE = 0x12345
+# erased after image is written, touching ranges are erased as one
+ERASE_RANGES = [(0x11000, 0x1000), (0x12000, 0x2000), (0x20000, 0x1000)]
+
+
+def run(cmd: list):
+    try:
+        subprocess.run(cmd, check=True, timeout=120)
+    except subprocess.CalledProcessError as err:
+        print(err.output)
+        sys.exit(err.returncode)
+
+
+def main():
+    cl_args = parser.parse_args()
+    with tempfile.TemporaryDirectory() as work_dir:
+        work_dir = Path(work_dir)
+        dump = work_dir / 'flash.bin'
+        image = work_dir / 'image.bin'
+
+        # esp image, whose header is written as is once flash at offset 0 is erased
+        rand = random.Random(IMAGE_SIZE)
+        content = bytes([0xE9, 0x03, 0x02, 0x20]) + rand.randbytes(IMAGE_SIZE - 4)
+        image.write_bytes(content)
+
+        sim = subprocess.Popen([cl_args.bin_dir / 'esp-sim', '--dump', dump], stdout=subprocess.PIPE, text=True)
+        port = sim.stdout.readline().strip()
+        try:
+            esp_flash = cl_args.bin_dir / 'esp-flash'
+            run([esp_flash, 'erase-flash', '--port', port])
+            run([esp_flash, image, '--port', port, '--offset', hex(FLASH_OFFSET), '--verify'])
+            run([esp_flash, 'erase-region', '--port', port] + [f'{offset:#x}:{size:#x}' for offset, size in ERASE_RANGES])
+        finally:
+            sim.send_signal(signal.SIGINT)
+            sim.wait(timeout=10)
+
+        flash = dump.read_bytes()
+        if flash[:FLASH_OFFSET] != b'\xff' * FLASH_OFFSET:
+            sys.exit('flash before image is not erased')
+        expected = bytearray(content)
+        for offset, size in ERASE_RANGES:
+            expected[offset - FLASH_OFFSET:offset - FLASH_OFFSET + size] = b'\xff' * size
+        if flash[FLASH_OFFSET:FLASH_OFFSET + IMAGE_SIZE] != expected:
+            sys.exit('flash differs from image with erased ranges')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,200 @@
+#include "catch2/catch_test_macros.hpp"
+#include "esp_common/checksum.hpp"
+#include "esp_common/logging.hpp"
+#include "esp_common/mapped_file.hpp"
+#include "esp_common/md5.hpp"
+#include "esp_common/spsc_ring.hpp"
+#include <fmt/format.h>
+#include <filesystem>
+#include <fmt/ranges.h>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace {
+
+auto to_hex(esplink::MD5::Digest const& t_digest) { return fmt::format("{:02x}", fmt::join(t_digest, "")); }
+
+}  // namespace
+
+TEST_CASE("md5 matches RFC 1321 test suite", "[MD5]") {
+  using namespace std::string_view_literals;
+
+  CHECK(to_hex(esplink::MD5::compute(""sv)) == "d41d8cd98f00b204e9800998ecf8427e");
+  CHECK(to_hex(esplink::MD5::compute("abc"sv)) == "900150983cd24fb0d6963f7d28e17f72");
+  CHECK(to_hex(esplink::MD5::compute("message digest"sv)) == "f96b697d7cb7938d525a2f31aaf161d0");
+  CHECK(to_hex(esplink::MD5::compute("abcdefghijklmnopqrstuvwxyz"sv)) == "c3fcd3d76192e4007dfb496cca67e13b");
+  CHECK(to_hex(esplink::MD5::compute(
+          "12345678901234567890123456789012345678901234567890123456789012345678901234567890"sv)) ==
+        "57edf4a22be3c955ac49da2e2107b67a");
+}
+
+TEST_CASE("md5 gives same digest regardless of how data is split", "[MD5]") {
+  std::vector<char> data(10000);
+  for (std::size_t i = 0; i < data.size(); ++i) {
+    data[i] = static_cast<char>(i * 31 + 7);
+  }
+
+  auto const expected = esplink::MD5::compute(data);
+  for (std::size_t const chunk_size : {1U, 3U, 63U, 64U, 65U, 4096U}) {
+    esplink::MD5 md5;
+    for (std::size_t i = 0; i < data.size(); i += chunk_size) {
+      md5.update(std::span{data}.subspan(i, std::min(chunk_size, data.size() - i)));
+    }
+    CHECK(md5.finalize() == expected);
+  }
+}
+
+TEST_CASE("md5 of chunks computed in parallel matches digest of each chunk", "[MD5]") {
+  std::vector<char> data(100000);
+  for (std::size_t i = 0; i < data.size(); ++i) {
+    data[i] = static_cast<char>(i * 13 + 5);
+  }
+
+  std::vector<std::span<char const>> chunks;
+  for (std::size_t i = 0; i < data.size(); i += 7000) {
+    chunks.push_back(std::span{data}.subspan(i, std::min<std::size_t>(7000, data.size() - i)));
+  }
+
+  for (unsigned const threads : {1U, 3U, 64U}) {
+    auto const digests = esplink::MD5::compute_each(chunks, threads);
+    REQUIRE(digests.size() == chunks.size());
+    for (std::size_t i = 0; i < chunks.size(); ++i) {
+      CHECK(digests[i] == esplink::MD5::compute(chunks[i]));
+    }
+  }
+
+  CHECK(esplink::MD5::compute_each({}).empty());
+}
+
+TEST_CASE("xor checksum kernels match scalar checksum at every length and alignment", "[Checksum]") {
+  std::vector<std::uint8_t> data(300);
+  for (std::size_t i = 0; i < data.size(); ++i) {
+    data[i] = static_cast<std::uint8_t>(i * 37 + 11);
+  }
+
+  for (std::size_t offset = 0; offset < 8; ++offset) {
+    for (std::size_t size = 0; offset + size <= data.size(); ++size) {
+      INFO("offset " << offset << ", size " << size);
+      auto const* const first = data.data() + offset;
+      auto const* const last  = first + size;
+      auto const expected     = esplink::xor_checksum_scalar(first, last, esplink::ESP32_CHECKSUM_MAGIC);
+
+      CHECK(esplink::xor_checksum_word(first, last, esplink::ESP32_CHECKSUM_MAGIC) == expected);
+      CHECK(esplink::xor_checksum(std::span{first, size}) == expected);
+#if ESPLINK_X86_KERNEL
+      CHECK(esplink::xor_checksum_sse2(first, last, esplink::ESP32_CHECKSUM_MAGIC) == expected);
+      if (esplink::has_avx2()) {
+        CHECK(esplink::xor_checksum_avx2(first, last, esplink::ESP32_CHECKSUM_MAGIC) == expected);
+      }
+#endif
+    }
+  }
+
+  std::string_view const text = "esplink";
+  CHECK(esplink::xor_checksum(std::span{text}) == 0x89);
+  CHECK(esplink::xor_checksum(std::span<char const>{}) == esplink::ESP32_CHECKSUM_MAGIC);
+  CHECK(esplink::xor_checksum(std::span{text}, 0) == (0x89 ^ esplink::ESP32_CHECKSUM_MAGIC));
+}
+
+TEST_CASE("mapped file views file content, and copy on write never modifies the file", "[MappedFile]") {
+  auto const path = std::filesystem::temp_directory_path() / "esplink_mapped_file_test.bin";
+  std::string const content(10000, 'x');
+  std::ofstream{path, std::ios::binary} << content;
+
+  {
+    esplink::MappedFile mapped{path, esplink::MappedFile::Mode::CopyOnWrite};
+    REQUIRE(mapped.size() == content.size());
+    CHECK(std::string_view{mapped.data().data(), mapped.size()} == content);
+
+    mapped.writable()[0] = 'y';
+    CHECK(mapped.data()[0] == 'y');
+    CHECK(esplink::MappedFile{path}.data()[0] == 'x');
+  }
+
+  {
+    // mapped again, file replaced at the path is never viewed
+    esplink::MappedFile const mapped{path};
+    std::filesystem::remove(path);
+    std::ofstream{path, std::ios::binary} << "replaced";
+
+    auto again = mapped.map_again(esplink::MappedFile::Mode::CopyOnWrite);
+    REQUIRE(again.size() == content.size());
+    again.writable()[0] = 'y';
+    CHECK(std::string_view{again.data().data() + 1, again.size() - 1} == content.substr(1));
+    CHECK(mapped.data()[0] == 'x');
+  }
+
+  std::ofstream{path, std::ios::binary | std::ios::trunc};
+  CHECK(esplink::MappedFile{path}.data().empty());
+
+  std::filesystem::remove(path);
+  CHECK_THROWS_AS(esplink::MappedFile{path}, std::system_error);
+}
+
+TEST_CASE("spsc ring hands out contiguous regions across wrap around", "[SpscRing]") {
+  esplink::SpscRing<int> ring{6};
+  REQUIRE(ring.capacity() == 8);
+
+  std::vector<int> const data{1, 2, 3, 4, 5, 6};
+  CHECK(ring.write(data) == 6);
+  CHECK(ring.write(data) == 2);  // only 2 left
+  CHECK(ring.writable().empty());
+
+  ring.consume(5);
+  CHECK(ring.readable().size() == 3);
+  CHECK(ring.readable()[0] == 6);
+
+  CHECK(ring.write(data) == 5);
+  CHECK(ring.readable().size() == 3);  // up to the end of buffer, rest is at the front
+  ring.consume(3);
+  CHECK(ring.readable().size() == 5);
+  CHECK(ring.readable()[0] == 1);
+
+  ring.clear();
+  CHECK(ring.empty());
+}
+
+TEST_CASE("spsc ring passes every element from producer to consumer in order", "[SpscRing]") {
+  constexpr int ELEMENT_COUNT = 100000;
+  esplink::SpscRing<int> ring{64};
+
+  std::thread producer{[&ring]() {
+    for (int i = 0; i < ELEMENT_COUNT;) {
+      auto const space    = ring.writable();
+      std::size_t written = 0;
+      for (; written < space.size() and i < ELEMENT_COUNT; ++written) {
+        space[written] = i++;
+      }
+      ring.commit(written);
+    }
+  }};
+
+  int expected  = 0;
+  bool in_order = true;
+  while (expected < ELEMENT_COUNT) {
+    auto const chunk = ring.readable();
+    for (auto const value : chunk) {
+      in_order = in_order and value == expected++;
+    }
+    ring.consume(chunk.size());
+  }
+
+  producer.join();
+  CHECK(in_order);
+  CHECK(ring.empty());
+}
+
+TEST_CASE("hex dump is formatted 16 bytes per line, continuing from offset", "[Logging]") {
+  std::vector<std::uint8_t> bytes(18);
+  for (std::size_t i = 0; i < bytes.size(); ++i) {
+    bytes[i] = static_cast<std::uint8_t>(i * 0x11);
+  }
+
+  CHECK(fmt::format("{}", esplink::HexDump{bytes}) ==
+        "\n0000  00 11 22 33 44 55 66 77 88 99 AA BB CC DD EE FF\n0010  10 21");
+  CHECK(fmt::format("{}", esplink::HexDump{std::span{bytes}.first(2), 0x20}) == "\n0020  00 11");
+  CHECK(fmt::format("{}", esplink::HexDump{}).empty());
+}
@@ -1,7 +1,13 @@
 #include "catch2/catch_test_macros.hpp"
+#include "esp_common/mapped_file.hpp"
+#include "esp_common/checksum.hpp"
 #include "esp_mkbin/elf_reader.hpp"
+#include "esp_mkbin/segment_layout.hpp"
+#include <cstring>
 #include <filesystem>
 #include <fstream>
+#include <functional>
+#include <numeric>
 #include <range/v3/algorithm/find_if.hpp>
 
 struct ContainSectionName {
@@ -13,6 +19,98 @@ struct ContainSectionName {
   }
 };
 
+/**
+ * @brief This function makes an ELF32 file holding a loadable section of t_size bytes at t_addr for each of t_sections,
+ *        in that order in section header table, followed by the section name string table. Section data are laid out
+ *        in the file in order of address, one right after another, each byte telling which section it belongs to.
+ */
+std::vector<char> make_elf(std::vector<esplink::ProgramHeader<esplink::Format::x86>> const& t_memories,
+                           std::vector<std::pair<std::uint32_t, std::uint32_t>> const& t_sections) {
+  using FileHeader    = esplink::FileHeaderWithoutIdentity<esplink::Format::x86>;
+  using ProgramHeader = esplink::ProgramHeader<esplink::Format::x86>;
+  using SectionHeader = esplink::SectionHeader<esplink::Format::x86>;
+
+  constexpr std::uint32_t PROGBITS = 1;
+  constexpr std::uint32_t STRTAB   = 3;
+  constexpr std::uint32_t ALLOC    = 0b10;
+
+  auto by_address = t_sections;
+  std::sort(by_address.begin(), by_address.end());
+
+  auto const data_offset = static_cast<std::uint32_t>(esplink::X86_FILE_HEADER_SIZE +
+                                                      t_memories.size() * esplink::X86_PROGRAM_HEADER_SIZE);
+  std::vector<SectionHeader> headers(1);  // index 0 is the null section
+  for (auto const& [addr, size] : t_sections) {
+    auto offset = data_offset;
+    for (auto const& [other_addr, other_size] : by_address) {
+      offset += other_addr < addr ? other_size : 0;
+    }
+    headers.push_back({.name_      = 0,
+                       .type_      = PROGBITS,
+                       .flags_     = ALLOC,
+                       .addr_      = addr,
+                       .offset_    = offset,
+                       .size_      = size,
+                       .link_      = 0,
+                       .info_      = 0,
+                       .addralign_ = 1,
+                       .entsize_   = 0});
+  }
+
+  std::vector<char> content(data_offset);
+  for (auto const& [addr, size] : by_address) {
+    auto const index = std::find(t_sections.begin(), t_sections.end(), std::pair{addr, size}) - t_sections.begin();
+    content.insert(content.end(), size, static_cast<char>(index + 1));
+  }
+
+  using std::string_view_literals::operator""sv;
+  constexpr auto NAMES = "\0.shstrtab\0"sv;
+  headers.push_back({.name_      = 1,
+                     .type_      = STRTAB,
+                     .flags_     = 0,
+                     .addr_      = 0,
+                     .offset_    = static_cast<std::uint32_t>(content.size()),
+                     .size_      = static_cast<std::uint32_t>(NAMES.size()),
+                     .link_      = 0,
+                     .info_      = 0,
+                     .addralign_ = 1,
+                     .entsize_   = 0});
+  content.insert(content.end(), NAMES.begin(), NAMES.end());
+
+  auto const append = [&content](auto const& t_header) {
+    auto const bytes = std::bit_cast<std::array<char, sizeof(t_header)>>(t_header);
+    content.insert(content.end(), bytes.begin(), bytes.end());
+  };
+  auto const section_offset = static_cast<std::uint32_t>(content.size());
+  for (auto const& header : headers) {
+    append(header);
+  }
+
+  esplink::Identity identity{};
+  identity.magic_number_ = 0x464C457F;
+  identity.class_        = std::byte{1};
+  identity.endianness_   = std::byte{1};
+  identity.version_      = std::byte{1};
+  FileHeader const file_header{.type_      = 2,
+                               .machine_   = 0xF3,
+                               .version_   = 1,
+                               .entry_     = t_memories.front().vaddr_,
+                               .phoff_     = esplink::X86_FILE_HEADER_SIZE,
+                               .shoff_     = section_offset,
+                               .flags_     = 0,
+                               .ehsize_    = esplink::X86_FILE_HEADER_SIZE,
+                               .phentsize_ = esplink::X86_PROGRAM_HEADER_SIZE,
+                               .phnum_     = static_cast<std::uint16_t>(t_memories.size()),
+                               .shentsize_ = esplink::X86_SECTION_HEADER_SIZE,
+                               .shnum_     = static_cast<std::uint16_t>(headers.size()),
+                               .shstrndx_  = static_cast<std::uint16_t>(headers.size() - 1)};
+  std::memcpy(content.data(), &identity, sizeof(identity));
+  std::memcpy(content.data() + sizeof(identity), &file_header, sizeof(file_header));
+  std::memcpy(content.data() + esplink::X86_FILE_HEADER_SIZE, t_memories.data(),
+              t_memories.size() * sizeof(ProgramHeader));
+  return content;
+}
+
 TEST_CASE("elf parser can parse section correctly", "[Parse Elf]") {
   using std::string_literals::operator""s;
 
@@ -70,3 +168,99 @@ TEST_CASE("elf parser can parse section correctly", "[Parse Elf]") {
     check_section(merged, ".init_array", 0x40380270U, 0x2270U, 0x4U + 0x10U);
   }
 }
+
+TEST_CASE("elf view parses mapped file in place", "[Parse Elf]") {
+  esplink::MappedFile const file{"main.elf"};
+  esplink::ELFView<esplink::Format::x86> const elf{file.data()};
+
+  // same file, same content as ELFFile above
+  CHECK(elf.file_header().entry_ == 0x40380080U);
+  CHECK(elf.program_headers().size() == 3);
+  REQUIRE(elf.sections().size() == 23);
+
+  SECTION("names and data view the file") {
+    auto const* const text = elf.find(".text");
+    REQUIRE(text != nullptr);
+    CHECK(text->header_.addr_ == 0x40380080U);
+    CHECK(text->data_.data() == file.data().data() + 0x2080U);
+    CHECK(text->data_.size() == 0x1ECU);
+    CHECK(text->name_.data() >= file.data().data());
+    CHECK(text->name_.data() < file.data().data() + file.size());
+    CHECK(elf.find(".no_such_section") == nullptr);
+  }
+
+  SECTION("loadable sections") {
+    auto const loadable = elf.loadable_sections();
+    REQUIRE(loadable.size() == 5);
+    CHECK(loadable.front().name_ == ".vector_table");
+
+    auto const& memory = elf.memory_type(loadable.front().header_);
+    CHECK(memory.vaddr_ <= 0x40380000U);
+    CHECK(0x40380000U < memory.vaddr_ + memory.memsz_);
+  }
+
+  SECTION("truncated and foreign files are rejected") {
+    CHECK_THROWS_AS(esplink::ELFView<esplink::Format::x86>(file.data().first(0x1000)), std::out_of_range);
+    CHECK_THROWS_AS(esplink::ELFView<esplink::Format::x86_64>(file.data()), std::invalid_argument);
+    CHECK_THROWS_AS(esplink::ELFView<esplink::Format::x86>(file.data().subspan(1)), std::invalid_argument);
+  }
+}
+
+TEST_CASE("more sections than image holds are merged as ELFFile always has", "[Parse Elf]") {
+  constexpr auto LOAD  = 1U;
+  auto const memory_at = [](std::uint32_t const t_addr, std::uint32_t const t_size) {
+    return esplink::ProgramHeader<esplink::Format::x86>{LOAD, 0, t_addr, t_addr, 0, t_size, 0};
+  };
+  // DROM ends where DRAM begins, sections across the boundary are adjacent in memory but never merged
+  std::vector const memories{memory_at(0x3FF00000U, 0x100U), memory_at(0x3FF00100U, 0x1000U),
+                             memory_at(0x40380000U, 0x10000U)};
+
+  // header table order has nothing to do with address
+  std::vector<std::pair<std::uint32_t, std::uint32_t>> const sections{
+    {0x40380274U, 0x10U}, {0x3FF00000U, 0x40U}, {0x40380000U, 0x80U}, {0x3FF00210U, 0x10U}, {0x40380410U, 0x4U},
+    {0x3FF000C0U, 0x40U}, {0x40380080U, 0x1ECU}, {0x40380300U, 0x8U}, {0x3FF00100U, 0x20U}, {0x40380270U, 0x4U},
+    {0x40380414U, 0x4U}, {0x3FF00120U, 0x24U}, {0x4038026CU, 0x4U}, {0x40380308U, 0x3U}, {0x3FF00200U, 0x10U},
+    {0x40380400U, 0xCU}, {0x3FF00040U, 0x40U}, {0x3FF00144U, 0x1CU},
+  };
+  REQUIRE(sections.size() > esplink::ESP32_IMAGE_MAX_SEGMENT);
+
+  auto const content = make_elf(memories, sections);
+  auto const path    = std::filesystem::temp_directory_path() / "esp_link_many_sections.elf";
+  std::ofstream{path, std::ios::binary}.write(content.data(), static_cast<std::streamsize>(content.size()));
+  std::fstream file{path, std::ios::in | std::ios::binary};
+  esplink::ELFFile const baseline_elf{file};
+  auto const baseline = std::get<0>(baseline_elf.content_).merge_adjacent_loadable();
+  std::filesystem::remove(path);
+
+  esplink::ELFView<esplink::Format::x86> const elf{content};
+  auto const segments = esplink::lay_out_segments(elf, "many_sections.elf");
+
+  std::vector<std::uint32_t> addresses;
+  std::transform(segments.begin(), segments.end(), std::back_inserter(addresses),
+                 [](auto const& t_segment) { return t_segment.address_; });
+  CHECK(addresses == std::vector<std::uint32_t>{0x40380410U, 0x40380400U, 0x40380300U, 0x40380000U, 0x3FF00200U,
+                                                0x3FF00100U, 0x3FF000C0U, 0x3FF00000U});
+
+  REQUIRE(segments.size() == baseline.size());
+  auto check_sum          = esplink::ESP32_CHECKSUM_MAGIC;
+  auto baseline_check_sum = esplink::ESP32_CHECKSUM_MAGIC;
+  for (std::size_t i = 0; i < segments.size(); ++i) {
+    auto const& [name, section] = baseline[i];
+    CHECK(segments[i].address_ == section.addr_);
+    CHECK(segments[i].size_ == section.size_);
+
+    // ELFFile era mkbin read the whole segment from the file offset of its first section
+    std::vector<char> data;
+    for (auto const part : segments[i].parts_) {
+      data.insert(data.end(), part.begin(), part.end());
+      check_sum = esplink::xor_checksum(part, check_sum);
+    }
+    auto const first = content.begin() + section.offset_;
+    CHECK(std::equal(data.begin(), data.end(), first, first + section.size_));
+    baseline_check_sum = std::accumulate(first, first + section.size_, baseline_check_sum,
+                                         [](std::uint8_t const t_sum, char const t_byte) {
+                                           return static_cast<std::uint8_t>(t_sum ^ static_cast<std::uint8_t>(t_byte));
+                                         });
+  }
+  CHECK(check_sum == baseline_check_sum);
+}
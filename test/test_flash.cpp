@@ -1,6 +1,10 @@
 #include "catch2/catch_test_macros.hpp"
 #include "esp_serial/boot_cmd.hpp"
+#include "esp_serial/erase_plan.hpp"
+#include "esp_serial/image_layout.hpp"
 #include "esp_serial/slip.hpp"
+#include "esp_serial/slip_kernel.hpp"
+#include <random>
 #include <range/v3/algorithm/find.hpp>
 #include <range/v3/algorithm/find_if.hpp>
 #include <range/v3/view/sliding.hpp>
@@ -97,3 +101,315 @@ TEST_CASE("slip protocal data is decoded correctly", "[SLIP]") {
   CHECK_THROWS_AS(slip.decode_packet(buffer_with_error_status.begin(), buffer_with_error_status.size()),
                   std::runtime_error);
 }
+
+TEST_CASE("compressed flash commands share packet layout with uncompressed ones", "[SLIP]") {
+  esplink::ESPSLIP slip;
+
+  constexpr auto BUFFER_SIZE = 16U;
+  std::array<char, BUFFER_SIZE> buffer{1, 2, 3, 4};
+
+  esplink::command::FLASH_DATA<BUFFER_SIZE> const flash_data{4, 1, buffer};
+  esplink::command::FLASH_DEFL_DATA<BUFFER_SIZE> const flash_defl_data{flash_data};
+
+  auto const packet      = slip.generate_packet(flash_data);
+  auto const defl_packet = slip.generate_packet(flash_defl_data);
+  REQUIRE(packet.size() == defl_packet.size());
+  CHECK(defl_packet[2] == esplink::command::FLASH_DEFL_DATA<BUFFER_SIZE>::COMMAND_BYTE);
+  CHECK(std::equal(packet.begin() + 3, packet.end(), defl_packet.begin() + 3));
+
+  auto const begin_packet = slip.generate_packet(esplink::command::FLASH_DEFL_BEGIN{{0x1000, 1, 0x1000, 0}});
+  CHECK(begin_packet[2] == esplink::command::FLASH_DEFL_BEGIN::COMMAND_BYTE);
+}
+
+TEST_CASE("stub responses carry 2 status bytes", "[SLIP]") {
+  esplink::ESPSLIP slip;
+  slip.set_status_size(esplink::ESPSLIP::STUB_STATUS_SIZE);
+
+  std::vector<std::uint8_t> const buffer{0xC0, 0x1, 0x6, 0x2, 0, 0, 0, 0, 0, 0, 0};
+  auto const result = slip.decode_packet(buffer.begin(), buffer.size());
+  CHECK(result.command_ == esplink::command::MEM_END::COMMAND_BYTE);
+
+  std::vector<std::uint8_t> const buffer_with_error_status{0xC0, 0x1, 0x6, 0x2, 0, 0, 0, 0, 0, 0x1, 0x5};
+  CHECK_THROWS_AS(slip.decode_packet(buffer_with_error_status.begin(), buffer_with_error_status.size()),
+                  std::runtime_error);
+}
+
+namespace {
+
+// hides header() and payload(), so that packet data is built by operator() and checksum by check_sum()
+template <typename Command>
+struct WholePacketData {
+  Command data_;
+
+  static constexpr auto NAME         = Command::NAME;
+  static constexpr auto COMMAND_BYTE = Command::COMMAND_BYTE;
+
+  [[nodiscard]] auto check_sum() const noexcept { return this->data_.check_sum(); }
+  auto operator()() const noexcept { return this->data_(); }
+};
+
+}  // namespace
+
+TEST_CASE("single pass framing of data packets matches framing of whole packet data", "[SLIP]") {
+  constexpr auto BUFFER_SIZE = 64U;
+  using FlashData            = esplink::command::FLASH_DATA<BUFFER_SIZE>;
+
+  std::array<char, BUFFER_SIZE> buffer{};
+  for (std::size_t i = 0; i < buffer.size(); ++i) {
+    buffer[i] = static_cast<char>(0xC0 + i % 0x20);
+  }
+
+  esplink::ESPSLIP slip;
+  esplink::ESPSLIP::Frame frame;
+  for (std::uint32_t size = 0; size <= BUFFER_SIZE; size += 7) {
+    FlashData const flash_data{size, size, buffer};
+    slip.encode_packet(frame, flash_data);
+
+    auto const expected = slip.generate_packet(WholePacketData<FlashData>{flash_data});
+    REQUIRE(frame.size() == expected.size());
+    CHECK(std::equal(frame.header_.begin(), frame.header_.end(), expected.begin()));
+    CHECK(std::equal(frame.body().begin(), frame.body().end(), expected.begin() + std::ssize(frame.header_)));
+  }
+}
+
+TEST_CASE("vectorized slip kernels are equivalent to scalar kernels", "[SLIP]") {
+  using esplink::slip::ESC;
+  using esplink::slip::END;
+
+  // mostly plain bytes with bursts of special bytes, so that both clean strides and escapes are exercised
+  std::mt19937 gen{0x5EED};
+  std::uniform_int_distribution<int> dist{0, 255};
+  auto const random_data = [&](std::size_t t_size) {
+    std::vector<std::uint8_t> ret_val(t_size);
+    for (auto& byte : ret_val) {
+      auto const value = dist(gen);
+      byte             = value < 8 ? END : (value < 16 ? ESC : static_cast<std::uint8_t>(value));
+    }
+    return ret_val;
+  };
+
+  using EscapeKernel   = std::uint8_t* (*)(std::uint8_t const*, std::uint8_t const*, std::uint8_t*, std::uint8_t&);
+  using UnescapeKernel = esplink::slip::UnescapeResult (*)(std::uint8_t const*, std::uint8_t const*, std::uint8_t*);
+  std::vector<std::pair<EscapeKernel, UnescapeKernel>> kernels{{esplink::slip::escape, esplink::slip::unescape}};
+#if ESPLINK_X86_KERNEL
+  kernels.emplace_back(esplink::slip::escape_sse2, esplink::slip::unescape_sse2);
+  if (esplink::has_avx2()) {
+    kernels.emplace_back(esplink::slip::escape_avx2, esplink::slip::unescape_avx2);
+  }
+#endif
+
+  for (std::size_t const size : {0U, 1U, 15U, 16U, 17U, 31U, 32U, 33U, 100U, 4096U}) {
+    auto const data         = random_data(size);
+    auto const* const first = data.data();
+    auto const* const last  = data.data() + data.size();
+
+    std::vector<std::uint8_t> expected(2 * size);
+    std::uint8_t expected_check_sum = 0xEF;
+    auto const* const expected_end  = esplink::slip::escape_scalar(first, last, expected.data(), expected_check_sum);
+    expected.resize(static_cast<std::size_t>(expected_end - expected.data()));
+    CHECK(std::find(expected.begin(), expected.end(), END) == expected.end());
+
+    for (auto const& [escape, unescape] : kernels) {
+      std::vector<std::uint8_t> escaped(2 * size);
+      std::uint8_t check_sum = 0xEF;
+      escaped.resize(static_cast<std::size_t>(escape(first, last, escaped.data(), check_sum) - escaped.data()));
+      CHECK(escaped == expected);
+      CHECK(check_sum == expected_check_sum);
+
+      std::vector<std::uint8_t> unescaped(escaped.size());
+      auto const result = unescape(escaped.data(), escaped.data() + escaped.size(), unescaped.data());
+      unescaped.resize(static_cast<std::size_t>(result.out_ - unescaped.data()));
+      CHECK(result.in_ == escaped.data() + escaped.size());
+      CHECK(unescaped == data);
+    }
+  }
+
+  SECTION("dangling escape is left for the next chunk") {
+    std::vector<std::uint8_t> const data(40, ESC);
+    for (auto const& [escape, unescape] : kernels) {
+      std::vector<std::uint8_t> unescaped(data.size());
+      auto const result = unescape(data.data(), data.data() + data.size() - 1, unescaped.data());
+      CHECK(result.in_ == data.data() + data.size() - 2);
+      CHECK(result.out_ - unescaped.data() == 19);
+    }
+  }
+
+  SECTION("invalid escape drops ESC and keeps the byte after it") {
+    constexpr std::uint8_t INVALID = 0x41;
+    std::vector<std::uint8_t> data(40, 0x55);
+    for (std::size_t const pos : {3U, 20U, 38U}) {
+      data[pos]     = ESC;
+      data[pos + 1] = INVALID;
+    }
+
+    auto expected = data;
+    std::erase(expected, ESC);
+    kernels.emplace_back(esplink::slip::escape_scalar, esplink::slip::unescape_scalar);
+    for (auto const& [escape, unescape] : kernels) {
+      std::vector<std::uint8_t> unescaped(data.size());
+      auto const result = unescape(data.data(), data.data() + data.size(), unescaped.data());
+      unescaped.resize(static_cast<std::size_t>(result.out_ - unescaped.data()));
+      CHECK(result.in_ == data.data() + data.size());
+      CHECK(unescaped == expected);
+    }
+  }
+}
+
+TEST_CASE("streaming decoder yields the same frames however the input is split", "[SLIP]") {
+  using esplink::ESPSLIP;
+
+  constexpr auto END     = ESPSLIP::SLIP_END;
+  constexpr auto ESC     = ESPSLIP::SLIP_ESC;
+  constexpr auto ESC_END = ESPSLIP::SLIP_ESC_END;
+  constexpr auto ESC_ESC = ESPSLIP::SLIP_ESC_ESC;
+
+  // garbage, a response containing escaped bytes, an empty frame, then a second response
+  std::vector<std::uint8_t> const stream{0x12, 0x34, ESC, END,                                      //
+                                         0x1, 0x8, 0x6, 0x0, 0x1, 0x2, 0x3, 0x4,                    //
+                                         ESC, ESC_END, ESC, ESC_ESC, 0x0, 0x0, 0x0, 0x0, END, END,  //
+                                         END, 0x1, 0xA, 0x4, 0x0, 0x1, 0x2, 0x3, 0x4, 0x0, 0x0, 0x0, 0x0, END};
+
+  auto const decode = [&](std::size_t t_chunk_size) {
+    ESPSLIP::Decoder decoder;
+    std::vector<std::vector<std::uint8_t>> frames;
+    for (std::size_t i = 0; i < stream.size(); i += t_chunk_size) {
+      auto const chunk = std::span{stream}.subspan(i, std::min(t_chunk_size, stream.size() - i));
+      decoder.feed(chunk, [&](auto t_frame) { frames.emplace_back(t_frame.begin(), t_frame.end()); });
+    }
+    return frames;
+  };
+
+  auto const frames = decode(stream.size());
+  REQUIRE(frames.size() == 2);
+  CHECK(frames[0] == std::vector<std::uint8_t>{0x1, 0x8, 0x6, 0x0, 0x1, 0x2, 0x3, 0x4, END, ESC, 0x0, 0x0, 0x0, 0x0});
+  CHECK(frames[1].size() == 12);
+
+  // every split point, in particular the one between ESC and ESC_END, has to give the same result
+  for (std::size_t chunk_size = 1; chunk_size < stream.size(); ++chunk_size) {
+    CHECK(decode(chunk_size) == frames);
+  }
+
+  ESPSLIP const slip;
+  CHECK(slip.is_response(frames[0], esplink::command::SYNC::COMMAND_BYTE));
+  CHECK_FALSE(slip.is_response(frames[0], esplink::command::READ_REG<0>::COMMAND_BYTE));
+  CHECK(slip.decode_frame(frames[1]).value_ == 0x0403'0201);
+}
+
+TEST_CASE("erase plan uses block erase for whole blocks and never erases outside of ranges", "[ErasePlan]") {
+  using esplink::ErasePlan;
+  using esplink::FlashRange;
+
+  // unaligned, overlapping and touching ranges are rounded out to sectors and merged, disjoint ones are kept apart
+  std::vector<FlashRange> const ranges{{0x0F800, 0x1000}, {0x10000, 0x25000}, {0x35000, 0x100}, {0x80000, 0x20000}};
+  ErasePlan const plan{ranges};
+
+  REQUIRE(plan.ranges().size() == 2);
+  CHECK(plan.ranges()[0] == FlashRange{0x0F000, 0x27000});
+  CHECK(plan.ranges()[1] == FlashRange{0x80000, 0x20000});
+
+  using Run                     = ErasePlan::Run;
+  std::vector<Run> const expect = {{{0x0F000, 0x1000}, false}, {{0x10000, 0x20000}, true},
+                                   {{0x30000, 0x6000}, false}, {{0x80000, 0x20000}, true}};
+  CHECK(std::vector<Run>(plan.runs().begin(), plan.runs().end()) == expect);
+  CHECK(plan.sector_count() == 7);
+  CHECK(plan.block_count() == 4);
+  CHECK(plan.erase_size() == 0x47000);
+  CHECK(plan.timeout() == 7 * ErasePlan::SECTOR_ERASE_TIME + 4 * ErasePlan::BLOCK_ERASE_TIME);
+
+  // a range within one block is erased by sectors, and small erases are still given time for the round trip
+  CHECK(ErasePlan::timeout(0x11000, 0x2000) == ErasePlan::MIN_TIMEOUT);
+  CHECK(ErasePlan{std::vector<FlashRange>{{0x11000, 0xE000}}}.block_count() == 0);
+  CHECK(ErasePlan{std::vector<FlashRange>{}}.runs().empty());
+}
+
+namespace {
+struct FakeImage {
+  std::string name_;
+  std::uint32_t offset_;
+  std::uint32_t size_;
+
+  [[nodiscard]] std::string const& name() const { return this->name_; }
+  [[nodiscard]] std::uint32_t offset() const { return this->offset_; }
+  [[nodiscard]] std::uint32_t size() const { return this->size_; }
+};
+}  // namespace
+
+TEST_CASE("images are sorted by offset and must not share a sector", "[ImageLayout]") {
+  SECTION("images apart from each other") {
+    std::vector<FakeImage> images{{"app", 0x10000, 0x12345}, {"boot", 0x1000, 0x7000}, {"table", 0x8000, 0x1000}};
+    CHECK_NOTHROW(esplink::check_overlap(images));
+    CHECK(images[0].name_ == "boot");
+    CHECK(images[1].name_ == "table");
+    CHECK(images[2].name_ == "app");
+  }
+
+  SECTION("overlap") {
+    std::vector<FakeImage> images{{"app", 0x10000, 0x12345}, {"data", 0x20000, 0x1000}};
+    CHECK_THROWS_AS(esplink::check_overlap(images), std::invalid_argument);
+  }
+
+  SECTION("shared sector") {
+    // boot ends in the sector before table, table and data are apart but share the sector at 0x9000
+    std::vector<FakeImage> images{{"boot", 0x1000, 0x7001}, {"table", 0x9000, 0x800}};
+    CHECK_NOTHROW(esplink::check_overlap(images));
+
+    images.push_back({"data", 0x9C00, 0x100});
+    CHECK_THROWS_AS(esplink::check_overlap(images), std::invalid_argument);
+  }
+}
+
+TEST_CASE("image file is given as hex offset and path", "[ImageLayout]") {
+  SECTION("with and without 0x prefix") {
+    for (auto const* arg : {"0x10000:app.bin", "0X10000:app.bin", "10000:app.bin"}) {
+      INFO(arg);
+      auto const image = esplink::parse_image_file(arg);
+      REQUIRE(image.has_value());
+      CHECK(image->offset_ == 0x10000);
+      CHECK(image->path_ == "app.bin");
+    }
+  }
+
+  SECTION("path may contain colon") {
+    auto const image = esplink::parse_image_file("0x8000:C:/table.bin");
+    REQUIRE(image.has_value());
+    CHECK(image->offset_ == 0x8000);
+    CHECK(image->path_ == "C:/table.bin");
+  }
+
+  SECTION("bad hex") {
+    auto const bad_args = {"app.bin", ":app.bin", "0x:app.bin", "0x10g00:app.bin", "-10:app.bin", "123456789:app.bin"};
+    for (auto const* arg : bad_args) {
+      INFO(arg);
+      CHECK_FALSE(esplink::parse_image_file(arg).has_value());
+    }
+  }
+}
+
+TEST_CASE("range to erase is given as hex offset and size", "[ImageLayout]") {
+  SECTION("with and without 0x prefix") {
+    for (auto const* arg : {"0x10000:0x2000", "0X10000:0X2000", "10000:2000"}) {
+      INFO(arg);
+      auto const range = esplink::parse_flash_range(arg);
+      REQUIRE(range.has_value());
+      CHECK(*range == esplink::FlashRange{0x10000, 0x2000});
+    }
+  }
+
+  SECTION("bad range") {
+    auto const bad_args = {"0x10000", "0x10000:", ":0x1000", "0x10000:0", "0x10000:0x1000:0x1000", "0x10000:-1000",
+                           "0x10000:123456789"};
+    for (auto const* arg : bad_args) {
+      INFO(arg);
+      CHECK_FALSE(esplink::parse_flash_range(arg).has_value());
+    }
+  }
+}
+
+TEST_CASE("regions are split into segments only at sector aligned offset", "[ImageLayout]") {
+  using esplink::Region;
+
+  std::vector<Region> const regions{{0, 0x25000}, {0x30000, 0x100}};
+  std::vector<Region> const segments{{0, 0x10000}, {0x10000, 0x10000}, {0x20000, 0x5000}, {0x30000, 0x100}};
+  CHECK(esplink::split_into_segments(regions, 0x10000, 0x10000) == segments);
+  CHECK(esplink::split_into_segments(regions, 0x10800, 0x10000) == regions);
+}
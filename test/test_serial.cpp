@@ -0,0 +1,555 @@
+#include "catch2/catch_test_macros.hpp"
+#include "esp_common/compress.hpp"
+#include "esp_common/md5.hpp"
+#include "esp_flash/daemon.hpp"
+#include "esp_flash/image_store.hpp"
+#include "esp_serial/boot_cmd.hpp"
+#include "esp_serial/link_estimator.hpp"
+#include "esp_serial/metrics.hpp"
+#include "esp_serial/serial_port.hpp"
+#include "esp_serial/slip.hpp"
+#include "esp_sim/rom_simulator.hpp"
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <thread>
+
+using namespace std::chrono_literals;
+using Loader = esplink::Serial<esplink::ESPSLIP>;
+
+namespace {
+
+constexpr std::uint32_t BLOCK_SIZE  = 0x400;
+constexpr std::uint32_t IMAGE_SIZE  = 0x10000;
+constexpr std::uint32_t FLASH_START = 0x10000;
+
+auto make_image() {
+  std::mt19937 gen{IMAGE_SIZE};
+  std::uniform_int_distribution<int> dist{0, UINT8_MAX};
+  std::vector<char> image(IMAGE_SIZE);
+  std::generate(image.begin(), image.end(), [&] { return static_cast<char>(dist(gen)); });
+  return image;
+}
+
+template <typename DataCommand>
+auto split_into_blocks(std::span<char const> const t_data) {
+  std::vector<DataCommand> blocks;
+  for (std::uint32_t offset = 0; offset < t_data.size(); offset += BLOCK_SIZE) {
+    auto const size     = std::min<std::uint32_t>(BLOCK_SIZE, static_cast<std::uint32_t>(t_data.size()) - offset);
+    auto const sequence = offset / BLOCK_SIZE;
+    auto const block    = esplink::command::FLASH_DATA<BLOCK_SIZE>{size, sequence, t_data.subspan(offset, size)};
+    blocks.push_back(DataCommand{block});
+  }
+
+  return blocks;
+}
+
+auto flash_content(esplink::sim::RomSimulator const& t_simulator, std::size_t const t_size) {
+  auto const flash = t_simulator.flash();
+  auto const first = flash.begin() + FLASH_START;
+  return std::vector<char>(first, first + static_cast<std::ptrdiff_t>(t_size));
+}
+
+}  // namespace
+
+TEST_CASE("serial talks to ROM loader simulator", "[Serial]") {
+  esplink::sim::RomSimulator simulator;
+  Loader loader{simulator.port()};
+
+  loader.transceive(esplink::command::SYNC(), 5);
+  auto const chip_id = loader.transceive(esplink::command::READ_REG<0x4000'1000>(), 5);
+  CHECK(chip_id.value_ == esplink::to_underlying(esplink::ChipID::ESP32_C3_ECO3));
+
+  auto const header = loader.transceive(esplink::command::FLASH_READ_SLOW{0, 4}, 5);
+  REQUIRE(header.data_.size() >= 4);  // followed by status bytes
+  CHECK(header.data_.front() == esplink::ESP32_MAGIC_NUMBER);
+
+  auto const image = make_image();
+  simulator.load_flash(FLASH_START, std::vector<std::uint8_t>(image.begin(), image.end()));
+  auto const digest   = loader.transceive(esplink::command::SPI_FLASH_MD5{FLASH_START, IMAGE_SIZE}, 5, 1000ms);
+  auto const expected = fmt::format("{:02x}", fmt::join(esplink::MD5::compute(image), ""));
+  REQUIRE(digest.data_.size() >= expected.size());
+  CHECK(std::string(digest.data_.begin(), digest.data_.begin() + std::ssize(expected)) == expected);
+}
+
+TEST_CASE("pipelined flashing survives dropped, refused and garbled packets", "[Serial]") {
+  auto strict = false;
+  SECTION("loader writing at its running write pointer") {}
+  SECTION("loader writing by sequence number") { strict = true; }
+
+  esplink::sim::RomSimulator simulator{
+    {.drop_rate_ = 0.05, .error_rate_ = 0.05, .garbage_rate_ = 0.05, .seed_ = 1, .strict_sequence_ = strict}};
+  Loader loader{simulator.port()};
+
+  // single commands are refused now and then as well, transceive only retries on timeout
+  auto const transceive = [&](auto const& t_cmd) {
+    for (int attempt = 1;; ++attempt) {
+      try {
+        return loader.transceive(t_cmd, 5, 200ms);
+      } catch (std::runtime_error& /**/) {
+        if (attempt == 5) {
+          throw;
+        }
+      }
+    }
+  };
+
+  auto const image = make_image();
+  auto const count = IMAGE_SIZE / BLOCK_SIZE;
+  transceive(esplink::command::SYNC());
+
+  // unless loader writes by sequence number, a lost block shifts responses behind it, so the failed block can't be told
+  // nor sent again, sectors that differ from image are written again instead, like esp-flash does
+  constexpr std::uint32_t SECTOR_SIZE = esplink::sim::RomSimulator::SECTOR_SIZE;
+  std::vector<std::pair<std::uint32_t, std::uint32_t>> to_write{{0, IMAGE_SIZE}};
+  for (int round = 1; not to_write.empty(); ++round) {
+    REQUIRE(round < 50);
+    try {
+      for (auto const& [offset, size] : to_write) {
+        auto const blocks = split_into_blocks<esplink::command::FLASH_DATA<BLOCK_SIZE>>(
+          std::span{image}.subspan(offset, size));
+        transceive(esplink::command::FLASH_BEGIN{size, static_cast<std::uint32_t>(blocks.size()), BLOCK_SIZE,
+                                                 FLASH_START + offset});
+        loader.transceive_pipelined(blocks, 4, strict ? 5 : 1, 200ms);
+      }
+      to_write.clear();
+    } catch (esplink::PipelineError const& /**/) {
+      REQUIRE_FALSE(strict);
+      to_write.clear();
+      for (std::uint32_t offset = 0; offset < IMAGE_SIZE; offset += SECTOR_SIZE) {
+        auto const sector   = std::span{image}.subspan(offset, SECTOR_SIZE);
+        auto const expected = fmt::format("{:02x}", fmt::join(esplink::MD5::compute(sector), ""));
+        auto const digest   = transceive(esplink::command::SPI_FLASH_MD5{FLASH_START + offset, SECTOR_SIZE});
+        if (std::string(digest.data_.begin(), digest.data_.begin() + std::ssize(expected)) != expected) {
+          to_write.emplace_back(offset, SECTOR_SIZE);
+        }
+      }
+    }
+  }
+  transceive(esplink::command::FLASH_END<esplink::command::FlashEndOption::Reboot>());
+
+  CHECK(flash_content(simulator, image.size()) == image);
+
+  auto const stats = simulator.stats();
+  CHECK(stats.dropped_ + stats.failed_ + stats.garbled_ > 0);
+
+  auto const& data = loader.metrics().commands().at(esplink::command::FLASH_DATA<BLOCK_SIZE>::COMMAND_BYTE);
+  CHECK(data.name_ == "FLASH_DATA");
+  CHECK(data.round_trip_.count() == data.responses_);
+  CHECK(data.escape_bytes_ > 0);
+  CHECK(data.wire_bytes_ > data.requests_ * BLOCK_SIZE);
+  CHECK(loader.metrics().received_bytes() > 0);
+
+  // every block is acknowledged once, every failure is charged a retry, blocks sent after a failed one are sent again
+  // without being charged
+  if (strict) {
+    CHECK(data.responses_ == count);
+    CHECK(data.retries_ == data.timeouts_ + data.errors_);
+    CHECK(data.retries_ > 0);
+    CHECK(data.requests_ >= data.responses_ + data.retries_);
+  } else {
+    CHECK(data.responses_ > count);
+    CHECK(data.retries_ == 0);
+    CHECK(data.timeouts_ + data.errors_ > 0);
+  }
+}
+
+TEST_CASE("pipelined and single requests count retry as attempts alike", "[Serial]") {
+  esplink::sim::RomSimulator simulator{{.drop_rate_ = 1.0}};
+  Loader loader{simulator.port()};
+
+  auto const image  = make_image();
+  auto const blocks = split_into_blocks<esplink::command::FLASH_DATA<BLOCK_SIZE>>(image);
+  CHECK_THROWS(loader.transceive(esplink::command::SYNC(), 2, 50ms));
+  CHECK_THROWS(loader.transceive_pipelined(blocks, 1, 2, 50ms));
+
+  auto const& commands = loader.metrics().commands();
+  CHECK(commands.at(esplink::command::SYNC::COMMAND_BYTE).requests_ == 2);
+  CHECK(commands.at(esplink::command::FLASH_DATA<BLOCK_SIZE>::COMMAND_BYTE).requests_ == 2);
+}
+
+TEST_CASE("compressed flashing is inflated by ROM loader simulator", "[Serial]") {
+  esplink::sim::RomSimulator simulator;
+  Loader loader{simulator.port()};
+
+  std::vector<char> image(IMAGE_SIZE);
+  for (std::size_t i = 0; i < image.size(); ++i) {
+    image[i] = static_cast<char>(i / BLOCK_SIZE);
+  }
+
+  auto const compressed = esplink::zlib_compress(image);
+  auto const blocks     = split_into_blocks<esplink::command::FLASH_DEFL_DATA<BLOCK_SIZE>>(compressed);
+  auto const count      = static_cast<std::uint32_t>(blocks.size());
+
+  loader.transceive(esplink::command::SYNC(), 5);
+  loader.transceive(esplink::command::FLASH_DEFL_BEGIN{{IMAGE_SIZE, count, BLOCK_SIZE, FLASH_START}}, 5);
+  loader.transceive_pipelined(blocks, 4, 2, 200ms);
+  loader.transceive(esplink::command::FLASH_DEFL_END<esplink::command::FlashEndOption::Reboot>(), 5);
+
+  CHECK(flash_content(simulator, image.size()) == image);
+}
+
+TEST_CASE("devices on one io_context are flashed concurrently", "[Serial]") {
+  constexpr std::size_t DEVICE_COUNT = 4;
+  std::vector<std::unique_ptr<esplink::sim::RomSimulator>> simulators;
+  for (std::size_t i = 0; i < DEVICE_COUNT; ++i) {
+    simulators.push_back(std::make_unique<esplink::sim::RomSimulator>(
+      esplink::sim::SimulatorOption{.byte_latency_ = 1us, .turnaround_ = 200us}));
+  }
+
+  // every device is given its own image, so that a response delivered to the wrong device shows up in flash
+  std::vector<std::vector<char>> images;
+  for (std::size_t i = 0; i < DEVICE_COUNT; ++i) {
+    auto image = make_image();
+    auto const key = static_cast<char>(i);
+    std::ranges::transform(image, image.begin(), [key](char t_byte) { return static_cast<char>(t_byte ^ key); });
+    images.push_back(std::move(image));
+  }
+
+  boost::asio::io_context context;
+  std::vector<std::unique_ptr<Loader>> loaders;
+  for (auto const& simulator : simulators) {
+    loaders.push_back(std::make_unique<Loader>(context, simulator->port()));
+  }
+
+  auto const flash = [](Loader& t_loader, std::vector<char> const& t_image) -> boost::asio::awaitable<void> {
+    auto const blocks = split_into_blocks<esplink::command::FLASH_DATA<BLOCK_SIZE>>(t_image);
+    auto const count  = static_cast<std::uint32_t>(blocks.size());
+
+    co_await t_loader.async_transceive(esplink::command::SYNC(), 5);
+    co_await t_loader.async_transceive(esplink::command::FLASH_BEGIN{IMAGE_SIZE, count, BLOCK_SIZE, FLASH_START}, 5);
+    co_await t_loader.async_transceive_pipelined(blocks, 4, 1, 200ms);
+    co_await t_loader.async_transceive(esplink::command::FLASH_END<esplink::command::FlashEndOption::Reboot>(), 5);
+    co_await t_loader.async_close();
+  };
+
+  std::vector<std::exception_ptr> errors(DEVICE_COUNT);
+  for (std::size_t i = 0; i < DEVICE_COUNT; ++i) {
+    boost::asio::co_spawn(context, flash(*loaders[i], images[i]),
+                          [&errors, i](std::exception_ptr const& t_error) { errors[i] = t_error; });
+  }
+  context.run();
+
+  for (std::size_t i = 0; i < DEVICE_COUNT; ++i) {
+    INFO(i);
+    if (errors[i] != nullptr) {
+      CHECK_NOTHROW(std::rethrow_exception(errors[i]));
+    }
+    CHECK(flash_content(*simulators[i], IMAGE_SIZE) == images[i]);
+  }
+}
+
+TEST_CASE("link estimator fits round trip to overhead and cost per byte", "[Serial]") {
+  using Seconds = esplink::LinkEstimator::Seconds;
+  esplink::LinkEstimator link;
+  CHECK(link.timeout(100, 1500ms) == 1500ms);
+
+  constexpr auto OVERHEAD = 2e-3;
+  constexpr auto PER_BYTE = 10e-6;
+  for (std::size_t bytes : {16U, 4096U, 64U, 1024U, 32U, 2048U, 128U, 4096U}) {
+    auto const round_trip = Seconds{OVERHEAD + PER_BYTE * static_cast<double>(bytes)};
+    link.add_sample(bytes, std::chrono::duration_cast<std::chrono::steady_clock::duration>(round_trip));
+  }
+
+  REQUIRE(link.ready());
+  CHECK(std::abs(link.overhead().count() - OVERHEAD) < 1e-4);
+  CHECK(std::abs(link.per_byte().count() - PER_BYTE) < 1e-7);
+
+  auto const timeout = link.timeout(4096, 1500ms);
+  CHECK(timeout >= std::chrono::ceil<std::chrono::milliseconds>(link.predict(4096)));
+  CHECK(timeout < 1500ms);
+  CHECK(link.timeout(16, 1500ms) == esplink::LinkEstimator::MIN_TIMEOUT);
+
+  link.back_off();
+  CHECK(link.timeout(4096, 1500ms) >= 2 * timeout - 1ms);
+
+  CHECK(link.byte_error_rate() == 0);
+  link.add_loss(4096);
+  CHECK(link.byte_error_rate() > 0);
+
+  link.reset(Seconds{PER_BYTE});
+  CHECK_FALSE(link.ready());
+
+  // short requests can't tell cost per byte from overhead, it's never taken lower than wire time then
+  for (std::size_t i = 0; i < 4; ++i) {
+    link.add_sample(16 + i, std::chrono::milliseconds{1});
+  }
+  CHECK(link.predict(4096).count() >= PER_BYTE * 4096);
+}
+
+TEST_CASE("adaptive timeout follows link to ROM loader simulator", "[Serial]") {
+  esplink::sim::RomSimulator simulator{{.byte_latency_ = 10us, .turnaround_ = 500us}};
+  Loader loader{simulator.port()};
+
+  auto const adaptive = esplink::Timeout::adaptive(1000ms, 200ms);
+  CHECK(adaptive.resolve(loader.link(), 64) == 200ms);
+
+  loader.transceive(esplink::command::SYNC(), 5);
+  for (std::uint32_t size : {4U, 16U, 64U, 32U, 8U}) {
+    loader.transceive(esplink::command::FLASH_READ_SLOW{0, size}, 5);
+  }
+
+  REQUIRE(loader.link().ready());
+  CHECK(loader.link().predict(64) > 500us);
+  CHECK(adaptive.resolve(loader.link(), 64) < 1000ms);
+
+  // fixed timeout doesn't follow the link
+  CHECK(esplink::Timeout{1000ms}.resolve(loader.link(), 64) == 1000ms);
+}
+
+TEST_CASE("metrics are exported as JSON and Prometheus text", "[Serial]") {
+  esplink::sim::RomSimulator simulator{{.byte_latency_ = 10us, .turnaround_ = 500us}};
+  std::vector<esplink::PortMetrics> ports;
+  {
+    Loader loader{simulator.port()};
+    loader.transceive(esplink::command::SYNC(), 5);
+    loader.transceive(esplink::command::FLASH_READ_SLOW{0, 4}, 5);
+    ports.push_back({"/dev/tty\"sim\"", loader.metrics()});
+  }
+
+  auto const& sync = ports.front().metrics_.commands().at(esplink::command::SYNC::COMMAND_BYTE);
+  CHECK(sync.requests_ == 1);
+  CHECK(sync.responses_ == 1);
+  CHECK(sync.write_time_.count() == 1);
+  CHECK(sync.first_byte_.count() == 1);
+  CHECK(sync.round_trip_.max() >= sync.first_byte_.max());
+  CHECK(sync.round_trip_.quantile(0.5) >= 500e-6);
+
+  auto const json = esplink::to_json(ports);
+  CHECK(json.find(R"("port": "/dev/tty\"sim\"")") != std::string::npos);
+  CHECK(json.find(R"("command": "SYNC")") != std::string::npos);
+  CHECK(json.find(R"("command": "FLASH_READ_SLOW")") != std::string::npos);
+  CHECK(json.find(R"("le": "+Inf", "count": 1)") != std::string::npos);
+
+  auto const text = esplink::to_prometheus(ports);
+  CHECK(text.find("# TYPE esplink_round_trip_seconds histogram") != std::string::npos);
+  CHECK(text.find(R"(esplink_requests_total{port="/dev/tty\"sim\"",command="SYNC"} 1)") != std::string::npos);
+  CHECK(text.find(R"(esplink_round_trip_seconds_count{port="/dev/tty\"sim\"",command="SYNC"} 1)") !=
+        std::string::npos);
+}
+
+TEST_CASE("flash is streamed by READ_FLASH of flasher stub as long as it is acknowledged", "[Serial]") {
+  auto strict = false;
+  SECTION("stub taking any frame as acknowledgement") {}
+  SECTION("stub taking only acknowledgement") { strict = true; }
+
+  esplink::sim::RomSimulator simulator{{.byte_latency_ = 1us, .stub_ = true, .strict_sequence_ = strict}};
+  Loader loader{simulator.port()};
+  loader.get_protocol().set_status_size(esplink::ESPSLIP::STUB_STATUS_SIZE);
+
+  auto const image = make_image();
+  simulator.load_flash(FLASH_START, std::vector<std::uint8_t>(image.begin(), image.end()));
+
+  constexpr std::uint32_t PACKET_SIZE = 0x1000;
+  constexpr std::uint32_t READ_SIZE   = 3 * PACKET_SIZE + 0x100;
+  loader.transceive(esplink::command::SYNC(), 5);
+  CHECK_THROWS(loader.transceive(esplink::command::FLASH_READ_SLOW{FLASH_START, 4}, 1));
+  loader.transceive(esplink::command::READ_FLASH{FLASH_START, READ_SIZE, PACKET_SIZE, 2}, 1);
+
+  std::vector<char> content;
+  auto const receive = [&] {
+    auto const packet = loader.receive_frame(1000ms);
+    REQUIRE(packet.has_value());
+    CHECK(packet->size() == std::min<std::size_t>(PACKET_SIZE, READ_SIZE - content.size()));
+    content.insert(content.end(), packet->begin(), packet->end());
+  };
+  auto const acknowledge = [&] {
+    loader.send_frame(std::bit_cast<std::array<std::uint8_t, 4>>(static_cast<std::uint32_t>(content.size())));
+  };
+
+  receive();
+  receive();
+  CHECK_FALSE(loader.receive_frame(100ms).has_value());  // nothing beyond the window is sent until acknowledged
+  while (content.size() < READ_SIZE) {
+    acknowledge();
+    receive();
+  }
+  acknowledge();
+
+  auto const digest = loader.receive_frame(1000ms);
+  REQUIRE(digest.has_value());
+  auto const expected = esplink::MD5::compute(std::span{image}.first(READ_SIZE));
+  CHECK(std::equal(digest->begin(), digest->end(), expected.begin(), expected.end()));
+  CHECK(content == std::vector<char>(image.begin(), image.begin() + READ_SIZE));
+}
+
+TEST_CASE("request sent while READ_FLASH streams is taken as acknowledgement, unless strict", "[Serial]") {
+  auto strict = false;
+  SECTION("stub taking any frame as acknowledgement") {}
+  SECTION("stub taking only acknowledgement") { strict = true; }
+
+  esplink::sim::RomSimulator simulator{{.byte_latency_ = 1us, .stub_ = true, .strict_sequence_ = strict}};
+  Loader loader{simulator.port()};
+  loader.get_protocol().set_status_size(esplink::ESPSLIP::STUB_STATUS_SIZE);
+
+  constexpr std::uint32_t PACKET_SIZE = 0x1000;
+  loader.transceive(esplink::command::SYNC(), 5);
+  loader.transceive(esplink::command::READ_FLASH{FLASH_START, 4 * PACKET_SIZE, PACKET_SIZE, 1}, 1);
+  REQUIRE(loader.receive_frame(1000ms).has_value());
+
+  // stream given up on, request sent as if stub was serving requests again
+  if (strict) {
+    CHECK_NOTHROW(loader.transceive(esplink::command::SYNC(), 1, 200ms));
+  } else {
+    CHECK_THROWS(loader.transceive(esplink::command::SYNC(), 1, 200ms));
+  }
+
+  // request read as acknowledgement of everything lets the stream run to its end, after which requests are served
+  loader.discard_input();
+  CHECK_NOTHROW(loader.transceive(esplink::command::SYNC(), 5, 200ms));
+}
+
+TEST_CASE("image is prepared once per flash configuration, and its digests are shared", "[ImageStore]") {
+  auto image      = make_image();
+  image[0]        = static_cast<char>(esplink::ESP32_MAGIC_NUMBER);
+  auto const path = std::filesystem::temp_directory_path() / fmt::format("esp-flash-test-{}.bin", getpid());
+  std::ofstream{path, std::ios::binary}.write(image.data(), std::ssize(image));
+
+  esplink::flash::ImageStore store{{FLASH_START, path}};
+  std::filesystem::remove(path);  // stays mapped
+  constexpr auto CHIP = esplink::ImageHeaderChipID::ESP32C3;
+  auto& as_is         = store.prepare<CHIP>(std::nullopt);
+  auto& patched       = store.prepare<CHIP>(esplink::flash::FlashParams{2, 0x2, 0x1});
+  CHECK(&store.prepare<CHIP>(esplink::flash::FlashParams{2, 0x2, 0x1}) == &patched);
+  CHECK(std::ranges::equal(as_is.data(), image));
+
+  // header is patched in a copy, the rest of the image is the same
+  auto const data = patched.data();
+  CHECK(data[2] == 2);
+  CHECK(data[3] == 0x21);
+  CHECK(data[12] == static_cast<char>(esplink::to_underlying(CHIP)));
+  CHECK(std::equal(data.begin() + 16, data.end(), image.begin() + 16));
+
+  boost::asio::io_context context;
+  std::vector<esplink::Region> const regions{{0, 0x1000}, {0x4000, 0x2345}};
+  auto const pending = patched.digests(context.get_executor(), regions);
+  CHECK(patched.digests(context.get_executor(), regions) == pending);
+
+  std::vector<esplink::MD5::Digest> digests;
+  boost::asio::co_spawn(
+    context, [&]() -> boost::asio::awaitable<void> { digests = *co_await pending->async_get(); },
+    [](std::exception_ptr const& t_error) {
+      if (t_error) {
+        std::rethrow_exception(t_error);
+      }
+    });
+  context.run();
+
+  REQUIRE(digests.size() == regions.size());
+  for (std::size_t i = 0; i < regions.size(); ++i) {
+    CHECK(digests[i] == esplink::MD5::compute(patched.data(regions[i])));
+  }
+}
+
+TEST_CASE("daemon keeps chip connected between jobs sent by clients", "[Daemon]") {
+  esplink::sim::RomSimulator simulator;
+  auto const image = make_image();
+  simulator.load_flash(FLASH_START, std::vector<std::uint8_t>(image.begin(), image.end()));
+
+  auto const socket = std::filesystem::temp_directory_path() / fmt::format("esp-flash-test-{}.sock", getpid());
+  esplink::flash::FlashOption option;
+  option.ports_ = {simulator.port()};
+  {
+    esplink::flash::Daemon daemon{socket, option};
+    CHECK(std::filesystem::is_socket(socket));
+    CHECK_THROWS_AS(esplink::flash::Daemon(socket, option), std::runtime_error);
+
+    std::thread serving{[&daemon] { daemon.run(); }};
+    CHECK(esplink::flash::send_to_daemon(socket, {"erase-region", "0x10000:0x1000", "0x12000:0x1000"}) ==
+          EXIT_SUCCESS);
+    CHECK(esplink::flash::send_to_daemon(socket, {"erase-region", "0x10800:0x1000"}) == EXIT_FAILURE);
+    CHECK(esplink::flash::send_to_daemon(socket, {"serve"}) == EXIT_FAILURE);
+    daemon.stop();
+    serving.join();
+  }
+  CHECK_FALSE(std::filesystem::exists(socket));
+
+  // connected once, before the first job
+  auto const trace = simulator.trace();
+  CHECK(std::ranges::count(trace, esplink::command::SYNC::COMMAND_BYTE, &esplink::sim::RequestRecord::command_) == 1);
+
+  auto expected = image;
+  std::fill_n(expected.begin(), 0x1000, '\xff');
+  std::fill_n(expected.begin() + 0x2000, 0x1000, '\xff');
+  CHECK(flash_content(simulator, IMAGE_SIZE) == expected);
+}
+
+TEST_CASE("flasher stub section losing a MEM_DATA packet is uploaded again from MEM_BEGIN", "[Serial]") {
+  constexpr auto MEM_BEGIN = esplink::command::MEM_BEGIN::COMMAND_BYTE;
+  constexpr auto MEM_DATA  = esplink::command::MEM_DATA<0x1800>::COMMAND_BYTE;
+  constexpr auto STUB_ELF  = "main.elf";
+
+  esplink::sim::SimulatorOption option;
+  SECTION("request lost") { option.drop_request_once_ = MEM_DATA; }
+  // sent again, the packet would be written twice at the running pointer of ROM loader
+  SECTION("response lost") { option.drop_response_once_ = MEM_DATA; }
+
+  esplink::sim::RomSimulator simulator{option};
+  boost::asio::io_context context;
+  Loader loader{context, simulator.port()};
+  auto const upload = [&]() -> boost::asio::awaitable<void> {
+    co_await loader.async_transceive(esplink::command::SYNC(), 5);
+    co_await esplink::flash::upload_stub(loader, STUB_ELF);
+    co_await loader.async_transceive(esplink::command::SYNC(), 1);  // answered by the stub
+    co_await loader.async_close();
+  };
+
+  std::exception_ptr error;
+  boost::asio::co_spawn(context, upload, [&error](std::exception_ptr const& t_error) { error = t_error; });
+  context.run();
+  if (error != nullptr) {
+    CHECK_NOTHROW(std::rethrow_exception(error));
+  }
+
+  esplink::MappedFile const stub{STUB_ELF};
+  auto const sections   = esplink::ELFView<esplink::Format::x86>{stub.data()}.loadable_sections().size();
+  auto const trace      = simulator.trace();
+  auto const mem_begins = std::ranges::count(trace, MEM_BEGIN, &esplink::sim::RequestRecord::command_);
+  CHECK(simulator.stats().dropped_ == 1);
+  CHECK(mem_begins == static_cast<std::ptrdiff_t>(sections) + 1);
+}
+
+TEST_CASE("baudrate is raised to the fastest one the chip keeps up with", "[Serial]") {
+  constexpr auto CHIP_ID = esplink::to_underlying(esplink::ChipID::ESP32_C3_ECO3);
+
+  esplink::sim::SimulatorOption option;
+  std::uint32_t expected_baud = 921'600;
+  int expected_reconnects     = 0;
+  SECTION("first attempt succeeds") {}
+  SECTION("failed attempt is recovered from by reset") {
+    option.max_baud_    = 500'000;
+    expected_baud       = 460'800;
+    expected_reconnects = 1;
+  }
+
+  esplink::sim::RomSimulator simulator{option};
+  boost::asio::io_context context;
+  Loader loader{context, simulator.port()};
+  int reconnects       = 0;
+  auto const reconnect = [&]() -> boost::asio::awaitable<void> {
+    ++reconnects;
+    simulator.reset();
+    co_await loader.async_transceive(esplink::command::SYNC(), 5);
+  };
+
+  std::uint32_t baud      = 0;
+  std::uint32_t host_baud = 0;
+  auto const negotiate    = [&]() -> boost::asio::awaitable<void> {
+    co_await loader.async_transceive(esplink::command::SYNC(), 5);
+    baud      = co_await esplink::flash::negotiate_baud_rate(loader, CHIP_ID, 921'600, false, reconnect);
+    host_baud = loader.get_baud_rate();
+    co_await loader.async_close();
+  };
+
+  std::exception_ptr error;
+  boost::asio::co_spawn(context, negotiate, [&error](std::exception_ptr const& t_error) { error = t_error; });
+  context.run();
+  if (error != nullptr) {
+    CHECK_NOTHROW(std::rethrow_exception(error));
+  }
+
+  CHECK(baud == expected_baud);
+  CHECK(host_baud == expected_baud);
+  CHECK(simulator.baud_rate() == expected_baud);
+  CHECK(reconnects == expected_reconnects);
+}